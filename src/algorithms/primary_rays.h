@@ -0,0 +1,58 @@
+#ifndef PRIMARY_RAYS_H
+#define PRIMARY_RAYS_H
+
+#include <algorithm>
+
+#include "../scene.h"
+#include "../image.h"
+#include "../samplers.h"
+#include "../cameras.h"
+#include "../hash.h"
+
+/// Traces one camera ray per pixel, with a random offset within the pixel. The image is processed in parallel, in tiles
+/// of 8x8 pixels whose rays are traversed together as a packet. Then f(x, y, ray, cone, hit, sampler) is called for each
+/// pixel, where cone is the footprint of the ray, which spans one pixel.
+template <typename F>
+void trace_primary_rays(const Scene& scene, const Image& img, int iter, F f) {
+    constexpr int tile_size = 8;
+    static_assert(tile_size * tile_size <= Bvh::max_packet_size, "Tiles must fit in a ray packet");
+
+    auto kx = 2.0f / (img.width - 1);
+    auto ky = 2.0f / (img.height - 1);
+
+    const int tiles_x = (img.width  + tile_size - 1) / tile_size;
+    const int tiles_y = (img.height + tile_size - 1) / tile_size;
+
+    // Each thread processes a row of tiles at a time, so that the sampler is seeded only once per row
+    #pragma omp parallel for schedule(dynamic)
+    for (int ty = 0; ty < tiles_y; ty++) {
+        UniformSampler sampler(sampler_seed(ty, iter));
+
+        for (int tx = 0; tx < tiles_x; tx++) {
+            const int x0 = tx * tile_size, x1 = std::min(x0 + tile_size, img.width);
+            const int y0 = ty * tile_size, y1 = std::min(y0 + tile_size, img.height);
+
+            Ray rays[tile_size * tile_size];
+            RayCone cones[tile_size * tile_size];
+            Hit hits[tile_size * tile_size];
+            int n = 0;
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++, n++) {
+                    const float u = (x + sampler()) * kx - 1.0f;
+                    const float v = 1.0f - (y + sampler()) * ky;
+                    rays[n]  = scene.camera->gen_ray(u, v);
+                    cones[n] = scene.camera->gen_cone(u, v, kx);
+                }
+            }
+
+            scene.intersect(rays, hits, n);
+
+            for (int y = y0, i = 0; y < y1; y++) {
+                for (int x = x0; x < x1; x++, i++)
+                    f(x, y, rays[i], cones[i], hits[i], sampler);
+            }
+        }
+    }
+}
+
+#endif // PRIMARY_RAYS_H
@@ -6,6 +6,7 @@
 #include "../hash_grid.h"
 #include "../debug.h"
 #include "../intersect.h"
+#include "primary_rays.h"
 #define BASIC_PATH_TRACER 1
 //#define NEXT_EVENT_ESTIMATOR 2
 //#define MULTIPLE_IMPORTANCE_SAMPLING 3
@@ -115,7 +116,7 @@ void NextEventEstimator2(rgb& irradiance, float &pNE, const Material &mat, const
     pBRDF = mat.bsdf->pdf(sampledDir, surf, out);
 }
 
-static rgb eye_trace(Ray ray, const Scene& scene, const PhotonMap& photon_map, Sampler& sampler, int light_path_count) {
+static rgb eye_trace(Ray ray, Hit hit, const Scene& scene, const PhotonMap& photon_map, Sampler& sampler, int light_path_count) {
     static constexpr float offset = 1e-4f;
 
     // TODO: Initialize path variables (see Path Tracing assignment)
@@ -124,7 +125,6 @@ static rgb eye_trace(Ray ray, const Scene& scene, const PhotonMap& photon_map, S
     ray.tmin = offset;
     auto lastMat = Bsdf::Type::Specular;
     while (true) {
-        Hit hit = scene.intersect(ray);
         if (hit.tri < 0) break;
 
         auto surf = scene.surface_params(ray, hit);
@@ -186,6 +186,8 @@ static rgb eye_trace(Ray ray, const Scene& scene, const PhotonMap& photon_map, S
         break; 
         
         }
+
+        hit = scene.intersect(ray);
     }
 
     return color;
@@ -212,7 +214,7 @@ static float estimate_pixel_size(const Scene& scene, int w, int h) {
                 hits[i] = scene.intersect(rays[i]);
             }
             auto eval_distance = [&] (int i, int j) {
-                if (hits[i].tri >= 0 && hits[i].tri == hits[j].tri) {
+                if (hits[i].tri >= 0 && hits[i].tri == hits[j].tri && hits[i].inst == hits[j].inst) {
                     d += length((rays[i].org + hits[i].t * rays[i].dir) -
                                 (rays[j].org + hits[j].t * rays[j].dir));
                     c++;
@@ -240,9 +242,6 @@ void render_ppm(const Scene& scene, Image& img, int iter) {
     if (iter == 1)
         base_radius = 2.0f * estimate_pixel_size(scene, img.width, img.height);
 
-    auto kx = 2.0f / (img.width - 1);
-    auto ky = 2.0f / (img.height - 1);
-
     std::vector<Photon> photons;
 
     // Trace a light path for every pixel
@@ -264,14 +263,8 @@ void render_ppm(const Scene& scene, Image& img, int iter) {
     PhotonMap photon_map(photons, radius);
 
     // Trace the eye paths
-    #pragma omp parallel for schedule(dynamic)
-    for (int y = 0; y < img.height; y++) {
-        UniformSampler sampler(sampler_seed(y, iter));
-
-        for (int x = 0; x < img.width; x++) {
-            auto ray = scene.camera->gen_ray((x + sampler()) * kx - 1.0f, 1.0f - (y + sampler()) * ky);
-            debug_raster(x, y);
-            img(x, y) += atomically(rgba(eye_trace(ray, scene, photon_map, sampler, img.width * img.height), 1.0f));
-        }
-    }
+    trace_primary_rays(scene, img, iter, [&] (int x, int y, const Ray& ray, const RayCone&, const Hit& hit, Sampler& sampler) {
+        debug_raster(x, y);
+        img(x, y) += atomically(rgba(eye_trace(ray, hit, scene, photon_map, sampler, img.width * img.height), 1.0f));
+    });
 }
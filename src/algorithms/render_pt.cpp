@@ -4,6 +4,7 @@
 #include "../cameras.h"
 #include "../hash.h"
 #include "../debug.h"
+#include "primary_rays.h"
 #include <iostream>
 #include <math.h>
 //#define BASIC_PATH_TRACER 1
@@ -36,8 +37,9 @@ void BrdfEstimator()
 
 }
 
-/// Path Tracing with MIS and Russian Roulette.
-static rgb path_trace(Ray ray, const Scene& scene, Sampler& sampler) {
+/// Path Tracing with MIS and Russian Roulette, starting from the given ray and its closest hit. The footprint of the
+/// ray is used to filter the textures, and keeps its spread after each bounce.
+static rgb path_trace(Ray ray, RayCone cone, Hit hit, const Scene& scene, Sampler& sampler) {
     static constexpr float offset = 1e-4f;
     rgb color(0.0f),throughput(1.0f);
 
@@ -47,11 +49,10 @@ static rgb path_trace(Ray ray, const Scene& scene, Sampler& sampler) {
     float sp = 0;
 	float wNE, wBRDF, pBRDF = 1;
     while (true) {
-        Hit hit = scene.intersect(ray);
         if (hit.tri < 0) break;
         
 
-        auto surf = scene.surface_params(ray, hit);
+        auto surf = scene.surface_params(ray, hit, cone);
         auto mat = scene.material(hit);
         auto out = -ray.dir;
 
@@ -109,26 +110,16 @@ static rgb path_trace(Ray ray, const Scene& scene, Sampler& sampler) {
         prevMat = mat.bsdf->type();
         pBRDF = sample.pdf;
 
+        cone = RayCone(cone.width_at(hit.t), cone.spread);
+        hit = scene.intersect(ray);
     }
     return color;
 }
 
 
 void render_pt(const Scene& scene, Image& img, int iter) {
-    auto kx = 2.0f / (img.width - 1);
-    auto ky = 2.0f / (img.height - 1);
-
-    #pragma omp parallel for schedule(dynamic)
-    for (int y = 0; y < img.height; y++) {
-        UniformSampler sampler(sampler_seed(y, iter));
-
-        for (int x = 0; x < img.width; x++) {
-            auto ray = scene.camera->gen_ray(
-                (x + sampler()) * kx - 1.0f,
-                1.0f - (y + sampler()) * ky);
-
-            debug_raster(x, y);
-            img(x, y) += rgba(path_trace(ray, scene, sampler), 1.0f);
-        }
-    }
+    trace_primary_rays(scene, img, iter, [&] (int x, int y, const Ray& ray, const RayCone& cone, const Hit& hit, Sampler& sampler) {
+        debug_raster(x, y);
+        img(x, y) += rgba(path_trace(ray, cone, hit, scene, sampler), 1.0f);
+    });
 }
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <vector>
+
+#include "../scene.h"
+#include "../color.h"
+#include "../samplers.h"
+#include "../hash.h"
+#include "../ray_sort.h"
+#include "primary_rays.h"
+
+/// Number of paths processed by a thread at a time. Every chunk uses its own sampler.
+static constexpr int chunk_size = 4096;
+/// Offset used to avoid self-intersections.
+static constexpr float offset = 1e-4f;
+
+/// Queue of path states, stored as a structure of arrays so that each stage only touches the data it needs.
+struct PathQueue {
+    std::vector<Ray> rays;
+    std::vector<RayCone> cones;     ///< Footprint of the rays, used to filter the textures
+    std::vector<Hit> hits;
+    std::vector<rgb> throughput;
+    std::vector<int> pixels;
+    std::vector<uint8_t> specular;  ///< Set if the last bounce was on a specular surface
+    int size;
+
+    PathQueue() : size(0) {}
+
+    void resize(int n) {
+        rays.resize(n);
+        cones.resize(n);
+        hits.resize(n);
+        throughput.resize(n);
+        pixels.resize(n);
+        specular.resize(n);
+        size = n;
+    }
+};
+
+/// Queue of shadow rays, along with the contribution to add to their pixel if they are not occluded.
+struct ShadowQueue {
+    std::vector<Ray> rays;
+    std::vector<rgb> contribs;
+    std::vector<int> pixels;
+    int size;
+
+    ShadowQueue() : size(0) {}
+
+    void resize(int n) {
+        rays.resize(n);
+        contribs.resize(n);
+        pixels.resize(n);
+        size = n;
+    }
+};
+
+/// Buffers kept between frames, to avoid reallocating them.
+struct WavefrontState {
+    PathQueue paths, next_paths;
+    ShadowQueue shadows, next_shadows;
+    std::vector<uint8_t> keep_path, keep_shadow;
+    std::vector<int> path_offsets, shadow_offsets;
+    std::vector<rgb> colors;
+    RaySorter sorter;
+};
+
+/// Computes the position of every element of a queue that is kept after compaction.
+/// The offsets are stored per chunk, and the function returns the number of elements that are kept.
+static int compact_offsets(const std::vector<uint8_t>& keep, int n, std::vector<int>& offsets) {
+    const int num_chunks = (n + chunk_size - 1) / chunk_size;
+    offsets.resize(num_chunks + 1);
+
+    #pragma omp parallel for
+    for (int c = 0; c < num_chunks; c++) {
+        const int begin = c * chunk_size, end = std::min(n, begin + chunk_size);
+        int count = 0;
+        for (int i = begin; i < end; i++) count += keep[i];
+        offsets[c + 1] = count;
+    }
+
+    offsets[0] = 0;
+    for (int c = 0; c < num_chunks; c++) offsets[c + 1] += offsets[c];
+    return offsets[num_chunks];
+}
+
+/// Moves the elements that are kept to the beginning of the destination queue, preserving their order.
+template <typename F>
+static void compact(const std::vector<uint8_t>& keep, int n, const std::vector<int>& offsets, F move) {
+    const int num_chunks = (n + chunk_size - 1) / chunk_size;
+
+    #pragma omp parallel for
+    for (int c = 0; c < num_chunks; c++) {
+        const int begin = c * chunk_size, end = std::min(n, begin + chunk_size);
+        for (int i = begin, j = offsets[c]; i < end; i++) {
+            if (keep[i]) move(i, j++);
+        }
+    }
+}
+
+/// Moves the elements at the given indices to the beginning of the destination queue, in that order.
+template <typename F>
+static void gather(const int* order, int n, F move) {
+    #pragma omp parallel for
+    for (int j = 0; j < n; j++)
+        move(order[j], j);
+}
+
+/// Shading stage: handles light hits, samples the lights, samples the BSDFs to extend the paths, and applies Russian roulette.
+/// Writes the continuation of each path and its shadow ray at the same index, and flags those that are kept.
+static void shade(const Scene& scene, WavefrontState& state, int bounce, int iter) {
+    auto& paths   = state.paths;
+    auto& next    = state.next_paths;
+    auto& shadows = state.next_shadows;
+    auto& colors  = state.colors;
+    const int n = paths.size;
+    const int num_chunks = (n + chunk_size - 1) / chunk_size;
+
+    next.resize(n);
+    shadows.resize(n);
+    state.keep_path.resize(n);
+    state.keep_shadow.resize(n);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < num_chunks; c++) {
+        UniformSampler sampler(fnv_hash(sampler_seed(c, iter), bounce));
+
+        for (int i = c * chunk_size, end = std::min(n, i + chunk_size); i < end; i++) {
+            state.keep_path[i]   = false;
+            state.keep_shadow[i] = false;
+
+            const Ray& ray = paths.rays[i];
+            const RayCone& cone = paths.cones[i];
+            const Hit& hit = paths.hits[i];
+            if (hit.tri < 0) continue;
+
+            auto surf = scene.surface_params(ray, hit, cone);
+            auto& mat = scene.material(hit);
+            auto out = -ray.dir;
+            auto throughput = paths.throughput[i];
+            const int pixel = paths.pixels[i];
+
+            if (auto light = mat.emitter) {
+                // Direct hits on a light source, only when they cannot be sampled by next event estimation
+                if (surf.entering && paths.specular[i])
+                    colors[pixel] += throughput * light->emission(out, surf.uv.x, surf.uv.y).intensity;
+                continue;
+            }
+            // Materials without BSDFs act like black bodies
+            if (!mat.bsdf) continue;
+
+            // Next event estimation: the contribution is only added if the shadow ray is not occluded
+            const int light_id = std::floor(sampler() * (((float)scene.lights.size()) - 0.01));
+            const float pdf_light = 1.0f / scene.lights.size();
+            auto light_sample = scene.lights[light_id]->sample_direct(surf.point, sampler);
+            const float d = length(light_sample.pos - surf.point);
+            auto light_dir = (light_sample.pos - surf.point) / d;
+            const float pdf_ne = light_sample.pdf_area * (d * d / light_sample.cos) * pdf_light;
+            const float cos = std::max(dot(surf.coords.n, light_dir), 0.0f);
+            auto contrib = mat.bsdf->eval(light_dir, surf, out) * cos * light_sample.intensity / pdf_ne * throughput;
+
+            auto sample = mat.bsdf->sample(sampler, surf, out);
+            if (sample.pdf == 0) continue;
+
+            const bool specular = mat.bsdf->type() == Bsdf::Type::Specular;
+            if (!specular) {
+                shadows.rays[i]     = Ray(surf.point, light_dir, offset, d - offset);
+                shadows.contribs[i] = contrib;
+                shadows.pixels[i]   = pixel;
+                state.keep_shadow[i] = true;
+            }
+
+            throughput *= sample.color / sample.pdf;
+            const float q = 1 - russian_roulette(sample.color / sample.pdf);
+            if (sampler() < q) continue;
+
+            next.rays[i]       = Ray(surf.point, sample.in, offset);
+            next.cones[i]      = RayCone(cone.width_at(hit.t), cone.spread);
+            next.throughput[i] = throughput * (1 / (1 - q));
+            next.pixels[i]     = pixel;
+            next.specular[i]   = specular;
+            state.keep_path[i] = true;
+        }
+    }
+}
+
+/// Renders an image using a wavefront path tracer, equivalent to the path tracer with next event estimation.
+/// All the paths of the image are advanced together, one stage at a time: extension, shading, shadow rays and accumulation.
+/// When sort_rays is set, the shadow and extension rays are reordered by direction and origin before being traced.
+static void trace_wavefront(const Scene& scene, Image& img, int iter, bool sort_rays) {
+    static WavefrontState state;
+    auto& paths = state.paths;
+
+    const int num_pixels = img.width * img.height;
+    state.colors.assign(num_pixels, rgb(0.0f));
+    paths.resize(num_pixels);
+
+    // The first extension stage uses packets of coherent camera rays
+    trace_primary_rays(scene, img, iter, [&] (int x, int y, const Ray& ray, const RayCone& cone, const Hit& hit, Sampler&) {
+        const int i = y * img.width + x;
+        paths.rays[i]       = ray;
+        paths.rays[i].tmin  = offset;
+        paths.cones[i]      = cone;
+        paths.hits[i]       = hit;
+        paths.throughput[i] = rgb(1.0f);
+        paths.pixels[i]     = i;
+        paths.specular[i]   = true;
+    });
+
+    for (int bounce = 0; paths.size > 0; bounce++) {
+        const int n = paths.size;
+        shade(scene, state, bounce, iter);
+
+        // Compact the shadow rays and the paths that are still alive. When rays are sorted, the queues are
+        // compacted in sorted order, so that the traversal loops below read them sequentially.
+        auto move_shadow = [&] (int i, int j) {
+            state.shadows.rays[j]     = state.next_shadows.rays[i];
+            state.shadows.contribs[j] = state.next_shadows.contribs[i];
+            state.shadows.pixels[j]   = state.next_shadows.pixels[i];
+        };
+        auto move_path = [&] (int i, int j) {
+            paths.rays[j]       = state.next_paths.rays[i];
+            paths.cones[j]      = state.next_paths.cones[i];
+            paths.throughput[j] = state.next_paths.throughput[i];
+            paths.pixels[j]     = state.next_paths.pixels[i];
+            paths.specular[j]   = state.next_paths.specular[i];
+        };
+
+        const int num_shadows = compact_offsets(state.keep_shadow, n, state.shadow_offsets);
+        state.shadows.resize(num_shadows);
+        if (sort_rays) {
+            state.sorter.sort(state.next_shadows.rays.data(), n, state.keep_shadow.data());
+            gather(state.sorter.order(), num_shadows, move_shadow);
+        } else {
+            compact(state.keep_shadow, n, state.shadow_offsets, move_shadow);
+        }
+
+        const int num_paths = compact_offsets(state.keep_path, n, state.path_offsets);
+        if (sort_rays) {
+            state.sorter.sort(state.next_paths.rays.data(), n, state.keep_path.data());
+            gather(state.sorter.order(), num_paths, move_path);
+        } else {
+            compact(state.keep_path, n, state.path_offsets, move_path);
+        }
+        paths.size = num_paths;
+
+        // Shadow rays: every pixel has at most one shadow ray per bounce, so there is no conflict when accumulating
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < num_shadows; i++) {
+            if (!scene.occluded(state.shadows.rays[i]))
+                state.colors[state.shadows.pixels[i]] += state.shadows.contribs[i];
+        }
+
+        // Extension
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < num_paths; i++)
+            paths.hits[i] = scene.intersect(paths.rays[i]);
+    }
+
+    #pragma omp parallel for
+    for (int y = 0; y < img.height; y++) {
+        for (int x = 0; x < img.width; x++)
+            img(x, y) += rgba(state.colors[y * img.width + x], 1.0f);
+    }
+}
+
+void render_wavefront(const Scene& scene, Image& img, int iter) {
+    trace_wavefront(scene, img, iter, false);
+}
+
+void render_wavefront_sorted(const Scene& scene, Image& img, int iter) {
+    trace_wavefront(scene, img, iter, true);
+}
@@ -1,11 +1,17 @@
 #include <cassert>
 #include <cmath>
 #include <cfloat>
+#include <climits>
 #include <algorithm>
 #include <memory>
+#include <vector>
 
 #include "bvh.h"
 #include "bbox.h"
+#include "simd.h"
+#include "radix_sort.h"
+#include "morton.h"
+#include "serialize.h"
 
 inline void flag_primitives(const int* prims, int begin, int end, uint8_t* flags, int split) {
     for (int i = begin; i < split; i++) {
@@ -30,13 +36,19 @@ inline void sorted_partition(int* prims, int* tmp, int begin, int end, int split
     std::copy(tmp + begin, tmp + end, prims + begin);
 }
 
-static int find_split(const int* prims, float* tmp_cost, int begin, int end, const BBox* bboxes, BBox& right_bb, float& cost) {
+/// Returns the number of blocks needed to store the primitives of a leaf: the SAH cost of a leaf is expressed in
+/// block intersections, so that leaves can be tuned for SIMD triangle blocks (a block size of 1 gives the usual SAH).
+inline int leaf_blocks(int num_prims, int block_size) {
+    return (num_prims + block_size - 1) / block_size;
+}
+
+static int find_split(const int* prims, float* tmp_cost, int begin, int end, const BBox* bboxes, BBox& right_bb, float& cost, int block_size) {
     BBox cur_bb = BBox::empty();
 
     // Sweep from the left and compute costs
     for (int i = begin; i < end - 1; i++) {
         cur_bb = extend(cur_bb, bboxes[prims[i]]);
-        tmp_cost[i] = (i - begin + 1) * half_area(cur_bb);
+        tmp_cost[i] = leaf_blocks(i - begin + 1, block_size) * half_area(cur_bb);
     }
 
     float min_cost = FLT_MAX;
@@ -49,7 +61,7 @@ static int find_split(const int* prims, float* tmp_cost, int begin, int end, con
     for (int i = end - 1; i > begin; i--) {
         cur_bb = extend(cur_bb, bboxes[prims[i]]);
 
-        const float c = tmp_cost[i - 1] + (end - i) * half_area(cur_bb);
+        const float c = tmp_cost[i - 1] + leaf_blocks(end - i, block_size) * half_area(cur_bb);
         if (c < min_cost) {
             min_bb = cur_bb;
             min_cost = c;
@@ -62,16 +74,118 @@ static int find_split(const int* prims, float* tmp_cost, int begin, int end, con
     return min_split;
 }
 
+/// Runs a function on contiguous chunks of the range [begin, end[ as OpenMP tasks, and waits for all of them to finish.
+template <typename F>
+static void for_each_chunk(int begin, int end, int num_chunks, F f) {
+    const int chunk_size = (end - begin + num_chunks - 1) / num_chunks;
+    for (int c = 0; c < num_chunks; c++) {
+        const int chunk_begin = std::min(end, begin + c * chunk_size);
+        const int chunk_end   = std::min(end, chunk_begin + chunk_size);
+        #pragma omp task firstprivate(c, chunk_begin, chunk_end)
+        f(c, chunk_begin, chunk_end);
+    }
+    #pragma omp taskwait
+}
+
+/// Parallel version of find_split, where each chunk of the list is swept by a different task.
+/// Returns the same split as find_split, since bounding box unions are exact.
+static int find_split_parallel(const int* prims, float* tmp_cost, int begin, int end, const BBox* bboxes, BBox& right_bb, float& cost, int num_chunks, int block_size) {
+    std::vector<BBox> left_bbs(num_chunks), right_bbs(num_chunks);
+    std::vector<BBox> min_bbs(num_chunks);
+    std::vector<float> min_costs(num_chunks);
+    std::vector<int> min_splits(num_chunks);
+
+    // Compute the bounding box of each chunk
+    for_each_chunk(begin, end, num_chunks, [&] (int c, int chunk_begin, int chunk_end) {
+        BBox cur_bb = BBox::empty();
+        for (int i = chunk_begin; i < chunk_end; i++)
+            cur_bb = extend(cur_bb, bboxes[prims[i]]);
+        left_bbs[c] = cur_bb;
+    });
+
+    // Compute the bounding box of everything on the left (resp. right) of each chunk
+    BBox cur_bb = BBox::empty();
+    for (int c = num_chunks - 1; c >= 0; c--) {
+        right_bbs[c] = cur_bb;
+        cur_bb = extend(cur_bb, left_bbs[c]);
+    }
+    cur_bb = BBox::empty();
+    for (int c = 0; c < num_chunks; c++) {
+        auto chunk_bb = left_bbs[c];
+        left_bbs[c] = cur_bb;
+        cur_bb = extend(cur_bb, chunk_bb);
+    }
+
+    // Sweep from the left and compute costs
+    for_each_chunk(begin, end, num_chunks, [&] (int c, int chunk_begin, int chunk_end) {
+        BBox cur_bb = left_bbs[c];
+        for (int i = chunk_begin, n = std::min(chunk_end, end - 1); i < n; i++) {
+            cur_bb = extend(cur_bb, bboxes[prims[i]]);
+            tmp_cost[i] = leaf_blocks(i - begin + 1, block_size) * half_area(cur_bb);
+        }
+    });
+
+    // Sweep from the right and find the minimum cost in each chunk
+    for_each_chunk(begin, end, num_chunks, [&] (int c, int chunk_begin, int chunk_end) {
+        BBox cur_bb = right_bbs[c];
+        min_costs[c]  = FLT_MAX;
+        min_splits[c] = -1;
+        for (int i = chunk_end - 1, n = std::max(chunk_begin, begin + 1); i >= n; i--) {
+            cur_bb = extend(cur_bb, bboxes[prims[i]]);
+
+            const float c_ = tmp_cost[i - 1] + leaf_blocks(end - i, block_size) * half_area(cur_bb);
+            if (c_ < min_costs[c]) {
+                min_bbs[c]    = cur_bb;
+                min_costs[c]  = c_;
+                min_splits[c] = i;
+            }
+        }
+    });
+
+    // Reduce the per-chunk minima in the same order as the sequential sweep
+    float min_cost = FLT_MAX;
+    int min_split = -1;
+    for (int c = num_chunks - 1; c >= 0; c--) {
+        if (min_costs[c] < min_cost) {
+            right_bb  = min_bbs[c];
+            min_cost  = min_costs[c];
+            min_split = min_splits[c];
+        }
+    }
+
+    cost = min_cost;
+    return min_split;
+}
+
+/// Sorts an array in parallel, using OpenMP tasks for each half and merging the results.
+template <typename T, typename Cmp>
+static void parallel_sort(T* begin, T* end, Cmp cmp) {
+    constexpr int task_threshold = 1 << 14;
+    if (end - begin <= task_threshold) {
+        std::sort(begin, end, cmp);
+        return;
+    }
+
+    T* middle = begin + (end - begin) / 2;
+    #pragma omp task
+    parallel_sort(begin, middle, cmp);
+    parallel_sort(middle, end, cmp);
+    #pragma omp taskwait
+    std::inplace_merge(begin, middle, end, cmp);
+}
+
 struct BvhBuilder {
     BvhBuilder(const BBox* bboxes,
                uint8_t* tmp_flags, int** prims,
                Bvh::Node* nodes,
-               int& node_count)
+               int& node_count,
+               int block_size)
         : bboxes(bboxes)
         , tmp_flags(tmp_flags)
         , prims(prims)
         , nodes(nodes)
         , node_count(node_count)
+        , block_size(block_size)
     {}
 
     void build(int node_id) {
@@ -87,6 +201,10 @@ struct BvhBuilder {
         int*   tmp_prims = tmp_storage.get() - begin;
         float* tmp_costs = (float*)tmp_prims; // Save some storage and re-use tmp buffer
 
+        // Large nodes near the root are processed by several tasks
+        const int  num_chunks = std::min(max_chunks(), (end - begin) / chunk_size());
+        const bool parallel   = end - begin > parallel_split_threshold();
+
         // On all three axes, try to split this node
         BBox  right_bb, min_right;
         float min_cost  = FLT_MAX, cost;
@@ -94,7 +212,9 @@ struct BvhBuilder {
         int   min_axis;
 
         for (int i = 0; i < 3; i++) {
-            const int split = find_split(prims[i], tmp_costs, begin, end, bboxes, right_bb, cost);
+            const int split = parallel
+                ? find_split_parallel(prims[i], tmp_costs, begin, end, bboxes, right_bb, cost, num_chunks, block_size)
+                : find_split(prims[i], tmp_costs, begin, end, bboxes, right_bb, cost, block_size);
             if (cost < min_cost) {
                 min_right = right_bb;
                 min_cost  = cost;
@@ -106,23 +226,45 @@ struct BvhBuilder {
         assert(min_split > begin && min_split < end);
 
         // Compare the minimum split cost with the SAH of this node
-        if (min_cost < ((end - begin) - traversal_cost) * half_area(node.min, node.max)) {
+        if (min_cost < (leaf_blocks(end - begin, block_size) - traversal_cost) * half_area(node.min, node.max)) {
             const int axis1 = (min_axis + 1) % 3;
             const int axis2 = (min_axis + 2) % 3;
 
-            flag_primitives(prims[min_axis], begin, end, tmp_flags, min_split);
-            sorted_partition(prims[axis1], tmp_prims, begin, end, min_split, tmp_flags);
-            sorted_partition(prims[axis2], tmp_prims, begin, end, min_split, tmp_flags);
-
-            // Recompute the bounding box of the left child
             BBox min_left = BBox::empty();
-            for (int i = begin; i < min_split; i++) {
-                min_left = extend(min_left, bboxes[prims[min_axis][i]]);
+            if (parallel) {
+                std::unique_ptr<int[]> other_tmp(new int[end - begin]);
+                int* other_tmp_prims = other_tmp.get() - begin;
+
+                for_each_chunk(begin, end, num_chunks, [&] (int, int chunk_begin, int chunk_end) {
+                    flag_primitives(prims[min_axis], chunk_begin, chunk_end, tmp_flags, min_split);
+                });
+
+                #pragma omp task
+                sorted_partition(prims[axis1], tmp_prims, begin, end, min_split, tmp_flags);
+                #pragma omp task
+                sorted_partition(prims[axis2], other_tmp_prims, begin, end, min_split, tmp_flags);
+
+                // Recompute the bounding box of the left child while the lists are partitioned
+                std::vector<BBox> chunk_bbs(num_chunks, BBox::empty());
+                for_each_chunk(begin, min_split, num_chunks, [&] (int c, int chunk_begin, int chunk_end) {
+                    for (int i = chunk_begin; i < chunk_end; i++)
+                        chunk_bbs[c] = extend(chunk_bbs[c], bboxes[prims[min_axis][i]]);
+                });
+                for (auto& bb : chunk_bbs) min_left = extend(min_left, bb);
+            } else {
+                flag_primitives(prims[min_axis], begin, end, tmp_flags, min_split);
+                sorted_partition(prims[axis1], tmp_prims, begin, end, min_split, tmp_flags);
+                sorted_partition(prims[axis2], tmp_prims, begin, end, min_split, tmp_flags);
+
+                // Recompute the bounding box of the left child
+                for (int i = begin; i < min_split; i++) {
+                    min_left = extend(min_left, bboxes[prims[min_axis][i]]);
+                }
             }
 
             int num_nodes;
 
-            //#pragma omp atomic capture
+            #pragma omp atomic capture
             {num_nodes = node_count; node_count += 2;}
 
             // Mark the node as an inner node
@@ -147,9 +289,9 @@ struct BvhBuilder {
 
             bool spawn_task = nodes[smallest_node].num_prims > parallel_threshold();
             if (spawn_task) {
-                BvhBuilder* builder = new BvhBuilder(bboxes, tmp_flags, prims, nodes, node_count);
+                BvhBuilder* builder = new BvhBuilder(bboxes, tmp_flags, prims, nodes, node_count, block_size);
                 builder->allocate_tmp_storage(nodes[smallest_node].num_prims);
-                //#pragma omp task firstprivate(builder, smallest_node)
+                #pragma omp task firstprivate(builder, smallest_node)
                 {
                     builder->build_and_delete(smallest_node);
                 }
@@ -170,6 +312,9 @@ struct BvhBuilder {
     }
 
     static constexpr int parallel_threshold() { return 1000; }
+    static constexpr int parallel_split_threshold() { return 1 << 15; }
+    static constexpr int chunk_size() { return 1 << 12; }
+    static constexpr int max_chunks() { return 64; }
 
     const BBox* bboxes;
 
@@ -179,176 +324,2317 @@ struct BvhBuilder {
 
     Bvh::Node* nodes;
     int& node_count;
+    int block_size;
 };
 
-void Bvh::build(const BBox* bboxes, const float3* centers, int num_tris) {
-    Node& root = nodes[0];
-    root.min = float3(FLT_MAX);
-    root.max = float3(-FLT_MAX);
-    root.first_prim = 0;
-    root.num_prims  = num_tris;
-    num_nodes = 1;
+struct BinnedBvhBuilder {
+    BinnedBvhBuilder(const BBox* bboxes, const float3* centers,
+                     int* prims, int* tmp_prims,
+                     Bvh::Node* nodes,
+                     int& node_count,
+                     int num_bins, int block_size)
+        : bboxes(bboxes)
+        , centers(centers)
+        , prims(prims)
+        , tmp_prims(tmp_prims)
+        , nodes(nodes)
+        , node_count(node_count)
+        , num_bins(num_bins)
+        , block_size(block_size)
+    {}
 
-    // Compute global bounding box
-    #pragma omp parallel
-    {
-        BBox local = BBox::empty();
-        #pragma omp for nowait
-        for (int i = 0; i < num_tris; i++) {
-            local.min = min(bboxes[i].min, local.min);
-            local.max = max(bboxes[i].max, local.max);
+    struct Bin {
+        BBox bb;
+        int count;
+    };
+
+    /// Bins all the primitives of the range [begin, end[, for every axis.
+    void fill_bins(Bin* bins, int begin, int end, const BBox& center_bb) const {
+        for (int i = 0; i < 3 * num_bins; i++) {
+            bins[i].bb = BBox::empty();
+            bins[i].count = 0;
         }
-        #pragma omp critical
-        {
-            root.min = min(local.min, root.min);
-            root.max = max(local.max, root.max);
+
+        const float3 scale = bin_scale(center_bb);
+        for (int i = begin; i < end; i++) {
+            const int prim = prims[i];
+            for (int axis = 0; axis < 3; axis++) {
+                Bin& bin = bins[axis * num_bins + bin_index(centers[prim], center_bb, scale, axis)];
+                bin.bb = extend(bin.bb, bboxes[prim]);
+                bin.count++;
+            }
         }
     }
 
-    prim_ids.reset(new int[num_tris]);
-    std::unique_ptr<int[]> all_prims(new int[2 * num_tris]);
-    int* prims[3] = { prim_ids.get(), all_prims.get(), all_prims.get() + num_tris };
-    #pragma omp parallel for
-    for (int i = 0; i < num_tris; i++) {
-        prims[0][i] = i;
-        prims[1][i] = i;
-        prims[2][i] = i;
+    float3 bin_scale(const BBox& center_bb) const {
+        const float3 extents = center_bb.max - center_bb.min;
+        const float k = num_bins * (1.0f - FLT_EPSILON);
+        return float3(extents.x > 0 ? k / extents.x : 0.0f,
+                      extents.y > 0 ? k / extents.y : 0.0f,
+                      extents.z > 0 ? k / extents.z : 0.0f);
     }
 
-    std::unique_ptr<uint8_t[]> tmp_flags(new uint8_t[num_tris]);
+    int bin_index(const float3& center, const BBox& center_bb, const float3& scale, int axis) const {
+        return std::min(num_bins - 1, int((center[axis] - center_bb.min[axis]) * scale[axis]));
+    }
 
-    BvhBuilder* builder = new BvhBuilder(bboxes, tmp_flags.get(), prims, nodes.get(), num_nodes);
-    builder->allocate_tmp_storage(num_tris);
+    /// Finds the best split of the range [begin, end[ by binning the primitive centers.
+    /// Returns the index of the first bin on the right, or -1 if the centers all fall in the same bin.
+    int find_split(int begin, int end, bool parallel, int num_chunks,
+                   BBox& center_bb, BBox& min_left, BBox& min_right, float& min_cost, int& min_axis) const {
+        // Compute the bounding box of the primitive centers, and fill the bins
+        center_bb = BBox::empty();
+        Bin bins[3 * max_bins()];
+        if (parallel) {
+            std::vector<BBox> chunk_bbs(num_chunks, BBox::empty());
+            for_each_chunk(begin, end, num_chunks, [&] (int c, int chunk_begin, int chunk_end) {
+                for (int i = chunk_begin; i < chunk_end; i++)
+                    chunk_bbs[c] = extend(chunk_bbs[c], centers[prims[i]]);
+            });
+            for (auto& bb : chunk_bbs) center_bb = extend(center_bb, bb);
+
+            std::vector<Bin> chunk_bins(num_chunks * 3 * num_bins);
+            for_each_chunk(begin, end, num_chunks, [&] (int c, int chunk_begin, int chunk_end) {
+                fill_bins(&chunk_bins[c * 3 * num_bins], chunk_begin, chunk_end, center_bb);
+            });
+
+            for (int i = 0; i < 3 * num_bins; i++) {
+                bins[i].bb = BBox::empty();
+                bins[i].count = 0;
+                for (int c = 0; c < num_chunks; c++) {
+                    bins[i].bb = extend(bins[i].bb, chunk_bins[c * 3 * num_bins + i].bb);
+                    bins[i].count += chunk_bins[c * 3 * num_bins + i].count;
+                }
+            }
+        } else {
+            for (int i = begin; i < end; i++)
+                center_bb = extend(center_bb, centers[prims[i]]);
+            fill_bins(bins, begin, end, center_bb);
+        }
 
-    #pragma omp parallel
-    {
-        // Sort according to projection of barycenter on each axis
-        #pragma omp sections
-        {
-            #pragma omp section
-            std::sort(prims[0], prims[0] + num_tris, [&] (int p0, int p1) { return centers[p0].x < centers[p1].x; });
+        // On all three axes, sweep the bins to find the best split
+        int min_split = -1;
+        min_cost = FLT_MAX;
+        min_axis = 0;
+
+        for (int axis = 0; axis < 3; axis++) {
+            if (center_bb.max[axis] <= center_bb.min[axis]) continue;
+
+            const Bin* axis_bins = bins + axis * num_bins;
+            float right_costs[max_bins()];
+            BBox  right_bbs[max_bins()];
+            BBox  cur_bb = BBox::empty();
+            int   count  = 0;
+            for (int i = num_bins - 1; i > 0; i--) {
+                cur_bb = extend(cur_bb, axis_bins[i].bb);
+                count += axis_bins[i].count;
+                right_costs[i] = leaf_blocks(count, block_size) * half_area(cur_bb);
+                right_bbs[i]   = cur_bb;
+            }
+
+            cur_bb = BBox::empty();
+            count  = 0;
+            for (int i = 1; i < num_bins; i++) {
+                cur_bb = extend(cur_bb, axis_bins[i - 1].bb);
+                count += axis_bins[i - 1].count;
+                if (count == 0 || count == end - begin) continue;
+
+                const float c = leaf_blocks(count, block_size) * half_area(cur_bb) + right_costs[i];
+                if (c < min_cost) {
+                    min_left  = cur_bb;
+                    min_right = right_bbs[i];
+                    min_cost  = c;
+                    min_split = i;
+                    min_axis  = axis;
+                }
+            }
+        }
+
+        return min_split;
+    }
 
-            #pragma omp section
-            std::sort(prims[1], prims[1] + num_tris, [&] (int p0, int p1) { return centers[p0].y < centers[p1].y; });
+    void build(int node_id) {
+        const float traversal_cost = 1.0f;
+
+        Bvh::Node& node = nodes[node_id];
+        const int begin = node.first_prim;
+        const int end   = node.first_prim + node.num_prims;
+
+        if (end - begin <= 1)
+            return;
+
+        // Large nodes near the root are binned by several tasks
+        const int  num_chunks = std::min(BvhBuilder::max_chunks(), (end - begin) / BvhBuilder::chunk_size());
+        const bool parallel   = end - begin > BvhBuilder::parallel_split_threshold();
 
-            #pragma omp section
-            std::sort(prims[2], prims[2] + num_tris, [&] (int p0, int p1) { return centers[p0].z < centers[p1].z; });
+        BBox  center_bb, min_left, min_right;
+        float min_cost;
+        int   min_axis;
+        const int min_split = find_split(begin, end, parallel, num_chunks, center_bb, min_left, min_right, min_cost, min_axis);
+
+        int middle;
+        if (min_split >= 0) {
+            // Compare the minimum split cost with the SAH of this node
+            if (min_cost >= (leaf_blocks(end - begin, block_size) - traversal_cost) * half_area(node.min, node.max))
+                return;
+
+            const float3 scale = bin_scale(center_bb);
+            auto is_left = [&] (int prim) {
+                return bin_index(centers[prim], center_bb, scale, min_axis) < min_split;
+            };
+            middle = parallel
+                ? partition_parallel(begin, end, num_chunks, is_left)
+                : std::partition(prims + begin, prims + end, is_left) - prims;
+        } else {
+            // All the centers are in the same bin, split the list in the middle if it is too large for a leaf
+            if (end - begin <= max_leaf_prims())
+                return;
+
+            middle = (begin + end) / 2;
+            min_left = min_right = BBox::empty();
+            for (int i = begin;  i < middle; i++) min_left  = extend(min_left,  bboxes[prims[i]]);
+            for (int i = middle; i < end;    i++) min_right = extend(min_right, bboxes[prims[i]]);
         }
 
-        #pragma omp barrier
+        assert(middle > begin && middle < end);
 
-        #pragma omp single
-        builder->build_and_delete(0);
+        int num_nodes;
+
+        #pragma omp atomic capture
+        {num_nodes = node_count; node_count += 2;}
+
+        // Mark the node as an inner node
+        node.child = num_nodes;
+        node.axis = -min_axis;
+
+        // Setup the child nodes
+        Bvh::Node& left = nodes[num_nodes];
+        left.first_prim = begin;
+        left.num_prims  = middle - begin;
+        left.min = min_left.min;
+        left.max = min_left.max;
+
+        Bvh::Node& right = nodes[num_nodes + 1];
+        right.first_prim = middle;
+        right.num_prims  = end - middle;
+        right.min = min_right.min;
+        right.max = min_right.max;
+
+        const int smallest_node = right.num_prims <  left.num_prims ? num_nodes + 1 : num_nodes;
+        const int biggest_node  = right.num_prims >= left.num_prims ? num_nodes + 1 : num_nodes;
+
+        bool spawn_task = nodes[smallest_node].num_prims > BvhBuilder::parallel_threshold();
+        if (spawn_task) {
+            #pragma omp task firstprivate(smallest_node)
+            build(smallest_node);
+        }
+
+        build(biggest_node);
+        if (!spawn_task) build(smallest_node);
     }
 
-    // Resize the array of nodes
-    Node* tmp_nodes = new Node[num_nodes];
-    std::copy(nodes.get(), nodes.get() + num_nodes, tmp_nodes);
-    nodes.reset(tmp_nodes);
-}
+    /// Partitions the range [begin, end[ with several tasks, going through the temporary buffer.
+    template <typename Pred>
+    int partition_parallel(int begin, int end, int num_chunks, Pred pred) {
+        std::vector<int> left_counts(num_chunks + 1, 0), right_counts(num_chunks + 1, 0);
+        for_each_chunk(begin, end, num_chunks, [&] (int c, int chunk_begin, int chunk_end) {
+            for (int i = chunk_begin; i < chunk_end; i++)
+                (pred(prims[i]) ? left_counts[c + 1] : right_counts[c + 1])++;
+        });
+
+        for (int c = 0; c < num_chunks; c++) {
+            left_counts[c + 1]  += left_counts[c];
+            right_counts[c + 1] += right_counts[c];
+        }
 
-void Bvh::build(const float3* verts, const int* indices, int num_tris) {
-    // Compute per-triangle and global bounding box
-    std::unique_ptr<BBox[]>   bboxes(new BBox[num_tris]);
-    std::unique_ptr<float3[]> centers(new float3[num_tris]);
+        const int middle = begin + left_counts[num_chunks];
+        for_each_chunk(begin, end, num_chunks, [&] (int c, int chunk_begin, int chunk_end) {
+            int left = begin + left_counts[c], right = middle + right_counts[c];
+            for (int i = chunk_begin; i < chunk_end; i++)
+                tmp_prims[pred(prims[i]) ? left++ : right++] = prims[i];
+        });
+        for_each_chunk(begin, end, num_chunks, [&] (int, int chunk_begin, int chunk_end) {
+            std::copy(tmp_prims + chunk_begin, tmp_prims + chunk_end, prims + chunk_begin);
+        });
+
+        return middle;
+    }
 
-    nodes.reset(new Node[num_tris * 2 + 1]);
+    static constexpr int max_bins() { return 64; }
+    static constexpr int max_leaf_prims() { return 8; }
 
-    #pragma omp parallel for
-    for (int i = 0; i < num_tris; i++) {
-        const float3 v0 = verts[indices[i * 4 + 0]];
-        const float3 v1 = verts[indices[i * 4 + 1]];
-        const float3 v2 = verts[indices[i * 4 + 2]];
+    const BBox* bboxes;
+    const float3* centers;
 
-        centers[i] = (1.0f / 3.0f) * (v0 + v1 + v2);
-        bboxes[i].min = min(v0, min(v1, v2));
-        bboxes[i].max = max(v0, max(v1, v2));
+    int* prims;
+    int* tmp_prims;
+
+    Bvh::Node* nodes;
+    int& node_count;
+    int num_bins;
+    int block_size;
+};
+
+/// Builder for spatial split BVHs (SBVH): in addition to object splits, nodes can be split with a plane that
+/// clips the triangles straddling it, in which case these triangles are referenced on both sides.
+struct SpatialBvhBuilder {
+    /// Reference to a triangle, with the part of the triangle bounding box that is inside the node.
+    struct Reference {
+        BBox bb;
+        int prim;
+    };
+
+    struct Bin {
+        BBox bb;
+        int count;
+    };
+
+    struct SpatialBin {
+        BBox bb;
+        int entries;
+        int exits;
+    };
+
+    struct Split {
+        float cost;
+        int axis;
+        int bin;
+        BBox left_bb, right_bb;
+        int left_count, right_count;
+    };
+
+    SpatialBvhBuilder(const float3* verts, const int* indices,
+                      int* prim_ids,
+                      Bvh::Node* nodes,
+                      int& node_count, int& prim_count,
+                      int max_dups, int num_bins, float min_overlap, int block_size)
+        : verts(verts)
+        , indices(indices)
+        , prim_ids(prim_ids)
+        , nodes(nodes)
+        , node_count(node_count)
+        , prim_count(prim_count)
+        , dup_count(0)
+        , max_dups(max_dups)
+        , num_bins(num_bins)
+        , min_overlap(min_overlap)
+        , block_size(block_size)
+    {}
+
+    /// Clips the part of the triangle inside the reference against a plane, and computes the bounding box on each side.
+    void split_reference(const Reference& ref, int axis, float pos, BBox& left_bb, BBox& right_bb) const {
+        left_bb = right_bb = BBox::empty();
+
+        const int* tri = indices + ref.prim * 4;
+        for (int i = 0; i < 3; i++) {
+            const float3 v0 = verts[tri[i]];
+            const float3 v1 = verts[tri[(i + 1) % 3]];
+            const float p0 = v0[axis];
+            const float p1 = v1[axis];
+
+            if (p0 <= pos) left_bb  = extend(left_bb,  v0);
+            if (p0 >= pos) right_bb = extend(right_bb, v0);
+
+            // Add the intersection of the edge with the plane to both sides
+            if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos)) {
+                float3 v = lerp(v0, v1, clamp((pos - p0) / (p1 - p0), 0.0f, 1.0f));
+                v[axis] = pos;
+                left_bb  = extend(left_bb,  v);
+                right_bb = extend(right_bb, v);
+            }
+        }
+
+        left_bb  = overlap(left_bb,  ref.bb);
+        right_bb = overlap(right_bb, ref.bb);
     }
 
-    build(bboxes.get(), centers.get(), num_tris);
+    float3 center(const Reference& ref) const {
+        return 0.5f * (ref.bb.min + ref.bb.max);
+    }
 
-    tris.reset(new PrecomputedTri[num_tris]);
+    /// Returns the index of the bin in which a coordinate falls, given the extents of the binned range.
+    int bin_index(float x, float min, float scale) const {
+        return clamp(int((x - min) * scale), 0, num_bins - 1);
+    }
 
-    #pragma omp parallel for
-    for (int i = 0; i < num_tris; i++) {
-        int tri_id = prim_ids[i];
-        int i0 = indices[tri_id * 4 + 0];
-        int i1 = indices[tri_id * 4 + 1];
-        int i2 = indices[tri_id * 4 + 2];
-        tris[i] = PrecomputedTri(verts[i0], verts[i1], verts[i2]);
+    float bin_scale(float min, float max) const {
+        return max > min ? num_bins * (1.0f - FLT_EPSILON) / (max - min) : 0.0f;
     }
-}
 
-void Bvh::traverse(const Ray& ray, Hit& hit, bool any) const {
-    constexpr int stack_size = 64;
-    int stack[stack_size];
-    int top = 1;
-    int stack_ptr = 0;
+    /// Finds the best object split by binning the reference centers, as in the binned builder.
+    bool find_object_split(const std::vector<Reference>& refs, const BBox& center_bb, Split& split) const {
+        split.cost = FLT_MAX;
+        for (int axis = 0; axis < 3; axis++) {
+            if (center_bb.max[axis] <= center_bb.min[axis]) continue;
 
-    hit.tri = -1;
-    hit.t = ray.tmax;
-    hit.u = 0;
-    hit.v = 0;
+            Bin bins[BinnedBvhBuilder::max_bins()];
+            for (int i = 0; i < num_bins; i++) {
+                bins[i].bb = BBox::empty();
+                bins[i].count = 0;
+            }
 
-    int ox = ray.dir.x > 0 ? 0 : 4;
-    int oy = ray.dir.y > 0 ? 1 : 5;
-    int oz = ray.dir.z > 0 ? 2 : 6;
-    auto idir = float3(1.0f) / ray.dir;
-    auto oidir = ray.org * idir;
+            const float scale = bin_scale(center_bb.min[axis], center_bb.max[axis]);
+            for (auto& ref : refs) {
+                Bin& bin = bins[bin_index(center(ref)[axis], center_bb.min[axis], scale)];
+                bin.bb = extend(bin.bb, ref.bb);
+                bin.count++;
+            }
 
-    stack[0] = -1;
-    while (top >= 0) {
-        auto& left  = nodes[top + 0];
-        auto& right = nodes[top + 1];
+            sweep_bins(bins, axis, [] (const Bin& bin) { return bin.count; },
+                                   [] (const Bin& bin) { return bin.count; }, split);
+        }
+        return split.cost < FLT_MAX;
+    }
 
-        // Intersect the two children of this node
-        auto p0 = reinterpret_cast<const float*>(&left);
-        auto p1 = reinterpret_cast<const float*>(&right);
-        auto t00x = p0[    ox] * idir.x - oidir.x;
-        auto t10x = p1[    ox] * idir.x - oidir.x;
-        auto t00y = p0[    oy] * idir.y - oidir.y;
-        auto t10y = p1[    oy] * idir.y - oidir.y;
-        auto t00z = p0[    oz] * idir.z - oidir.z;
-        auto t10z = p1[    oz] * idir.z - oidir.z;
-        auto t01x = p0[4 - ox] * idir.x - oidir.x;
-        auto t11x = p1[4 - ox] * idir.x - oidir.x;
-        auto t01y = p0[6 - oy] * idir.y - oidir.y;
-        auto t11y = p1[6 - oy] * idir.y - oidir.y;
-        auto t01z = p0[8 - oz] * idir.z - oidir.z;
-        auto t11z = p1[8 - oz] * idir.z - oidir.z;
-        float t0[2], t1[2];
-        t0[0] = std::max(std::max(ray.tmin, t00x), std::max(t00y, t00z));
-        t0[1] = std::max(std::max(ray.tmin, t10x), std::max(t10y, t10z));
-        t1[0] = std::min(std::min(hit.t, t01x), std::min(t01y, t01z));
-        t1[1] = std::min(std::min(hit.t, t11x), std::min(t11y, t11z));
+    /// Finds the best spatial split by clipping the references against the planes between the bins.
+    bool find_spatial_split(const std::vector<Reference>& refs, const BBox& node_bb, Split& split) const {
+        split.cost = FLT_MAX;
+        for (int axis = 0; axis < 3; axis++) {
+            if (node_bb.max[axis] <= node_bb.min[axis]) continue;
+
+            SpatialBin bins[BinnedBvhBuilder::max_bins()];
+            for (int i = 0; i < num_bins; i++) {
+                bins[i].bb = BBox::empty();
+                bins[i].entries = 0;
+                bins[i].exits = 0;
+            }
 
-        const int old_ptr = stack_ptr;
+            const float scale = bin_scale(node_bb.min[axis], node_bb.max[axis]);
+            const float bin_size = (node_bb.max[axis] - node_bb.min[axis]) / num_bins;
+            for (auto& ref : refs) {
+                const int first = bin_index(ref.bb.min[axis], node_bb.min[axis], scale);
+                const int last  = bin_index(ref.bb.max[axis], node_bb.min[axis], scale);
+
+                // Chop the reference into the bins it overlaps
+                Reference cur = ref;
+                for (int i = first; i < last; i++) {
+                    BBox left_bb, right_bb;
+                    split_reference(cur, axis, node_bb.min[axis] + (i + 1) * bin_size, left_bb, right_bb);
+                    bins[i].bb = extend(bins[i].bb, left_bb);
+                    cur.bb = right_bb;
+                }
+                bins[last].bb = extend(bins[last].bb, cur.bb);
+                bins[first].entries++;
+                bins[last].exits++;
+            }
+
+            sweep_bins(bins, axis, [] (const SpatialBin& bin) { return bin.entries; },
+                                   [] (const SpatialBin& bin) { return bin.exits; }, split);
+        }
+        return split.cost < FLT_MAX;
+    }
+
+    /// Sweeps the bins of an axis and updates the split if a cheaper one is found.
+    template <typename B, typename LeftCount, typename RightCount>
+    void sweep_bins(const B* bins, int axis, LeftCount left_count, RightCount right_count, Split& split) const {
+        float right_costs[BinnedBvhBuilder::max_bins()];
+        BBox  right_bbs[BinnedBvhBuilder::max_bins()];
+        int   right_counts[BinnedBvhBuilder::max_bins()];
+        BBox  cur_bb = BBox::empty();
+        int   count  = 0;
+        for (int i = num_bins - 1; i > 0; i--) {
+            cur_bb = extend(cur_bb, bins[i].bb);
+            count += right_count(bins[i]);
+            right_costs[i]  = leaf_blocks(count, block_size) * half_area(cur_bb);
+            right_bbs[i]    = cur_bb;
+            right_counts[i] = count;
+        }
+
+        cur_bb = BBox::empty();
+        count  = 0;
+        for (int i = 1; i < num_bins; i++) {
+            cur_bb = extend(cur_bb, bins[i - 1].bb);
+            count += left_count(bins[i - 1]);
+            if (count == 0 || right_counts[i] == 0) continue;
+
+            const float c = leaf_blocks(count, block_size) * half_area(cur_bb) + right_costs[i];
+            if (c < split.cost) {
+                split.cost        = c;
+                split.axis        = axis;
+                split.bin         = i;
+                split.left_bb     = cur_bb;
+                split.right_bb    = right_bbs[i];
+                split.left_count  = count;
+                split.right_count = right_counts[i];
+            }
+        }
+    }
 
-        auto intersect_leaf = [&] (const Node& leaf) {
-            for (int j = leaf.first_prim; j < leaf.first_prim + leaf.num_prims; j++) {
-                if (intersect_ray_tri(ray, tris[j], hit.t, hit.u, hit.v)) {
-                    hit.tri = j;
-                    if (any) return;
+    /// Distributes the references on both sides of the splitting plane. References that straddle the plane are
+    /// either duplicated, or kept on one side only when that is cheaper (reference unsplitting).
+    void partition_spatial(const std::vector<Reference>& refs, const BBox& node_bb, const Split& split,
+                           std::vector<Reference>& left_refs, std::vector<Reference>& right_refs) const {
+        const int axis = split.axis;
+        const float scale = bin_scale(node_bb.min[axis], node_bb.max[axis]);
+        const float pos = node_bb.min[axis] + split.bin * (node_bb.max[axis] - node_bb.min[axis]) / num_bins;
+
+        BBox left_bb  = split.left_bb;
+        BBox right_bb = split.right_bb;
+        int left_count  = split.left_count;
+        int right_count = split.right_count;
+
+        for (auto& ref : refs) {
+            const int first = bin_index(ref.bb.min[axis], node_bb.min[axis], scale);
+            const int last  = bin_index(ref.bb.max[axis], node_bb.min[axis], scale);
+            if (last < split.bin) {
+                left_refs.push_back(ref);
+            } else if (first >= split.bin) {
+                right_refs.push_back(ref);
+            } else {
+                BBox left_part, right_part;
+                split_reference(ref, axis, pos, left_part, right_part);
+
+                // Compare the cost of duplicating the reference with the cost of keeping it on one side
+                const float split_cost = half_area(left_bb) * left_count + half_area(right_bb) * right_count;
+                const float left_cost  = half_area(extend(left_bb, ref.bb)) * left_count + half_area(right_bb) * (right_count - 1);
+                const float right_cost = half_area(left_bb) * (left_count - 1) + half_area(extend(right_bb, ref.bb)) * right_count;
+
+                const bool can_unsplit_left  = right_count > 1;
+                const bool can_unsplit_right = left_count  > 1;
+                if (can_unsplit_left && (is_empty(right_part) || (left_cost < split_cost && left_cost <= right_cost))) {
+                    left_bb = extend(left_bb, ref.bb);
+                    left_refs.push_back(ref);
+                    right_count--;
+                } else if (can_unsplit_right && (is_empty(left_part) || right_cost < split_cost)) {
+                    right_bb = extend(right_bb, ref.bb);
+                    right_refs.push_back(ref);
+                    left_count--;
+                } else {
+                    left_refs.push_back(Reference{ is_empty(left_part)  ? ref.bb : left_part,  ref.prim });
+                    right_refs.push_back(Reference{ is_empty(right_part) ? ref.bb : right_part, ref.prim });
                 }
             }
-        };
+        }
+    }
+
+    void make_leaf(Bvh::Node& node, const std::vector<Reference>& refs) {
+        int first_prim;
+
+        #pragma omp atomic capture
+        {first_prim = prim_count; prim_count += refs.size();}
+
+        for (size_t i = 0; i < refs.size(); i++)
+            prim_ids[first_prim + i] = refs[i].prim;
+        node.first_prim = first_prim;
+        node.num_prims  = refs.size();
+    }
+
+    void build(int node_id, std::vector<Reference>& refs) {
+        const float traversal_cost = 1.0f;
+
+        Bvh::Node& node = nodes[node_id];
+        const BBox node_bb(node.min, node.max);
+        const int num_refs = refs.size();
+
+        if (num_refs <= 1) {
+            make_leaf(node, refs);
+            return;
+        }
+
+        BBox center_bb = BBox::empty();
+        for (auto& ref : refs)
+            center_bb = extend(center_bb, center(ref));
+
+        Split object_split, spatial_split;
+        const bool has_object_split = find_object_split(refs, center_bb, object_split);
+
+        // Only look for spatial splits when the children of the best object split overlap significantly
+        int cur_dups;
+        #pragma omp atomic read
+        cur_dups = dup_count;
+
+        bool has_spatial_split = false;
+        if (cur_dups < max_dups &&
+            (!has_object_split || half_area(overlap(object_split.left_bb, object_split.right_bb)) > min_overlap)) {
+            has_spatial_split = find_spatial_split(refs, node_bb, spatial_split);
+        }
+
+        // Reserve the references that the spatial split may duplicate, within the memory budget
+        int num_dups = 0;
+        if (has_spatial_split && (!has_object_split || spatial_split.cost < object_split.cost)) {
+            num_dups = spatial_split.left_count + spatial_split.right_count - num_refs;
+            int old_count;
+
+            #pragma omp atomic capture
+            {old_count = dup_count; dup_count += num_dups;}
+
+            if (old_count + num_dups > max_dups) {
+                #pragma omp atomic
+                dup_count -= num_dups;
+                has_spatial_split = false;
+                num_dups = 0;
+            }
+        } else {
+            has_spatial_split = false;
+        }
 
-        if (t0[0] <= t1[0]) {
-            if (left.num_prims > 0) intersect_leaf(left);
-            else stack[++stack_ptr] = left.child;
+        const Split& split = has_spatial_split ? spatial_split : object_split;
+        const bool has_split = has_spatial_split || has_object_split;
+
+        // Compare the minimum split cost with the SAH of this node
+        if ((has_split && split.cost >= (leaf_blocks(num_refs, block_size) - traversal_cost) * half_area(node_bb)) ||
+            (!has_split && num_refs <= BinnedBvhBuilder::max_leaf_prims())) {
+            make_leaf(node, refs);
+            return;
         }
 
-        if (t0[1] <= t1[1]) {
-            if (right.num_prims > 0) intersect_leaf(right);
-            else stack[++stack_ptr] = right.child;
+        auto left_refs  = new std::vector<Reference>();
+        auto right_refs = new std::vector<Reference>();
+        int axis = 0;
+        if (has_spatial_split) {
+            partition_spatial(refs, node_bb, split, *left_refs, *right_refs);
+            axis = split.axis;
+
+            // Give back the references that were kept on one side only
+            const int unused = num_dups - (int(left_refs->size() + right_refs->size()) - num_refs);
+            #pragma omp atomic
+            dup_count -= unused;
+        } else if (has_object_split) {
+            const float scale = bin_scale(center_bb.min[split.axis], center_bb.max[split.axis]);
+            for (auto& ref : refs) {
+                const int bin = bin_index(center(ref)[split.axis], center_bb.min[split.axis], scale);
+                (bin < split.bin ? left_refs : right_refs)->push_back(ref);
+            }
+            axis = split.axis;
+        } else {
+            // All the centers are in the same bin, split the list in the middle
+            left_refs->assign(refs.begin(), refs.begin() + num_refs / 2);
+            right_refs->assign(refs.begin() + num_refs / 2, refs.end());
         }
 
-        // Reorder the children on the stack
-        if (old_ptr + 2 <= stack_ptr && t0[0] < t0[1])
-            std::swap(stack[stack_ptr], stack[stack_ptr - 1]);
+        // The references of this node are not needed anymore
+        std::vector<Reference>().swap(refs);
 
-        top = stack[stack_ptr--];
+        assert(!left_refs->empty() && !right_refs->empty());
+
+        int num_nodes;
+
+        #pragma omp atomic capture
+        {num_nodes = node_count; node_count += 2;}
+
+        // Mark the node as an inner node
+        node.child = num_nodes;
+        node.axis = -axis;
+
+        // Setup the child nodes, with bounding boxes that tightly enclose their references
+        std::vector<Reference>* child_refs[2] = { left_refs, right_refs };
+        for (int i = 0; i < 2; i++) {
+            BBox bb = BBox::empty();
+            for (auto& ref : *child_refs[i])
+                bb = extend(bb, ref.bb);
+            nodes[num_nodes + i].min = bb.min;
+            nodes[num_nodes + i].max = bb.max;
+        }
+
+        const int smallest = right_refs->size() <  left_refs->size() ? 1 : 0;
+        const int biggest  = 1 - smallest;
+
+        bool spawn_task = child_refs[smallest]->size() > size_t(BvhBuilder::parallel_threshold());
+        if (spawn_task) {
+            const int child_id = num_nodes + smallest;
+            std::vector<Reference>* task_refs = child_refs[smallest];
+            #pragma omp task firstprivate(child_id, task_refs)
+            build_and_delete(child_id, task_refs);
+        }
+
+        build_and_delete(num_nodes + biggest, child_refs[biggest]);
+        if (!spawn_task) build_and_delete(num_nodes + smallest, child_refs[smallest]);
+    }
+
+    void build_and_delete(int node_id, std::vector<Reference>* refs) {
+        build(node_id, *refs);
+        delete refs;
     }
 
-    if (hit.tri >= 0) hit.tri = prim_ids[hit.tri];
+    const float3* verts;
+    const int* indices;
+
+    int* prim_ids;
+
+    Bvh::Node* nodes;
+    int& node_count;
+    int& prim_count;
+    int  dup_count;
+    int  max_dups;
+    int  num_bins;
+    float min_overlap;
+    int  block_size;
+};
+
+/// Returns the axis along which the centers of two boxes are the furthest apart.
+inline int split_axis(const float3& left_min, const float3& left_max, const float3& right_min, const float3& right_max) {
+    const float3 d = (right_min + right_max) - (left_min + left_max);
+    const float3 a(std::fabs(d.x), std::fabs(d.y), std::fabs(d.z));
+    return a.x >= a.y && a.x >= a.z ? 0 : (a.y >= a.z ? 1 : 2);
+}
+
+/// Returns the number of leading zero bits of a key (the number of bits of the key if it is zero).
+template <typename Key>
+inline int count_leading_zeros(Key x) {
+    // The intrinsics are undefined for zero, which happens when a range starts with repeated codes
+    if (x == 0) return sizeof(Key) * 8;
+#ifdef __GNUC__
+    return sizeof(Key) == 4 ? __builtin_clz(x) : __builtin_clzll(x);
+#else
+    int n = 0;
+    for (Key bit = Key(1) << (sizeof(Key) * 8 - 1); !(x & bit); bit >>= 1) n++;
+    return n;
+#endif
+}
+
+/// Builder for linear BVHs (LBVH): the primitives are sorted along a Morton curve, and the hierarchy is emitted
+/// in a single top-down pass by splitting each range where the highest differing bit of the codes changes.
+template <typename Key>
+struct LinearBvhBuilder {
+    LinearBvhBuilder(const BBox* bboxes, const Key* codes,
+                     int* prims, float* tmp_costs,
+                     Bvh::Node* nodes,
+                     int& node_count,
+                     int sah_levels, int block_size)
+        : bboxes(bboxes)
+        , codes(codes)
+        , prims(prims)
+        , tmp_costs(tmp_costs)
+        , nodes(nodes)
+        , node_count(node_count)
+        , sah_levels(sah_levels)
+        , block_size(block_size)
+    {}
+
+    /// Returns the index of the first primitive whose code has the highest differing bit of the range set.
+    int find_morton_split(int begin, int end) const {
+        const Key first = codes[begin];
+        const Key last  = codes[end - 1];
+
+        // Identical codes, split the range in the middle
+        if (first == last) return (begin + end) / 2;
+
+        const int prefix = count_leading_zeros<Key>(first ^ last);
+
+        // Binary search for the last primitive that shares more than 'prefix' bits with the first one
+        int split = begin;
+        int step  = end - 1 - begin;
+        do {
+            step = (step + 1) >> 1;
+            const int next = split + step;
+            if (next < end - 1 && count_leading_zeros<Key>(first ^ codes[next]) > prefix)
+                split = next;
+        } while (step > 1);
+
+        return split + 1;
+    }
+
+    /// Builds the subtree rooted at the given node, and computes the bounding box of the node from its children.
+    void build(int node_id, int depth) {
+        Bvh::Node& node = nodes[node_id];
+        const int begin = node.first_prim;
+        const int end   = node.first_prim + node.num_prims;
+
+        if (end - begin <= std::max(max_leaf_prims(), block_size)) {
+            BBox bb = BBox::empty();
+            for (int i = begin; i < end; i++)
+                bb = extend(bb, bboxes[prims[i]]);
+            node.min = bb.min;
+            node.max = bb.max;
+            return;
+        }
+
+        int split;
+        if (depth < sah_levels) {
+            // Refine the top of the hierarchy by choosing the split along the curve that minimizes the SAH
+            const int  num_chunks = std::min(BvhBuilder::max_chunks(), (end - begin) / BvhBuilder::chunk_size());
+            const bool parallel   = end - begin > BvhBuilder::parallel_split_threshold();
+            BBox  right_bb;
+            float cost;
+            split = parallel
+                ? find_split_parallel(prims, tmp_costs, begin, end, bboxes, right_bb, cost, num_chunks, block_size)
+                : find_split(prims, tmp_costs, begin, end, bboxes, right_bb, cost, block_size);
+        } else {
+            split = find_morton_split(begin, end);
+        }
+
+        assert(split > begin && split < end);
+
+        int num_nodes;
+
+        #pragma omp atomic capture
+        {num_nodes = node_count; node_count += 2;}
+
+        node.child = num_nodes;
+
+        Bvh::Node& left = nodes[num_nodes];
+        left.first_prim = begin;
+        left.num_prims  = split - begin;
+
+        Bvh::Node& right = nodes[num_nodes + 1];
+        right.first_prim = split;
+        right.num_prims  = end - split;
+
+        const int smallest_node = right.num_prims <  left.num_prims ? num_nodes + 1 : num_nodes;
+        const int biggest_node  = right.num_prims >= left.num_prims ? num_nodes + 1 : num_nodes;
+
+        bool spawn_task = nodes[smallest_node].num_prims > BvhBuilder::parallel_threshold();
+        if (spawn_task) {
+            #pragma omp task firstprivate(smallest_node, depth)
+            build(smallest_node, depth + 1);
+        }
+
+        build(biggest_node, depth + 1);
+        if (spawn_task) {
+            #pragma omp taskwait
+        } else {
+            build(smallest_node, depth + 1);
+        }
+
+        node.axis = -split_axis(left.min, left.max, right.min, right.max);
+        node.min  = min(left.min, right.min);
+        node.max  = max(left.max, right.max);
+    }
+
+    static constexpr int max_leaf_prims() { return 4; }
+
+    const BBox* bboxes;
+    const Key* codes;
+
+    int* prims;
+    float* tmp_costs;
+
+    Bvh::Node* nodes;
+    int& node_count;
+    int sah_levels;
+    int block_size;
+};
+
+/// Post-build optimizer that lowers the SAH cost of a BVH by restructuring treelets: for every node, the treelet
+/// made of the node and its largest descendants is replaced by the topology that minimizes the SAH for the same leaves.
+struct BvhOptimizer {
+    BvhOptimizer(Bvh::Node* nodes, int num_nodes, int block_size)
+        : nodes(nodes), costs(new float[num_nodes]), block_size(block_size)
+    {}
+
+    /// Restructures all the treelets of the subtree in post-order, and returns the SAH cost of the subtree.
+    float optimize(int node_id, int depth) {
+        const float traversal_cost = 1.0f;
+
+        const Bvh::Node& node = nodes[node_id];
+        if (node.num_prims > 0)
+            return costs[node_id] = leaf_blocks(node.num_prims, block_size) * half_area(node.min, node.max);
+
+        const int child = node.child;
+        float left_cost, right_cost;
+        if (depth < task_depth()) {
+            #pragma omp task shared(left_cost) firstprivate(child, depth)
+            left_cost = optimize(child + 0, depth + 1);
+            right_cost = optimize(child + 1, depth + 1);
+            #pragma omp taskwait
+        } else {
+            left_cost  = optimize(child + 0, depth + 1);
+            right_cost = optimize(child + 1, depth + 1);
+        }
+
+        costs[node_id] = traversal_cost * half_area(node.min, node.max) + left_cost + right_cost;
+        restructure(node_id);
+        return costs[node_id];
+    }
+
+    void restructure(int node_id) {
+        const float traversal_cost = 1.0f;
+
+        // Form the treelet by repeatedly opening the inner treelet leaf with the largest area
+        int leaves[max_treelet_leaves()];
+        int pairs[max_treelet_leaves() - 1];
+        int num_leaves = 2, num_pairs = 1;
+        leaves[0] = nodes[node_id].child + 0;
+        leaves[1] = nodes[node_id].child + 1;
+        pairs[0]  = nodes[node_id].child;
+
+        while (num_leaves < max_treelet_leaves()) {
+            int   best = -1;
+            float best_area = -1.0f;
+            for (int i = 0; i < num_leaves; i++) {
+                const Bvh::Node& leaf = nodes[leaves[i]];
+                if (leaf.num_prims > 0) continue;
+                const float area = half_area(leaf.min, leaf.max);
+                if (area > best_area) {
+                    best_area = area;
+                    best = i;
+                }
+            }
+            if (best < 0) break;
+
+            const int first = nodes[leaves[best]].child;
+            pairs[num_pairs++]     = first;
+            leaves[best]           = first + 0;
+            leaves[num_leaves++]   = first + 1;
+        }
+
+        if (num_leaves < 3) return;
+
+        // Find the optimal topology for every subset of the treelet leaves, in order of increasing size
+        const int num_subsets = 1 << num_leaves;
+        BBox  subset_bbs[1 << max_treelet_leaves()];
+        float subset_costs[1 << max_treelet_leaves()];
+        int   subset_splits[1 << max_treelet_leaves()];
+        for (int s = 1; s < num_subsets; s++) {
+            const int i = first_bit(s);
+            const Bvh::Node& leaf = nodes[leaves[i]];
+            const int rest = s & (s - 1);
+            if (!rest) {
+                subset_bbs[s]   = BBox(leaf.min, leaf.max);
+                subset_costs[s] = costs[leaves[i]];
+                continue;
+            }
+
+            subset_bbs[s] = extend(subset_bbs[rest], BBox(leaf.min, leaf.max));
+
+            // Enumerate the partitions of the subset, keeping the lowest leaf on the left to skip symmetric ones
+            float best_cost = FLT_MAX;
+            int   best_split = 0;
+            const int low = s & -s;
+            for (int p = (s - 1) & s; p; p = (p - 1) & s) {
+                if (!(p & low)) continue;
+                const float c = subset_costs[p] + subset_costs[s ^ p];
+                if (c < best_cost) {
+                    best_cost  = c;
+                    best_split = p;
+                }
+            }
+            subset_costs[s]  = traversal_cost * half_area(subset_bbs[s]) + best_cost;
+            subset_splits[s] = best_split;
+        }
+
+        const int all = num_subsets - 1;
+        if (subset_costs[all] >= costs[node_id] * (1.0f - min_improvement()))
+            return;
+
+        // Rebuild the treelet with the optimal topology, re-using the pairs of nodes of the original treelet
+        Bvh::Node leaf_nodes[max_treelet_leaves()];
+        float     leaf_costs[max_treelet_leaves()];
+        for (int i = 0; i < num_leaves; i++) {
+            leaf_nodes[i] = nodes[leaves[i]];
+            leaf_costs[i] = costs[leaves[i]];
+        }
+
+        int next_pair = 0;
+        emit(node_id, all, leaf_nodes, leaf_costs, subset_bbs, subset_costs, subset_splits, pairs, next_pair);
+        assert(next_pair == num_pairs);
+    }
+
+    void emit(int node_id, int subset,
+              const Bvh::Node* leaf_nodes, const float* leaf_costs,
+              const BBox* subset_bbs, const float* subset_costs, const int* subset_splits,
+              const int* pairs, int& next_pair) {
+        if (!(subset & (subset - 1))) {
+            const int i = first_bit(subset);
+            nodes[node_id] = leaf_nodes[i];
+            costs[node_id] = leaf_costs[i];
+            return;
+        }
+
+        const int first = pairs[next_pair++];
+        const int left  = subset_splits[subset];
+        const int right = subset ^ left;
+        emit(first + 0, left,  leaf_nodes, leaf_costs, subset_bbs, subset_costs, subset_splits, pairs, next_pair);
+        emit(first + 1, right, leaf_nodes, leaf_costs, subset_bbs, subset_costs, subset_splits, pairs, next_pair);
+
+        Bvh::Node& node = nodes[node_id];
+        node.min   = subset_bbs[subset].min;
+        node.max   = subset_bbs[subset].max;
+        node.child = first;
+        node.axis  = -split_axis(subset_bbs[left].min, subset_bbs[left].max, subset_bbs[right].min, subset_bbs[right].max);
+        costs[node_id] = subset_costs[subset];
+    }
+
+    static constexpr int max_treelet_leaves() { return 7; }
+    static constexpr int task_depth() { return 8; }
+    static constexpr float min_improvement() { return 1e-5f; }
+
+    Bvh::Node* nodes;
+    std::unique_ptr<float[]> costs;
+    int block_size;
+};
+
+void Bvh::build(const float3* verts, const int* indices, const BBox* bboxes, const float3* centers, int num_tris, const BvhSettings& settings) {
+    // Spatial splits duplicate references to triangles, up to the given budget
+    const int max_refs = settings.builder == BvhSettings::Builder::Spatial
+        ? int(std::min(double(num_tris) * std::max(settings.spatial_budget, 1.0f), double(INT_MAX / 2 - 1)))
+        : num_tris;
+
+    nodes = make_aligned_array<Node>(max_refs * 2 + 1);
+    prim_ids = make_aligned_array<int>(max_refs);
+    num_refs = num_tris;
+
+    Node& root = nodes[0];
+    root.min = float3(FLT_MAX);
+    root.max = float3(-FLT_MAX);
+    root.first_prim = 0;
+    root.num_prims  = num_tris;
+    num_nodes = 1;
+
+    // Compute global bounding box
+    #pragma omp parallel
+    {
+        BBox local = BBox::empty();
+        #pragma omp for nowait
+        for (int i = 0; i < num_tris; i++) {
+            local.min = min(bboxes[i].min, local.min);
+            local.max = max(bboxes[i].max, local.max);
+        }
+        #pragma omp critical
+        {
+            root.min = min(local.min, root.min);
+            root.max = max(local.max, root.max);
+        }
+    }
+
+    switch (settings.builder) {
+        case BvhSettings::Builder::Sweep:   build_sweep(bboxes, centers, num_tris); break;
+        case BvhSettings::Builder::Binned:  build_binned(bboxes, centers, num_tris, settings.num_bins); break;
+        case BvhSettings::Builder::Spatial: build_spatial(verts, indices, bboxes, num_tris, max_refs, settings.num_bins); break;
+        case BvhSettings::Builder::Linear:
+            if (settings.morton_bits > 30) build_linear<uint64_t>(bboxes, centers, num_tris, settings.sah_levels);
+            else                           build_linear<uint32_t>(bboxes, centers, num_tris, settings.sah_levels);
+            break;
+        default: assert(false); break;
+    }
+
+    sah = compute_sah();
+    if (settings.optimize_passes > 0) {
+        const float initial_sah = sah;
+        optimize(settings.optimize_passes);
+        sah = compute_sah();
+        info("BVH optimization reduced the SAH cost from ", initial_sah, " to ", sah, ".");
+    }
+
+    relayout(settings.align_nodes);
+    bb = BBox(nodes[0].min, nodes[0].max);
+}
+
+void Bvh::build_sweep(const BBox* bboxes, const float3* centers, int num_tris) {
+    std::unique_ptr<int[]> all_prims(new int[2 * num_tris]);
+    int* prims[3] = { prim_ids.get(), all_prims.get(), all_prims.get() + num_tris };
+    #pragma omp parallel for
+    for (int i = 0; i < num_tris; i++) {
+        prims[0][i] = i;
+        prims[1][i] = i;
+        prims[2][i] = i;
+    }
+
+    std::unique_ptr<uint8_t[]> tmp_flags(new uint8_t[num_tris]);
+
+    BvhBuilder* builder = new BvhBuilder(bboxes, tmp_flags.get(), prims, nodes.get(), num_nodes, tri_block);
+    builder->allocate_tmp_storage(num_tris);
+
+    #pragma omp parallel
+    {
+        #pragma omp single
+        {
+            // Sort according to projection of barycenter on each axis
+            #pragma omp task
+            parallel_sort(prims[0], prims[0] + num_tris, [&] (int p0, int p1) { return centers[p0].x < centers[p1].x; });
+
+            #pragma omp task
+            parallel_sort(prims[1], prims[1] + num_tris, [&] (int p0, int p1) { return centers[p0].y < centers[p1].y; });
+
+            #pragma omp task
+            parallel_sort(prims[2], prims[2] + num_tris, [&] (int p0, int p1) { return centers[p0].z < centers[p1].z; });
+
+            #pragma omp taskwait
+
+            // Subtrees are built by tasks that are picked up by idle threads
+            builder->build_and_delete(0);
+        }
+    }
+}
+
+void Bvh::build_binned(const BBox* bboxes, const float3* centers, int num_tris, int num_bins) {
+    #pragma omp parallel for
+    for (int i = 0; i < num_tris; i++)
+        prim_ids[i] = i;
+
+    std::unique_ptr<int[]> tmp_prims(new int[num_tris]);
+    BinnedBvhBuilder builder(bboxes, centers, prim_ids.get(), tmp_prims.get(), nodes.get(), num_nodes,
+                             clamp(num_bins, 2, BinnedBvhBuilder::max_bins()), tri_block);
+
+    #pragma omp parallel
+    {
+        #pragma omp single
+        builder.build(0);
+    }
+}
+
+void Bvh::build_spatial(const float3* verts, const int* indices, const BBox* bboxes, int num_tris, int max_refs, int num_bins) {
+    // Spatial splits are only considered when the children of an object split overlap by more than this fraction of the root area
+    const float min_overlap = 1e-5f * half_area(nodes[0].min, nodes[0].max);
+
+    auto refs = new std::vector<SpatialBvhBuilder::Reference>(num_tris);
+    #pragma omp parallel for
+    for (int i = 0; i < num_tris; i++)
+        (*refs)[i] = SpatialBvhBuilder::Reference{ bboxes[i], i };
+
+    num_refs = 0;
+    SpatialBvhBuilder builder(verts, indices, prim_ids.get(), nodes.get(), num_nodes, num_refs,
+                              max_refs - num_tris, clamp(num_bins, 2, BinnedBvhBuilder::max_bins()), min_overlap, tri_block);
+
+    #pragma omp parallel
+    {
+        #pragma omp single
+        builder.build_and_delete(0, refs);
+    }
+
+    // Resize the array of primitive indices
+    auto tmp_ids = make_aligned_array<int>(num_refs);
+    std::copy(prim_ids.get(), prim_ids.get() + num_refs, tmp_ids.get());
+    prim_ids = std::move(tmp_ids);
+}
+
+template <typename Key>
+void Bvh::build_linear(const BBox* bboxes, const float3* centers, int num_tris, int sah_levels) {
+    // Compute the bounding box of the centers, in which the Morton codes are computed
+    BBox center_bb = BBox::empty();
+    #pragma omp parallel
+    {
+        BBox local = BBox::empty();
+        #pragma omp for nowait
+        for (int i = 0; i < num_tris; i++)
+            local = extend(local, centers[i]);
+        #pragma omp critical
+        { center_bb = extend(center_bb, local); }
+    }
+
+    const float3 extents = center_bb.max - center_bb.min;
+    const float3 scale(extents.x > 0 ? 1.0f / extents.x : 0.0f,
+                       extents.y > 0 ? 1.0f / extents.y : 0.0f,
+                       extents.z > 0 ? 1.0f / extents.z : 0.0f);
+
+    std::unique_ptr<Key[]> codes(new Key[num_tris]);
+    #pragma omp parallel for
+    for (int i = 0; i < num_tris; i++) {
+        codes[i] = morton_code<Key>((centers[i] - center_bb.min) * scale);
+        prim_ids[i] = i;
+    }
+
+    {
+        std::unique_ptr<Key[]> tmp_codes(new Key[num_tris]);
+        std::unique_ptr<int[]> tmp_ids(new int[num_tris]);
+        radix_sort(codes.get(), prim_ids.get(), tmp_codes.get(), tmp_ids.get(), num_tris, sizeof(Key) == 4 ? 30 : 63);
+    }
+
+    std::unique_ptr<float[]> tmp_costs(sah_levels > 0 ? new float[num_tris] : nullptr);
+    LinearBvhBuilder<Key> builder(bboxes, codes.get(), prim_ids.get(), tmp_costs.get(), nodes.get(), num_nodes, sah_levels, tri_block);
+
+    #pragma omp parallel
+    {
+        #pragma omp single
+        builder.build(0, 0);
+    }
+}
+
+void Bvh::optimize(int num_passes) {
+    if (nodes[0].num_prims > 0) return;
+
+    BvhOptimizer optimizer(nodes.get(), num_nodes, tri_block);
+    for (int i = 0; i < num_passes; i++) {
+        #pragma omp parallel
+        {
+            #pragma omp single
+            optimizer.optimize(0, 0);
+        }
+    }
+}
+
+void Bvh::relayout(bool align) {
+    // The array is resized to fit the nodes exactly, with one padding node after the root if pairs need to be aligned
+    const int first_pair = align ? 2 : 1;
+    auto new_nodes = make_aligned_array<Node>(num_nodes + first_pair - 1);
+    new_nodes[0] = nodes[0];
+    if (align) {
+        new_nodes[1].min = float3(FLT_MAX);
+        new_nodes[1].max = float3(-FLT_MAX);
+        new_nodes[1].child = 0;
+        new_nodes[1].num_prims = 0;
+    }
+
+    // Place the pairs of children in depth-first order, visiting the child with the largest area first,
+    // so that the nodes that are likely to be traversed one after the other are close in memory
+    int next_pair = first_pair;
+    std::vector<std::pair<int, int>> stack;
+    stack.emplace_back(0, 0);
+    while (!stack.empty()) {
+        const int old_id = stack.back().first;
+        const int new_id = stack.back().second;
+        stack.pop_back();
+
+        if (nodes[old_id].num_prims > 0) continue;
+
+        const int old_child = nodes[old_id].child;
+        const int new_child = next_pair;
+        next_pair += 2;
+        new_nodes[new_id].child   = new_child;
+        new_nodes[new_child + 0] = nodes[old_child + 0];
+        new_nodes[new_child + 1] = nodes[old_child + 1];
+
+        const bool left_first = half_area(nodes[old_child].min, nodes[old_child].max) >=
+                                half_area(nodes[old_child + 1].min, nodes[old_child + 1].max);
+        stack.emplace_back(old_child + left_first, new_child + left_first);
+        stack.emplace_back(old_child + !left_first, new_child + !left_first);
+    }
+
+    assert(next_pair == num_nodes + first_pair - 1);
+    num_nodes = next_pair;
+    nodes = std::move(new_nodes);
+}
+
+float Bvh::compute_sah() const {
+    const float traversal_cost = 1.0f;
+    const float inv_root_area = 1.0f / half_area(nodes[0].min, nodes[0].max);
+
+    float cost = 0.0f;
+    #pragma omp parallel for reduction(+:cost)
+    for (int i = 0; i < num_nodes; i++) {
+        const Node& node = nodes[i];
+        const float area = half_area(node.min, node.max) * inv_root_area;
+        cost += node.num_prims > 0 ? leaf_blocks(node.num_prims, tri_block) * area : traversal_cost * area;
+    }
+    return cost;
+}
+
+void Bvh::build(const float3* verts, const int* indices, int num_tris, const BvhSettings& settings) {
+    // Compute per-triangle and global bounding box
+    std::unique_ptr<BBox[]>   bboxes(new BBox[num_tris]);
+    std::unique_ptr<float3[]> centers(new float3[num_tris]);
+
+    #pragma omp parallel for
+    for (int i = 0; i < num_tris; i++) {
+        const float3 v0 = verts[indices[i * 4 + 0]];
+        const float3 v1 = verts[indices[i * 4 + 1]];
+        const float3 v2 = verts[indices[i * 4 + 2]];
+
+        centers[i] = (1.0f / 3.0f) * (v0 + v1 + v2);
+        bboxes[i].min = min(v0, min(v1, v2));
+        bboxes[i].max = max(v0, max(v1, v2));
+    }
+
+    assert(settings.tri_block == 1 || settings.tri_block == 4 || settings.tri_block == 8);
+    tri_block = settings.tri_block;
+    shadow_order = settings.shadow_order;
+
+    build(verts, indices, bboxes.get(), centers.get(), num_tris, settings);
+
+    num_prim_slots = num_refs;
+    if (tri_block > 1) pack_leaves();
+
+    instances.clear();
+    remap_hits = !settings.leaf_order;
+    num_input_prims = num_tris;
+    precompute_tris(verts, indices);
+    build_wide(settings);
+    built_layout_sah = layout_sah = compute_layout_sah();
+    refit_order.clear();
+}
+
+/// Returns the bounding box of an instance in world space, computed from the transformed corners of the instanced BVH.
+static BBox instance_bounds(const BvhInstance& inst) {
+    const BBox& local = inst.bvh->bounds();
+    BBox bb = BBox::empty();
+    for (int j = 0; j < 8; j++) {
+        const float3 corner(j & 1 ? local.max.x : local.min.x,
+                            j & 2 ? local.max.y : local.min.y,
+                            j & 4 ? local.max.z : local.min.z);
+        bb = extend(bb, transform_point(inst.to_world, corner));
+    }
+    return bb;
+}
+
+void Bvh::build(const BvhInstance* insts, int num_insts, const BvhSettings& settings) {
+    instances.assign(insts, insts + num_insts);
+
+    std::unique_ptr<BBox[]>   bboxes(new BBox[num_insts]);
+    std::unique_ptr<float3[]> centers(new float3[num_insts]);
+
+    #pragma omp parallel for
+    for (int i = 0; i < num_insts; i++) {
+        bboxes[i] = instance_bounds(insts[i]);
+        centers[i] = 0.5f * (bboxes[i].min + bboxes[i].max);
+    }
+
+    // Instances are intersected one at a time, and spatial splits are not possible without the triangles
+    BvhSettings top_settings = settings;
+    top_settings.tri_block = 1;
+    if (top_settings.builder == BvhSettings::Builder::Spatial)
+        top_settings.builder = BvhSettings::Builder::Binned;
+
+    tri_block = 1;
+    shadow_order = settings.shadow_order;
+
+    build(nullptr, nullptr, bboxes.get(), centers.get(), num_insts, top_settings);
+    num_prim_slots = num_refs;
+
+    // Hits on instances already refer to the triangles of the instanced BVHs
+    remap_hits = false;
+    num_input_prims = num_insts;
+    build_wide(top_settings);
+    built_layout_sah = layout_sah = compute_layout_sah();
+    refit_order.clear();
+}
+
+void Bvh::precompute_tris(const float3* verts, const int* indices) {
+    auto precompute_tri = [&] (int tri_id) {
+        int i0 = indices[tri_id * 4 + 0];
+        int i1 = indices[tri_id * 4 + 1];
+        int i2 = indices[tri_id * 4 + 2];
+        return PrecomputedTri(verts[i0], verts[i1], verts[i2]);
+    };
+
+    if (tri_block == 4) tris4 = pack_tris<4>(precompute_tri);
+    if (tri_block == 8) tris8 = pack_tris<8>(precompute_tri);
+    if (tri_block == 1) {
+        tris = make_aligned_array<PrecomputedTri>(num_refs);
+
+        #pragma omp parallel for
+        for (int i = 0; i < num_refs; i++)
+            tris[i] = precompute_tri(prim_ids[i]);
+    }
+}
+
+void Bvh::build_wide(const BvhSettings& settings) {
+    assert(settings.width == 2 || settings.width == 4 || settings.width == 8);
+    bvh_width = settings.width;
+    compressed = false;
+    if (bvh_width == 2) return;
+
+    // Collapse the binary tree into a wide BVH, the binary nodes are not needed anymore after that
+    if (bvh_width == 4) nodes4 = collapse<4>();
+    if (bvh_width == 8) nodes8 = collapse<8>();
+    nodes.reset();
+
+    compressed = settings.compress_nodes;
+    if (!compressed) return;
+
+    if (bvh_width == 4) { qnodes4 = compress<4>(nodes4.get()); nodes4.reset(); }
+    if (bvh_width == 8) { qnodes8 = compress<8>(nodes8.get()); nodes8.reset(); }
+}
+
+/// Orders the nodes of a tree by decreasing depth, given the depth of every node (or -1 for nodes that cannot be reached).
+/// Returns the offsets of the levels in that order: the children of the nodes of a level are all in the previous levels.
+static std::vector<int> order_by_depth(const std::vector<int>& depth, std::vector<int>& order) {
+    const int max_depth = *std::max_element(depth.begin(), depth.end());
+    std::vector<int> offsets(max_depth + 2, 0);
+    for (auto d : depth) {
+        if (d >= 0) offsets[max_depth - d + 1]++;
+    }
+    for (int i = 0; i <= max_depth; i++) offsets[i + 1] += offsets[i];
+
+    order.resize(offsets.back());
+    std::vector<int> pos(offsets.begin(), offsets.end() - 1);
+    for (int i = 0, n = depth.size(); i < n; i++) {
+        if (depth[i] >= 0) order[pos[max_depth - depth[i]]++] = i;
+    }
+    return offsets;
+}
+
+/// Processes the nodes one level at a time, starting with the deepest one. The nodes of a level are processed in parallel.
+template <typename F>
+static void for_each_level(const std::vector<int>& order, const std::vector<int>& offsets, F f) {
+    for (int level = 0, n = offsets.size() - 1; level < n; level++) {
+        #pragma omp parallel for schedule(dynamic, 64)
+        for (int i = offsets[level]; i < offsets[level + 1]; i++)
+            f(order[i]);
+    }
+}
+
+template <typename F>
+void Bvh::refit_binary(F prim_bounds) {
+    if (refit_order.empty()) {
+        std::vector<int> depth(num_nodes, -1);
+        depth[0] = 0;
+        for (int i = 0; i < num_nodes; i++) {
+            if (depth[i] < 0 || nodes[i].num_prims > 0) continue;
+            depth[nodes[i].child + 0] = depth[i] + 1;
+            depth[nodes[i].child + 1] = depth[i] + 1;
+        }
+        refit_offsets = order_by_depth(depth, refit_order);
+    }
+
+    for_each_level(refit_order, refit_offsets, [&] (int i) {
+        Node& node = nodes[i];
+        BBox node_bb = BBox::empty();
+        if (node.num_prims > 0) {
+            for (int j = node.first_prim; j < node.first_prim + node.num_prims; j++)
+                node_bb = extend(node_bb, prim_bounds(prim_ids[j]));
+        } else {
+            node_bb = extend(BBox(nodes[node.child].min, nodes[node.child].max),
+                             BBox(nodes[node.child + 1].min, nodes[node.child + 1].max));
+        }
+        node.min = node_bb.min;
+        node.max = node_bb.max;
+    });
+
+    bb = BBox(nodes[0].min, nodes[0].max);
+}
+
+template <int N>
+void Bvh::set_bounds(WideNode<N>& node, const BBox* bbs) {
+    for (int i = 0; i < N; i++) {
+        node.bounds[0][i] = bbs[i].min.x;
+        node.bounds[1][i] = bbs[i].max.x;
+        node.bounds[2][i] = bbs[i].min.y;
+        node.bounds[3][i] = bbs[i].max.y;
+        node.bounds[4][i] = bbs[i].min.z;
+        node.bounds[5][i] = bbs[i].max.z;
+    }
+}
+
+template <int N>
+void Bvh::set_bounds(QuantizedNode<N>& node, const BBox* bbs) {
+    quantize(bbs, node);
+}
+
+template <int N, typename NodeType, typename F>
+void Bvh::refit_wide(NodeType* wide, F prim_bounds) {
+    if (refit_order.empty()) {
+        std::vector<int> depth(num_nodes, -1);
+        depth[0] = 0;
+        for (int i = 0; i < num_nodes; i++) {
+            for (int j = 0; j < N; j++) {
+                if (wide[i].child[j] >= 0 && wide[i].num_prims[j] == 0)
+                    depth[wide[i].child[j]] = depth[i] + 1;
+            }
+        }
+        refit_offsets = order_by_depth(depth, refit_order);
+    }
+
+    // Quantized nodes do not store the exact bounds of their children, so the bounds of every node are kept aside
+    std::vector<BBox> node_bbs(num_nodes);
+    for_each_level(refit_order, refit_offsets, [&] (int i) {
+        NodeType& node = wide[i];
+        BBox bbs[N];
+        BBox node_bb = BBox::empty();
+        for (int j = 0; j < N; j++) {
+            bbs[j] = BBox::empty();
+            if (node.child[j] < 0) continue;
+            if (node.num_prims[j] > 0) {
+                for (int k = node.child[j]; k < node.child[j] + node.num_prims[j]; k++)
+                    bbs[j] = extend(bbs[j], prim_bounds(prim_ids[k]));
+            } else {
+                bbs[j] = node_bbs[node.child[j]];
+            }
+            node_bb = extend(node_bb, bbs[j]);
+        }
+        set_bounds(node, bbs);
+        node_bbs[i] = node_bb;
+    });
+
+    bb = node_bbs[0];
+}
+
+template <typename F>
+void Bvh::refit_nodes(F prim_bounds) {
+    if (compressed && bvh_width == 4) refit_wide<4>(qnodes4.get(), prim_bounds);
+    else if (compressed && bvh_width == 8) refit_wide<8>(qnodes8.get(), prim_bounds);
+    else if (bvh_width == 4) refit_wide<4>(nodes4.get(), prim_bounds);
+    else if (bvh_width == 8) refit_wide<8>(nodes8.get(), prim_bounds);
+    else refit_binary(prim_bounds);
+
+    layout_sah = compute_layout_sah();
+}
+
+void Bvh::refit(const float3* verts, const int* indices) {
+    assert(instances.empty());
+    precompute_tris(verts, indices);
+    refit_nodes([&] (int tri_id) {
+        // Padding slots of triangle blocks do not contain any triangle
+        if (tri_id < 0) return BBox::empty();
+        const float3 v0 = verts[indices[tri_id * 4 + 0]];
+        const float3 v1 = verts[indices[tri_id * 4 + 1]];
+        const float3 v2 = verts[indices[tri_id * 4 + 2]];
+        return BBox(min(v0, min(v1, v2)), max(v0, max(v1, v2)));
+    });
+}
+
+void Bvh::refit() {
+    assert(!instances.empty());
+    refit_nodes([&] (int inst_id) { return instance_bounds(instances[inst_id]); });
+}
+
+bool Bvh::update(const float3* verts, const int* indices, const BvhSettings& settings) {
+    refit(verts, indices);
+    if (sah_ratio() <= settings.rebuild_threshold) return false;
+    build(verts, indices, num_input_prims, settings);
+    return true;
+}
+
+bool Bvh::update(const BvhSettings& settings) {
+    refit();
+    if (sah_ratio() <= settings.rebuild_threshold) return false;
+    // The instances are copied, since the construction overwrites them
+    auto insts = instances;
+    build(insts.data(), insts.size(), settings);
+    return true;
+}
+
+template <int N, typename NodeType>
+float Bvh::compute_wide_sah(const NodeType* wide) const {
+    const float traversal_cost = 1.0f;
+
+    // Same cost model as for binary trees, but the area of every node is obtained from the bounds stored in its parent
+    auto child_bounds = [&] (const NodeType& node, int i) {
+        float planes[6][N];
+        for (int p = 0; p < 6; p++)
+            load_plane(node, p).store(planes[p]);
+        return BBox(float3(planes[0][i], planes[2][i], planes[4][i]),
+                    float3(planes[1][i], planes[3][i], planes[5][i]));
+    };
+
+    BBox root_bb = BBox::empty();
+    for (int i = 0; i < N; i++) {
+        if (wide[0].child[i] >= 0) root_bb = extend(root_bb, child_bounds(wide[0], i));
+    }
+
+    float cost = 0.0f;
+    #pragma omp parallel for reduction(+:cost)
+    for (int i = 0; i < num_nodes; i++) {
+        for (int j = 0; j < N; j++) {
+            if (wide[i].child[j] < 0) continue;
+            const float area = half_area(child_bounds(wide[i], j));
+            cost += wide[i].num_prims[j] > 0 ? leaf_blocks(wide[i].num_prims[j], tri_block) * area : traversal_cost * area;
+        }
+    }
+    return traversal_cost + cost / half_area(root_bb);
+}
+
+float Bvh::compute_layout_sah() const {
+    if (compressed && bvh_width == 4) return compute_wide_sah<4>(qnodes4.get());
+    if (compressed && bvh_width == 8) return compute_wide_sah<8>(qnodes8.get());
+    if (bvh_width == 4) return compute_wide_sah<4>(nodes4.get());
+    if (bvh_width == 8) return compute_wide_sah<8>(nodes8.get());
+    return compute_sah();
+}
+
+void Bvh::save(BinaryWriter& out) const {
+    assert(instances.empty());
+
+    out.write(bb);
+    out.write(num_nodes);
+    out.write(num_refs);
+    out.write(num_prim_slots);
+    out.write(num_input_prims);
+    out.write(bvh_width);
+    out.write(compressed);
+    out.write(tri_block);
+    out.write(shadow_order);
+    out.write(remap_hits);
+    out.write(sah);
+    out.write(layout_sah);
+    out.write(built_layout_sah);
+
+    // Only the node array matching the width and compression of the BVH is in use
+    if (compressed && bvh_width == 4) out.write_array(qnodes4.get(), num_nodes);
+    else if (compressed)              out.write_array(qnodes8.get(), num_nodes);
+    else if (bvh_width == 4)          out.write_array(nodes4.get(), num_nodes);
+    else if (bvh_width == 8)          out.write_array(nodes8.get(), num_nodes);
+    else                              out.write_array(nodes.get(), num_nodes);
+
+    out.write_array(prim_ids.get(), num_prim_slots);
+    if (tri_block == 4)      out.write_array(tris4.get(), num_prim_slots / 4);
+    else if (tri_block == 8) out.write_array(tris8.get(), num_prim_slots / 8);
+    else                     out.write_array(tris.get(), num_refs);
+}
+
+/// Makes an array point to an array of the reader, which must have the expected number of elements.
+template <typename T>
+static void map_array(BinaryReader& in, aligned_array<T>& array, size_t expected) {
+    size_t n;
+    T* ptr = in.read_array<T>(n);
+    if (n != expected) in.fail();
+    array = make_array_view(ptr);
+}
+
+bool Bvh::map(BinaryReader& in) {
+    bb               = in.read<BBox>();
+    num_nodes        = in.read<int>();
+    num_refs         = in.read<int>();
+    num_prim_slots   = in.read<int>();
+    num_input_prims  = in.read<int>();
+    bvh_width        = in.read<int>();
+    compressed       = in.read<bool>();
+    tri_block        = in.read<int>();
+    shadow_order     = in.read<bool>();
+    remap_hits       = in.read<bool>();
+    sah              = in.read<float>();
+    layout_sah       = in.read<float>();
+    built_layout_sah = in.read<float>();
+
+    nodes.reset();
+    nodes4.reset();
+    nodes8.reset();
+    qnodes4.reset();
+    qnodes8.reset();
+    tris.reset();
+    tris4.reset();
+    tris8.reset();
+    instances.clear();
+    refit_order.clear();
+
+    if (compressed && bvh_width == 4) map_array(in, qnodes4, num_nodes);
+    else if (compressed)              map_array(in, qnodes8, num_nodes);
+    else if (bvh_width == 4)          map_array(in, nodes4, num_nodes);
+    else if (bvh_width == 8)          map_array(in, nodes8, num_nodes);
+    else                              map_array(in, nodes, num_nodes);
+
+    map_array(in, prim_ids, num_prim_slots);
+    if (tri_block == 4)      map_array(in, tris4, num_prim_slots / 4);
+    else if (tri_block == 8) map_array(in, tris8, num_prim_slots / 8);
+    else                     map_array(in, tris, num_refs);
+
+    return in.ok() && num_nodes > 0 && (bvh_width == 2 || bvh_width == 4 || bvh_width == 8);
+}
+
+size_t Bvh::node_memory() const {
+    if (compressed) return num_nodes * (bvh_width == 4 ? sizeof(QuantizedNode<4>) : sizeof(QuantizedNode<8>));
+    if (bvh_width == 4) return num_nodes * sizeof(WideNode<4>);
+    if (bvh_width == 8) return num_nodes * sizeof(WideNode<8>);
+    return num_nodes * sizeof(Node);
+}
+
+size_t Bvh::tri_memory() const {
+    if (!instances.empty()) return instances.size() * sizeof(BvhInstance) + num_prim_slots * sizeof(int);
+    return num_prim_slots * (sizeof(PrecomputedTri) + sizeof(int));
+}
+
+template <int N>
+int Bvh::collapse(int node_id, std::vector<WideNode<N>>& wide) const {
+    // Gather the children of the wide node by repeatedly opening the inner node with the largest area
+    int children[N];
+    int count = 0;
+    if (nodes[node_id].num_prims > 0) {
+        children[count++] = node_id;
+    } else {
+        children[count++] = nodes[node_id].child + 0;
+        children[count++] = nodes[node_id].child + 1;
+    }
+
+    while (count < N) {
+        int   best = -1;
+        float best_area = -1.0f;
+        for (int i = 0; i < count; i++) {
+            const Node& node = nodes[children[i]];
+            if (node.num_prims > 0) continue;
+            const float area = half_area(node.min, node.max);
+            if (area > best_area) {
+                best_area = area;
+                best = i;
+            }
+        }
+        if (best < 0) break;
+
+        const int first = nodes[children[best]].child;
+        children[best]    = first + 0;
+        children[count++] = first + 1;
+    }
+
+    const int wide_id = wide.size();
+    wide.emplace_back();
+
+    for (int i = 0; i < N; i++) {
+        float3 min(FLT_MAX), max(-FLT_MAX);
+        int child = -1, num_prims = 0;
+        if (i < count) {
+            const Node& node = nodes[children[i]];
+            min = node.min;
+            max = node.max;
+            if (node.num_prims > 0) {
+                child     = node.first_prim;
+                num_prims = node.num_prims;
+            } else {
+                child = collapse<N>(children[i], wide);
+            }
+        }
+
+        // The vector may have been reallocated by the recursive call
+        WideNode<N>& wide_node = wide[wide_id];
+        wide_node.bounds[0][i] = min.x;
+        wide_node.bounds[1][i] = max.x;
+        wide_node.bounds[2][i] = min.y;
+        wide_node.bounds[3][i] = max.y;
+        wide_node.bounds[4][i] = min.z;
+        wide_node.bounds[5][i] = max.z;
+        wide_node.child[i]     = child;
+        wide_node.num_prims[i] = num_prims;
+    }
+
+    return wide_id;
+}
+
+void Bvh::pack_leaves() {
+    // Every leaf starts on a new block, and the end of its last block is padded with invalid primitive indices
+    int num_slots = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        if (nodes[i].num_prims > 0)
+            num_slots += leaf_blocks(nodes[i].num_prims, tri_block) * tri_block;
+    }
+
+    auto packed_ids = make_aligned_array<int>(num_slots);
+    std::fill(packed_ids.get(), packed_ids.get() + num_slots, -1);
+
+    int first_slot = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        Node& node = nodes[i];
+        if (node.num_prims <= 0) continue;
+
+        std::copy(prim_ids.get() + node.first_prim, prim_ids.get() + node.first_prim + node.num_prims, packed_ids.get() + first_slot);
+        node.first_prim = first_slot;
+        first_slot += leaf_blocks(node.num_prims, tri_block) * tri_block;
+    }
+
+    prim_ids = std::move(packed_ids);
+    num_prim_slots = num_slots;
+}
+
+template <int M, typename F>
+aligned_array<TriBlock<M>> Bvh::pack_tris(F precompute_tri) const {
+    const int num_blocks = num_prim_slots / M;
+    auto blocks = make_aligned_array<TriBlock<M>>(num_blocks);
+
+    #pragma omp parallel for
+    for (int i = 0; i < num_blocks; i++) {
+        for (int j = 0; j < M; j++) {
+            const int tri_id = prim_ids[i * M + j];
+            if (tri_id >= 0) blocks[i].set(j, precompute_tri(tri_id));
+            else             blocks[i].clear(j);
+        }
+    }
+
+    return blocks;
+}
+
+template <int N>
+aligned_array<Bvh::WideNode<N>> Bvh::collapse() {
+    std::vector<WideNode<N>> wide;
+    wide.reserve(num_nodes / (N - 1) + 1);
+    collapse<N>(0, wide);
+
+    auto wide_nodes = make_aligned_array<WideNode<N>>(wide.size());
+    std::copy(wide.begin(), wide.end(), wide_nodes.get());
+    num_nodes = wide.size();
+    return wide_nodes;
+}
+
+/// Returns the power of two by which quantized coordinates are multiplied, given its exponent.
+inline float quantization_scale(int exponent) {
+    return int_as_float((exponent + 127) << 23);
+}
+
+/// Computes the quantization exponent of an axis, such that the whole extent of the node is covered by 8 bits.
+inline int quantization_exponent(float min, float max) {
+    int exponent = max > min ? clamp(int(std::ceil(std::log2((max - min) / 255.0f))), -126, 127) : -126;
+    while (exponent < 127 && min + 255.0f * quantization_scale(exponent) < max) exponent++;
+    return exponent;
+}
+
+template <int N>
+void Bvh::quantize(const BBox* bbs, QuantizedNode<N>& qnode) {
+    BBox node_bb = BBox::empty();
+    for (int i = 0; i < N; i++) {
+        if (!is_empty(bbs[i])) node_bb = extend(node_bb, bbs[i]);
+    }
+
+    qnode.origin = node_bb.min;
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        qnode.exponents[axis] = quantization_exponent(node_bb.min[axis], node_bb.max[axis]);
+        scale[axis] = quantization_scale(qnode.exponents[axis]);
+    }
+    qnode.exponents[3] = 0;
+
+    for (int i = 0; i < N; i++) {
+        if (is_empty(bbs[i])) {
+            for (int axis = 0; axis < 3; axis++) {
+                qnode.bounds[axis * 2 + 0][i] = 255;
+                qnode.bounds[axis * 2 + 1][i] = 0;
+            }
+            continue;
+        }
+
+        // Round the bounds conservatively, using the same expression as the traversal to dequantize them
+        for (int axis = 0; axis < 3; axis++) {
+            const float origin = node_bb.min[axis];
+            int lo = clamp(int(std::floor((bbs[i].min[axis] - origin) / scale[axis])), 0, 255);
+            int hi = clamp(int(std::ceil ((bbs[i].max[axis] - origin) / scale[axis])), 0, 255);
+            while (lo > 0   && origin + lo * scale[axis] > bbs[i].min[axis]) lo--;
+            while (hi < 255 && origin + hi * scale[axis] < bbs[i].max[axis]) hi++;
+            qnode.bounds[axis * 2 + 0][i] = lo;
+            qnode.bounds[axis * 2 + 1][i] = hi;
+        }
+    }
+}
+
+template <int N>
+Bvh::QuantizedNode<N> Bvh::compress(const BBox* bbs, const int* child, const int* num_prims, std::vector<QuantizedNode<N>>& qnodes) const {
+    QuantizedNode<N> qnode;
+    quantize(bbs, qnode);
+
+    for (int i = 0; i < N; i++) {
+        if (is_empty(bbs[i])) {
+            qnode.child[i]     = -1;
+            qnode.num_prims[i] = 0;
+            continue;
+        }
+
+        // Leaves with more primitives than what fits in 8 bits are split in several leaves
+        if (num_prims[i] > 255) {
+            qnode.child[i]     = compress_leaf<N>(bbs[i], child[i], num_prims[i], qnodes);
+            qnode.num_prims[i] = 0;
+        } else {
+            qnode.child[i]     = child[i];
+            qnode.num_prims[i] = num_prims[i];
+        }
+    }
+
+    return qnode;
+}
+
+template <int N>
+int Bvh::compress_leaf(const BBox& bb, int first_prim, int num_prims, std::vector<QuantizedNode<N>>& qnodes) const {
+    BBox bbs[N];
+    int child[N], counts[N];
+    for (int i = 0; i < N; i++) {
+        // Sub-leaves must start on a block boundary
+        const bool last = i == N - 1;
+        const int count = last ? num_prims : std::min(num_prims, 255 / tri_block * tri_block);
+        bbs[i]    = count > 0 ? bb : BBox::empty();
+        child[i]  = first_prim;
+        counts[i] = count;
+        first_prim += count;
+        num_prims  -= count;
+    }
+
+    const int id = qnodes.size();
+    qnodes.emplace_back();
+    auto qnode = compress<N>(bbs, child, counts, qnodes);
+    qnodes[id] = qnode;
+    return id;
+}
+
+template <int N>
+aligned_array<Bvh::QuantizedNode<N>> Bvh::compress(const WideNode<N>* wide) {
+    std::vector<QuantizedNode<N>> qnodes(num_nodes);
+    for (int i = 0; i < num_nodes; i++) {
+        BBox bbs[N];
+        for (int j = 0; j < N; j++) {
+            bbs[j] = BBox(float3(wide[i].bounds[0][j], wide[i].bounds[2][j], wide[i].bounds[4][j]),
+                          float3(wide[i].bounds[1][j], wide[i].bounds[3][j], wide[i].bounds[5][j]));
+        }
+        auto qnode = compress<N>(bbs, wide[i].child, wide[i].num_prims, qnodes);
+        qnodes[i] = qnode;
+    }
+
+    auto quantized = make_aligned_array<QuantizedNode<N>>(qnodes.size());
+    std::copy(qnodes.begin(), qnodes.end(), quantized.get());
+    num_nodes = qnodes.size();
+    return quantized;
+}
+
+template <int M>
+void Bvh::intersect_blocks(const TriBlock<M>* blocks, const Ray& ray, int first_prim, int num_prims, Hit& hit) const {
+    for (int i = first_prim / M, n = (first_prim + num_prims + M - 1) / M; i < n; i++) {
+        const int lane = intersect_ray_tri_block(ray, blocks[i], hit.t, hit.u, hit.v);
+        if (lane >= 0) hit.tri = i * M + lane;
+    }
+}
+
+void Bvh::intersect_instances(const Ray& ray, int first_prim, int num_prims, Hit& hit) const {
+    for (int j = first_prim; j < first_prim + num_prims; j++) {
+        const int id = prim_ids[j];
+        const BvhInstance& inst = instances[id];
+
+        // The direction is not normalized, so that distances along the ray are the same in both spaces
+        Ray local(transform_point(inst.to_local, ray.org), transform_vector(inst.to_local, ray.dir), ray.tmin, hit.t);
+        Hit local_hit;
+        inst.bvh->traverse(local, local_hit);
+        if (local_hit.tri >= 0) {
+            hit = local_hit;
+            hit.tri += inst.first_tri;
+            hit.inst = id;
+        }
+    }
+}
+
+inline void Bvh::intersect_leaf(const Ray& ray, int first_prim, int num_prims, Hit& hit) const {
+    if (tri_block == 4) return intersect_blocks(tris4.get(), ray, first_prim, num_prims, hit);
+    if (tri_block == 8) return intersect_blocks(tris8.get(), ray, first_prim, num_prims, hit);
+    if (!instances.empty()) return intersect_instances(ray, first_prim, num_prims, hit);
+
+    for (int j = first_prim; j < first_prim + num_prims; j++) {
+        if (intersect_ray_tri(ray, tris[j], hit.t, hit.u, hit.v))
+            hit.tri = j;
+    }
+}
+
+void Bvh::traverse(const Ray& ray, Hit& hit) const {
+    if (compressed && bvh_width == 4) return traverse_wide<4>(qnodes4.get(), ray, hit);
+    if (compressed && bvh_width == 8) return traverse_wide<8>(qnodes8.get(), ray, hit);
+    if (bvh_width == 4) return traverse_wide<4>(nodes4.get(), ray, hit);
+    if (bvh_width == 8) return traverse_wide<8>(nodes8.get(), ray, hit);
+
+    constexpr int stack_size = 64;
+    int stack[stack_size];
+    int top = nodes[0].child;
+    int stack_ptr = 0;
+
+    hit.tri = -1;
+    hit.t = ray.tmax;
+    hit.u = 0;
+    hit.v = 0;
+    hit.inst = -1;
+
+    // The root is only a leaf for very small BVHs, such as a top-level BVH with a single instance
+    if (nodes[0].num_prims > 0) {
+        intersect_leaf(ray, nodes[0].first_prim, nodes[0].num_prims, hit);
+        top = -1;
+    }
+
+    int ox = ray.dir.x > 0 ? 0 : 4;
+    int oy = ray.dir.y > 0 ? 1 : 5;
+    int oz = ray.dir.z > 0 ? 2 : 6;
+    auto idir = float3(1.0f) / ray.dir;
+    auto oidir = ray.org * idir;
+
+    stack[0] = -1;
+    while (top >= 0) {
+        auto& left  = nodes[top + 0];
+        auto& right = nodes[top + 1];
+
+        // Intersect the two children of this node
+        auto p0 = reinterpret_cast<const float*>(&left);
+        auto p1 = reinterpret_cast<const float*>(&right);
+        auto t00x = p0[    ox] * idir.x - oidir.x;
+        auto t10x = p1[    ox] * idir.x - oidir.x;
+        auto t00y = p0[    oy] * idir.y - oidir.y;
+        auto t10y = p1[    oy] * idir.y - oidir.y;
+        auto t00z = p0[    oz] * idir.z - oidir.z;
+        auto t10z = p1[    oz] * idir.z - oidir.z;
+        auto t01x = p0[4 - ox] * idir.x - oidir.x;
+        auto t11x = p1[4 - ox] * idir.x - oidir.x;
+        auto t01y = p0[6 - oy] * idir.y - oidir.y;
+        auto t11y = p1[6 - oy] * idir.y - oidir.y;
+        auto t01z = p0[8 - oz] * idir.z - oidir.z;
+        auto t11z = p1[8 - oz] * idir.z - oidir.z;
+        float t0[2], t1[2];
+        t0[0] = std::max(std::max(ray.tmin, t00x), std::max(t00y, t00z));
+        t0[1] = std::max(std::max(ray.tmin, t10x), std::max(t10y, t10z));
+        t1[0] = std::min(std::min(hit.t, t01x), std::min(t01y, t01z));
+        t1[1] = std::min(std::min(hit.t, t11x), std::min(t11y, t11z));
+
+        const int old_ptr = stack_ptr;
+
+        if (t0[0] <= t1[0]) {
+            if (left.num_prims > 0) intersect_leaf(ray, left.first_prim, left.num_prims, hit);
+            else stack[++stack_ptr] = left.child;
+        }
+
+        if (t0[1] <= t1[1]) {
+            if (right.num_prims > 0) intersect_leaf(ray, right.first_prim, right.num_prims, hit);
+            else stack[++stack_ptr] = right.child;
+        }
+
+        // Reorder the children on the stack
+        if (old_ptr + 2 <= stack_ptr && t0[0] < t0[1])
+            std::swap(stack[stack_ptr], stack[stack_ptr - 1]);
+
+        top = stack[stack_ptr--];
+    }
+
+    if (hit.tri >= 0 && remap_hits) hit.tri = prim_ids[hit.tri];
+}
+
+/// Returns the lower bound of the product of the intervals [a_lo, a_hi] and [b_lo, b_hi].
+inline float interval_mul_min(float a_lo, float a_hi, float b_lo, float b_hi) {
+    return std::min(std::min(a_lo * b_lo, a_lo * b_hi), std::min(a_hi * b_lo, a_hi * b_hi));
+}
+
+/// Returns the upper bound of the product of the intervals [a_lo, a_hi] and [b_lo, b_hi].
+inline float interval_mul_max(float a_lo, float a_hi, float b_lo, float b_hi) {
+    return std::max(std::max(a_lo * b_lo, a_lo * b_hi), std::max(a_hi * b_lo, a_hi * b_hi));
+}
+
+void Bvh::traverse_packet(const Ray* rays, Hit* hits, int n) const {
+    assert(n <= max_packet_size);
+
+    // The interval test below requires the ray directions to have the same sign on every axis, and a root that is not a leaf
+    bool coherent = bvh_width == 2 && instances.empty() && nodes[0].num_prims <= 0;
+    for (int i = 1; i < n && coherent; i++) {
+        coherent = (rays[i].dir.x > 0) == (rays[0].dir.x > 0) &&
+                   (rays[i].dir.y > 0) == (rays[0].dir.y > 0) &&
+                   (rays[i].dir.z > 0) == (rays[0].dir.z > 0);
+    }
+    if (!coherent) {
+        for (int i = 0; i < n; i++) traverse(rays[i], hits[i]);
+        return;
+    }
+
+    // Per-ray data, and bounds of the origins, inverse directions and ray intervals of the whole packet
+    float3 idir[max_packet_size], oidir[max_packet_size];
+    float3 org_lo(FLT_MAX), org_hi(-FLT_MAX);
+    float3 idir_lo(FLT_MAX), idir_hi(-FLT_MAX);
+    float tmin = FLT_MAX, tmax = -FLT_MAX;
+    for (int i = 0; i < n; i++) {
+        hits[i].tri = -1;
+        hits[i].t = rays[i].tmax;
+        hits[i].u = 0;
+        hits[i].v = 0;
+        hits[i].inst = -1;
+
+        idir[i] = float3(1.0f) / rays[i].dir;
+        oidir[i] = rays[i].org * idir[i];
+        org_lo = min(org_lo, rays[i].org);
+        org_hi = max(org_hi, rays[i].org);
+        idir_lo = min(idir_lo, idir[i]);
+        idir_hi = max(idir_hi, idir[i]);
+        tmin = std::min(tmin, rays[i].tmin);
+        tmax = std::max(tmax, rays[i].tmax);
+    }
+
+    const int ox = rays[0].dir.x > 0 ? 0 : 4;
+    const int oy = rays[0].dir.y > 0 ? 1 : 5;
+    const int oz = rays[0].dir.z > 0 ? 2 : 6;
+
+    // Intersects one ray of the packet with a box, and returns the entry distance in t
+    auto intersect_ray = [&] (const float* p, int i, float& t) {
+        auto t0x = p[    ox] * idir[i].x - oidir[i].x;
+        auto t0y = p[    oy] * idir[i].y - oidir[i].y;
+        auto t0z = p[    oz] * idir[i].z - oidir[i].z;
+        auto t1x = p[4 - ox] * idir[i].x - oidir[i].x;
+        auto t1y = p[6 - oy] * idir[i].y - oidir[i].y;
+        auto t1z = p[8 - oz] * idir[i].z - oidir[i].z;
+        t = std::max(std::max(rays[i].tmin, t0x), std::max(t0y, t0z));
+        return t <= std::min(std::min(hits[i].t, t1x), std::min(t1y, t1z));
+    };
+
+    // Conservative test that returns false only if no ray of the packet can intersect the box
+    auto intersect_interval = [&] (const float* p) {
+        float t0 = tmin, t1 = tmax;
+        t0 = std::max(t0, interval_mul_min(p[    ox] - org_hi.x, p[    ox] - org_lo.x, idir_lo.x, idir_hi.x));
+        t0 = std::max(t0, interval_mul_min(p[    oy] - org_hi.y, p[    oy] - org_lo.y, idir_lo.y, idir_hi.y));
+        t0 = std::max(t0, interval_mul_min(p[    oz] - org_hi.z, p[    oz] - org_lo.z, idir_lo.z, idir_hi.z));
+        t1 = std::min(t1, interval_mul_max(p[4 - ox] - org_hi.x, p[4 - ox] - org_lo.x, idir_lo.x, idir_hi.x));
+        t1 = std::min(t1, interval_mul_max(p[6 - oy] - org_hi.y, p[6 - oy] - org_lo.y, idir_lo.y, idir_hi.y));
+        t1 = std::min(t1, interval_mul_max(p[8 - oz] - org_hi.z, p[8 - oz] - org_lo.z, idir_lo.z, idir_hi.z));
+        return t0 <= t1;
+    };
+
+    // Returns the first ray, starting at 'first', that intersects the box, or n if there is none.
+    // Coherent rays usually hit the box with the first ray, or miss it with the interval test.
+    auto first_active = [&] (const float* p, int first, float& t) {
+        if (intersect_ray(p, first, t)) return first;
+        if (!intersect_interval(p)) return n;
+        for (int i = first + 1; i < n; i++) {
+            if (intersect_ray(p, i, t)) return i;
+        }
+        return n;
+    };
+
+    constexpr int stack_size = 64;
+    struct {
+        int node;
+        int first;
+    } stack[stack_size];
+    int stack_ptr = 0;
+
+    stack[0].node  = nodes[0].child;
+    stack[0].first = 0;
+    while (stack_ptr >= 0) {
+        const auto top = stack[stack_ptr--];
+        const int old_ptr = stack_ptr;
+
+        float t0[2];
+        for (int c = 0; c < 2; c++) {
+            const Node& child = nodes[top.node + c];
+            const auto p = reinterpret_cast<const float*>(&child);
+            const int first = first_active(p, top.first, t0[c]);
+            if (first >= n) continue;
+
+            if (child.num_prims > 0) {
+                float t;
+                for (int i = first; i < n; i++) {
+                    if (i == first || intersect_ray(p, i, t))
+                        intersect_leaf(rays[i], child.first_prim, child.num_prims, hits[i]);
+                }
+
+                // The interval test can only use the farthest hit of the packet
+                tmax = hits[0].t;
+                for (int i = 1; i < n; i++) tmax = std::max(tmax, hits[i].t);
+            } else {
+                stack_ptr++;
+                assert(stack_ptr < stack_size);
+                stack[stack_ptr].node  = child.child;
+                stack[stack_ptr].first = first;
+            }
+        }
+
+        // Reorder the children on the stack, using the entry distance of their first active ray
+        if (old_ptr + 2 <= stack_ptr && t0[0] < t0[1])
+            std::swap(stack[stack_ptr], stack[stack_ptr - 1]);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (hits[i].tri >= 0 && remap_hits) hits[i].tri = prim_ids[hits[i].tri];
+    }
+}
+
+template <int N>
+vfloat<N> Bvh::load_plane(const WideNode<N>& node, int plane) {
+    return vfloat<N>::load(node.bounds[plane]);
+}
+
+template <int N>
+vfloat<N> Bvh::load_plane(const QuantizedNode<N>& node, int plane) {
+    const int axis = plane / 2;
+    return vfloat<N>(node.origin[axis]) + vfloat<N>::load(node.bounds[plane]) * vfloat<N>(quantization_scale(node.exponents[axis]));
+}
+
+template <int N, typename NodeType>
+void Bvh::traverse_wide(const NodeType* wide, const Ray& ray, Hit& hit) const {
+    constexpr int stack_size = 32 * N;
+    struct {
+        int node;
+        float t;
+    } stack[stack_size];
+    int stack_ptr = 0;
+
+    hit.tri = -1;
+    hit.t = ray.tmax;
+    hit.u = 0;
+    hit.v = 0;
+    hit.inst = -1;
+
+    // Offsets of the near and far planes in the bounds array, depending on the ray direction
+    const int ox = ray.dir.x > 0 ? 0 : 1;
+    const int oy = ray.dir.y > 0 ? 2 : 3;
+    const int oz = ray.dir.z > 0 ? 4 : 5;
+    auto idir = float3(1.0f) / ray.dir;
+    auto oidir = ray.org * idir;
+
+    const vfloat<N> idir_x(idir.x), idir_y(idir.y), idir_z(idir.z);
+    const vfloat<N> oidir_x(oidir.x), oidir_y(oidir.y), oidir_z(oidir.z);
+    const vfloat<N> tmin(ray.tmin);
+
+    stack[0].node = 0;
+    stack[0].t = ray.tmin;
+    while (stack_ptr >= 0) {
+        const auto top = stack[stack_ptr--];
+        if (top.t > hit.t) continue;
+
+        // Intersect all the children of this node at once
+        const NodeType& node = wide[top.node];
+        auto t0x = load_plane(node,     ox) * idir_x - oidir_x;
+        auto t1x = load_plane(node, 1 - ox) * idir_x - oidir_x;
+        auto t0y = load_plane(node,     oy) * idir_y - oidir_y;
+        auto t1y = load_plane(node, 5 - oy) * idir_y - oidir_y;
+        auto t0z = load_plane(node,     oz) * idir_z - oidir_z;
+        auto t1z = load_plane(node, 9 - oz) * idir_z - oidir_z;
+        auto t0 = max(max(tmin, t0x), max(t0y, t0z));
+        auto t1 = min(min(vfloat<N>(hit.t), t1x), min(t1y, t1z));
+
+        int mask = mask_le(t0, t1);
+        if (!mask) continue;
+
+        float dist[N];
+        t0.store(dist);
+
+        // Intersect the leaves and push the inner nodes, sorted so that the closest one is on top of the stack
+        const int old_ptr = stack_ptr;
+        for (; mask; mask &= mask - 1) {
+            const int i = first_bit(mask);
+            if (node.child[i] < 0) continue;
+            if (node.num_prims[i] > 0) {
+                intersect_leaf(ray, node.child[i], node.num_prims[i], hit);
+            } else {
+                int j = ++stack_ptr;
+                assert(stack_ptr < stack_size);
+                while (j > old_ptr + 1 && stack[j - 1].t < dist[i]) {
+                    stack[j] = stack[j - 1];
+                    j--;
+                }
+                stack[j].node = node.child[i];
+                stack[j].t    = dist[i];
+            }
+        }
+    }
+
+    if (hit.tri >= 0 && remap_hits) hit.tri = prim_ids[hit.tri];
+}
+
+template <int M>
+bool Bvh::occluded_blocks(const TriBlock<M>* blocks, const Ray& ray, int first_prim, int num_prims) const {
+    for (int i = first_prim / M, n = (first_prim + num_prims + M - 1) / M; i < n; i++) {
+        if (occluded_ray_tri_block(ray, blocks[i])) return true;
+    }
+    return false;
+}
+
+bool Bvh::occluded_instances(const Ray& ray, int first_prim, int num_prims) const {
+    for (int j = first_prim; j < first_prim + num_prims; j++) {
+        const BvhInstance& inst = instances[prim_ids[j]];
+        Ray local(transform_point(inst.to_local, ray.org), transform_vector(inst.to_local, ray.dir), ray.tmin, ray.tmax);
+        if (inst.bvh->occluded(local)) return true;
+    }
+    return false;
+}
+
+inline bool Bvh::occluded_leaf(const Ray& ray, int first_prim, int num_prims) const {
+    if (tri_block == 4) return occluded_blocks(tris4.get(), ray, first_prim, num_prims);
+    if (tri_block == 8) return occluded_blocks(tris8.get(), ray, first_prim, num_prims);
+    if (!instances.empty()) return occluded_instances(ray, first_prim, num_prims);
+
+    float t = ray.tmax, u, v;
+    for (int j = first_prim; j < first_prim + num_prims; j++) {
+        if (intersect_ray_tri(ray, tris[j], t, u, v)) return true;
+    }
+    return false;
+}
+
+template <bool Ordered>
+bool Bvh::occluded_binary(const Ray& ray) const {
+    if (nodes[0].num_prims > 0) return occluded_leaf(ray, nodes[0].first_prim, nodes[0].num_prims);
+
+    constexpr int stack_size = 64;
+    int stack[stack_size];
+    int top = nodes[0].child;
+    int stack_ptr = 0;
+
+    int ox = ray.dir.x > 0 ? 0 : 4;
+    int oy = ray.dir.y > 0 ? 1 : 5;
+    int oz = ray.dir.z > 0 ? 2 : 6;
+    auto idir = float3(1.0f) / ray.dir;
+    auto oidir = ray.org * idir;
+
+    stack[0] = -1;
+    while (top >= 0) {
+        auto& left  = nodes[top + 0];
+        auto& right = nodes[top + 1];
+
+        // Same slab test as in traverse(), but against a fixed ray interval
+        auto p0 = reinterpret_cast<const float*>(&left);
+        auto p1 = reinterpret_cast<const float*>(&right);
+        auto t00x = p0[    ox] * idir.x - oidir.x;
+        auto t10x = p1[    ox] * idir.x - oidir.x;
+        auto t00y = p0[    oy] * idir.y - oidir.y;
+        auto t10y = p1[    oy] * idir.y - oidir.y;
+        auto t00z = p0[    oz] * idir.z - oidir.z;
+        auto t10z = p1[    oz] * idir.z - oidir.z;
+        auto t01x = p0[4 - ox] * idir.x - oidir.x;
+        auto t11x = p1[4 - ox] * idir.x - oidir.x;
+        auto t01y = p0[6 - oy] * idir.y - oidir.y;
+        auto t11y = p1[6 - oy] * idir.y - oidir.y;
+        auto t01z = p0[8 - oz] * idir.z - oidir.z;
+        auto t11z = p1[8 - oz] * idir.z - oidir.z;
+        const bool hit_left  = std::max(std::max(ray.tmin, t00x), std::max(t00y, t00z)) <=
+                               std::min(std::min(ray.tmax, t01x), std::min(t01y, t01z));
+        const bool hit_right = std::max(std::max(ray.tmin, t10x), std::max(t10y, t10z)) <=
+                               std::min(std::min(ray.tmax, t11x), std::min(t11y, t11z));
+
+        const int old_ptr = stack_ptr;
+
+        if (hit_left) {
+            if (left.num_prims > 0) {
+                if (occluded_leaf(ray, left.first_prim, left.num_prims)) return true;
+            } else stack[++stack_ptr] = left.child;
+        }
+
+        if (hit_right) {
+            if (right.num_prims > 0) {
+                if (occluded_leaf(ray, right.first_prim, right.num_prims)) return true;
+            } else stack[++stack_ptr] = right.child;
+        }
+
+        // Visit first the child whose near corner comes first along the ray direction
+        if (Ordered && old_ptr + 2 <= stack_ptr &&
+            dot(float3(p0[ox], p0[oy], p0[oz]), ray.dir) < dot(float3(p1[ox], p1[oy], p1[oz]), ray.dir))
+            std::swap(stack[stack_ptr], stack[stack_ptr - 1]);
+
+        top = stack[stack_ptr--];
+    }
+
+    return false;
+}
+
+template <int N, bool Ordered, typename NodeType>
+bool Bvh::occluded_wide(const NodeType* wide, const Ray& ray) const {
+    constexpr int stack_size = 32 * N;
+    int stack[stack_size];
+    int stack_ptr = 0;
+
+    const int ox = ray.dir.x > 0 ? 0 : 1;
+    const int oy = ray.dir.y > 0 ? 2 : 3;
+    const int oz = ray.dir.z > 0 ? 4 : 5;
+    auto idir = float3(1.0f) / ray.dir;
+    auto oidir = ray.org * idir;
+
+    const vfloat<N> idir_x(idir.x), idir_y(idir.y), idir_z(idir.z);
+    const vfloat<N> oidir_x(oidir.x), oidir_y(oidir.y), oidir_z(oidir.z);
+    const vfloat<N> tmin(ray.tmin), tmax(ray.tmax);
+
+    stack[0] = 0;
+    while (stack_ptr >= 0) {
+        const NodeType& node = wide[stack[stack_ptr--]];
+        auto near_x = load_plane(node, ox);
+        auto near_y = load_plane(node, oy);
+        auto near_z = load_plane(node, oz);
+        auto t0x = near_x * idir_x - oidir_x;
+        auto t1x = load_plane(node, 1 - ox) * idir_x - oidir_x;
+        auto t0y = near_y * idir_y - oidir_y;
+        auto t1y = load_plane(node, 5 - oy) * idir_y - oidir_y;
+        auto t0z = near_z * idir_z - oidir_z;
+        auto t1z = load_plane(node, 9 - oz) * idir_z - oidir_z;
+        auto t0 = max(max(tmin, t0x), max(t0y, t0z));
+        auto t1 = min(min(tmax, t1x), min(t1y, t1z));
+
+        int mask = mask_le(t0, t1);
+        if (!mask) continue;
+
+        // Project the near corners of the children on the ray direction, to visit them in that order
+        float keys[N];
+        if (Ordered) {
+            auto proj = near_x * vfloat<N>(ray.dir.x) + near_y * vfloat<N>(ray.dir.y) + near_z * vfloat<N>(ray.dir.z);
+            proj.store(keys);
+        }
+
+        const int old_ptr = stack_ptr;
+        float pushed_keys[N];
+        for (; mask; mask &= mask - 1) {
+            const int i = first_bit(mask);
+            if (node.child[i] < 0) continue;
+            if (node.num_prims[i] > 0) {
+                if (occluded_leaf(ray, node.child[i], node.num_prims[i])) return true;
+            } else {
+                int j = ++stack_ptr;
+                assert(stack_ptr < stack_size);
+                if (Ordered) {
+                    while (j > old_ptr + 1 && pushed_keys[j - old_ptr - 2] < keys[i]) {
+                        stack[j] = stack[j - 1];
+                        pushed_keys[j - old_ptr - 1] = pushed_keys[j - old_ptr - 2];
+                        j--;
+                    }
+                    pushed_keys[j - old_ptr - 1] = keys[i];
+                }
+                stack[j] = node.child[i];
+            }
+        }
+    }
+
+    return false;
+}
+
+template <bool Ordered>
+bool Bvh::occluded(const Ray& ray) const {
+    if (compressed && bvh_width == 4) return occluded_wide<4, Ordered>(qnodes4.get(), ray);
+    if (compressed && bvh_width == 8) return occluded_wide<8, Ordered>(qnodes8.get(), ray);
+    if (bvh_width == 4) return occluded_wide<4, Ordered>(nodes4.get(), ray);
+    if (bvh_width == 8) return occluded_wide<8, Ordered>(nodes8.get(), ray);
+    return occluded_binary<Ordered>(ray);
+}
+
+bool Bvh::occluded(const Ray& ray) const {
+    return shadow_order ? occluded<true>(ray) : occluded<false>(ray);
 }
@@ -1,27 +1,175 @@
 #ifndef BVH_H
 #define BVH_H
 
+#include <cstdint>
 #include <memory>
+#include <vector>
 
 #include "float3.h"
 #include "intersect.h"
 #include "bbox.h"
+#include "simd.h"
+#include "transform.h"
+
+/// Options controlling the construction and the memory layout of a BVH.
+struct BvhSettings {
+    /// Algorithm used to build the binary tree.
+    enum class Builder {
+        Sweep,      ///< Full SAH sweep over presorted primitive lists (slow build, best quality)
+        Binned,     ///< Binned SAH (fast build, slightly lower quality)
+        Spatial,    ///< Binned SAH with spatial splits (SBVH, slowest build, fewer overlapping nodes)
+        Linear      ///< Morton code ordering (LBVH, fastest build, lowest quality)
+    };
+
+    Builder builder;        ///< Algorithm used to build the tree
+    int num_bins;           ///< Number of bins per axis for the binned and spatial builders
+    float spatial_budget;   ///< Maximum number of triangle references per triangle for the spatial builder
+    int morton_bits;        ///< Number of bits of the Morton codes for the linear builder: 30 or 63
+    int sah_levels;         ///< Number of levels at the top of the linear BVH that are split with the SAH
+    int optimize_passes;    ///< Number of treelet restructuring passes run after construction (0 to disable)
+    bool align_nodes;       ///< Aligns every pair of sibling nodes on a 64-byte cache line
+    bool compress_nodes;    ///< Stores the bounds of wide nodes quantized to 8 bits (requires a width of 4 or 8)
+    int tri_block;          ///< Number of triangles per SIMD block in the leaves: 1 (scalar), 4 or 8
+    int width;              ///< Number of children per node: 2 (binary), 4 or 8 (SIMD-friendly wide BVH)
+    bool shadow_order;      ///< Visits the children in approximate front-to-back order when testing occlusion
+    float rebuild_threshold;///< Maximum ratio between the SAH cost of a refitted BVH and its cost after construction, above which Bvh::update() rebuilds it
+    bool leaf_order;        ///< Reports hits with the index of the primitive slot in the leaves instead of the triangle index (see Bvh::prim_id())
+
+    BvhSettings()
+        : builder(Builder::Sweep), num_bins(16), spatial_budget(1.5f), morton_bits(30), sah_levels(0), optimize_passes(0), align_nodes(false), compress_nodes(false), tri_block(1), width(2), shadow_order(false), rebuild_threshold(1.5f), leaf_order(false)
+    {}
+};
+
+class Bvh;
+class BinaryWriter;
+class BinaryReader;
+
+/// Instance of a bottom-level BVH in a two-level BVH.
+struct BvhInstance {
+    Transform to_world;   ///< Transformation from the space of the instanced BVH to world space
+    Transform to_local;   ///< Inverse transformation, applied to the rays
+    const Bvh* bvh;       ///< Instanced BVH, which must outlive the two-level BVH
+    int first_tri;        ///< Offset added to the triangle indices of the instanced BVH
+};
 
 /// Bounding Volume Hierarchy.
 class Bvh {
 public:
+    /// Maximum number of rays in a packet.
+    static constexpr int max_packet_size = 64;
+
+    Bvh() : num_nodes(0), num_refs(0), num_prim_slots(0), num_input_prims(0), bvh_width(2), compressed(false), tri_block(1), shadow_order(false), remap_hits(true), sah(0), layout_sah(0), built_layout_sah(0) {}
+
     /// Builds a BVH given a list of vertices and a list of indices.
-    void build(const float3* verts, const int* indices, int num_tris);
+    void build(const float3* verts, const int* indices, int num_tris, const BvhSettings& settings = BvhSettings());
+    /// Builds a top-level BVH over a list of instances of other BVHs. The hits reported by this BVH contain the index of the
+    /// instance, and the index of the triangle offset by the first_tri member of the instance. The nodes use the given width,
+    /// but spatial splits and triangle blocks are disabled.
+    void build(const BvhInstance* instances, int num_instances, const BvhSettings& settings = BvhSettings());
+
+    /// Updates the bounds of the nodes after the vertices have moved, without changing the structure of the tree.
+    /// The indices must be the same as the ones given for the construction. Refitting is much faster than a full
+    /// construction, but the quality of the tree degrades as the geometry deforms (see sah_ratio()).
+    void refit(const float3* verts, const int* indices);
+    /// Updates the bounds of a top-level BVH after the instanced BVHs have been refitted or rebuilt.
+    void refit();
+    /// Refits the BVH, and rebuilds it if the SAH cost after refitting exceeds the cost after construction by more
+    /// than the rebuild threshold of the settings. Returns true if the BVH was rebuilt.
+    bool update(const float3* verts, const int* indices, const BvhSettings& settings = BvhSettings());
+    /// Same as above, for a top-level BVH.
+    bool update(const BvhSettings& settings = BvhSettings());
+
+    /// Writes a BVH built over triangles to a binary stream, so that it can be loaded with map().
+    void save(BinaryWriter&) const;
+    /// Loads a BVH written with save(). The nodes and triangle data are not copied: the BVH directly uses the memory of
+    /// the reader, which must outlive it, and be writable if the BVH is refitted. Returns false if the data is invalid.
+    bool map(BinaryReader&);
 
-    /// Traverses the BVH in order to find the closest intersection, or any intersection if 'any' is set.
-    void traverse(const Ray& ray, Hit& hit, bool any = false) const;
+    /// Traverses the BVH in order to find the closest intersection.
+    void traverse(const Ray& ray, Hit& hit) const;
+    /// Traverses the BVH with a packet of coherent rays (e.g. camera rays for a block of pixels), to find the closest intersection
+    /// of each ray. Falls back to traverse() for wide BVHs and for packets whose ray directions do not have the same signs.
+    void traverse_packet(const Ray* rays, Hit* hits, int n) const;
+    /// Returns true if the ray intersects any triangle within [ray.tmin, ray.tmax]. Faster than traverse().
+    bool occluded(const Ray& ray) const;
+
+    /// Returns the number of instances of a top-level BVH, or 0 for a BVH built over triangles.
+    int instance_count() const { return instances.size(); }
+    /// Returns the instance with the given index.
+    const BvhInstance& instance(int i) const { return instances[i]; }
+    /// Returns the number of primitive slots in the leaves, including the padding of triangle blocks.
+    int prim_slot_count() const { return num_prim_slots; }
+    /// Returns the index of the primitive stored in a leaf slot, or -1 for padding slots. Hits reported by a BVH built
+    /// with the leaf order setting contain slot indices, so that per-triangle data can be stored in the order of the leaves.
+    int prim_id(int slot) const { return prim_ids[slot]; }
+    /// Returns the bounding box of the BVH.
+    const BBox& bounds() const { return bb; }
 
     /// Returns the number of nodes in the BVH.
     int node_count() const { return num_nodes; }
+    /// Returns the number of triangle references in the leaves (greater than the number of triangles with spatial splits).
+    int ref_count() const { return num_refs; }
+    /// Returns the number of children per node.
+    int width() const { return bvh_width; }
+    /// Returns the SAH cost of the binary tree, relative to the cost of intersecting one triangle (or one block of triangles).
+    float sah_cost() const { return sah; }
+    /// Returns the ratio between the current SAH cost of the nodes (after refitting) and their cost right after construction.
+    float sah_ratio() const { return layout_sah / built_layout_sah; }
+    /// Returns the memory used by the nodes, in bytes.
+    size_t node_memory() const;
+    /// Returns the memory used by the triangle data and the primitive indices, in bytes.
+    size_t tri_memory() const;
 private:
-    void build(const BBox*, const float3*, int);
+    template <int N> struct WideNode;
+    template <int N> struct QuantizedNode;
+
+    void build(const float3*, const int*, const BBox*, const float3*, int, const BvhSettings&);
+    void build_wide(const BvhSettings&);
+    void precompute_tris(const float3*, const int*);
+    void build_sweep(const BBox*, const float3*, int);
+    void build_binned(const BBox*, const float3*, int, int);
+    void build_spatial(const float3*, const int*, const BBox*, int, int, int);
+    template <typename Key> void build_linear(const BBox*, const float3*, int, int);
+    void optimize(int);
+    void relayout(bool);
+    void pack_leaves();
+    template <int M, typename F> aligned_array<TriBlock<M>> pack_tris(F) const;
+    float compute_sah() const;
+    template <int N, typename NodeType> float compute_wide_sah(const NodeType*) const;
+    float compute_layout_sah() const;
+
+    template <typename F> void refit_nodes(F);
+    template <typename F> void refit_binary(F);
+    template <int N, typename NodeType, typename F> void refit_wide(NodeType*, F);
+    template <int N> static void set_bounds(WideNode<N>&, const BBox*);
+    template <int N> static void set_bounds(QuantizedNode<N>&, const BBox*);
+
+    template <int N> aligned_array<WideNode<N>> collapse();
+    template <int N> int collapse(int, std::vector<WideNode<N>>&) const;
+    template <int N> aligned_array<QuantizedNode<N>> compress(const WideNode<N>*);
+    template <int N> QuantizedNode<N> compress(const BBox*, const int*, const int*, std::vector<QuantizedNode<N>>&) const;
+    template <int N> static void quantize(const BBox*, QuantizedNode<N>&);
+    template <int N> int compress_leaf(const BBox&, int, int, std::vector<QuantizedNode<N>>&) const;
+
+    template <int N> static vfloat<N> load_plane(const WideNode<N>&, int);
+    template <int N> static vfloat<N> load_plane(const QuantizedNode<N>&, int);
+    template <int N, typename NodeType> void traverse_wide(const NodeType*, const Ray&, Hit&) const;
+    template <int M> void intersect_blocks(const TriBlock<M>*, const Ray&, int, int, Hit&) const;
+    void intersect_instances(const Ray&, int, int, Hit&) const;
+    void intersect_leaf(const Ray&, int, int, Hit&) const;
+
+    template <bool Ordered> bool occluded(const Ray&) const;
+    template <bool Ordered> bool occluded_binary(const Ray&) const;
+    template <int N, bool Ordered, typename NodeType> bool occluded_wide(const NodeType*, const Ray&) const;
+    template <int M> bool occluded_blocks(const TriBlock<M>*, const Ray&, int, int) const;
+    bool occluded_instances(const Ray&, int, int) const;
+    bool occluded_leaf(const Ray&, int, int) const;
 
     friend struct BvhBuilder;
+    friend struct BinnedBvhBuilder;
+    friend struct SpatialBvhBuilder;
+    template <typename Key> friend struct LinearBvhBuilder;
+    friend struct BvhOptimizer;
 
     struct Node {
         float3 min;           ///< Min. BB corners
@@ -36,10 +184,52 @@ private:
         };
     };
 
-    std::unique_ptr<Node[]>           nodes;
-    std::unique_ptr<int[]>            prim_ids;
-    std::unique_ptr<PrecomputedTri[]> tris;
+    static_assert(sizeof(Node) == 32, "BVH nodes must be 32 bytes, so that a pair of siblings fits in a cache line");
+
+    /// Node of a wide BVH, with the bounding boxes of all the children stored as a structure of arrays.
+    template <int N>
+    struct WideNode {
+        float bounds[6][N];   ///< Min. and max. BB corners of each child, in the order min x, max x, min y, max y, min z, max z
+        int   child[N];       ///< Index of the child node, index of the first primitive for leaves, or -1 for empty slots
+        int   num_prims[N];   ///< Number of primitives for leaves, 0 for inner nodes and empty slots
+    };
+
+    /// Compressed node of a wide BVH, where the bounding boxes of the children are quantized to 8 bits, relative to
+    /// the bounding box of the node. The scale on each axis is a power of two, so that dequantization is exact.
+    template <int N>
+    struct QuantizedNode {
+        float3  origin;         ///< Min. BB corner of the node
+        int     child[N];       ///< Index of the child node, index of the first primitive for leaves, or -1 for empty slots
+        int8_t  exponents[4];   ///< Scale of the quantized coordinates on each axis, as a power of two (last one unused)
+        uint8_t bounds[6][N];   ///< Quantized min. and max. BB corners of each child, in the same order as for WideNode
+        uint8_t num_prims[N];   ///< Number of primitives for leaves, 0 for inner nodes and empty slots
+    };
+
+    aligned_array<Node>               nodes;
+    aligned_array<WideNode<4>>        nodes4;
+    aligned_array<WideNode<8>>        nodes8;
+    aligned_array<QuantizedNode<4>>   qnodes4;
+    aligned_array<QuantizedNode<8>>   qnodes8;
+    aligned_array<int>                prim_ids;
+    aligned_array<PrecomputedTri>     tris;
+    aligned_array<TriBlock<4>>        tris4;
+    aligned_array<TriBlock<8>>        tris8;
+    std::vector<BvhInstance>          instances;
+    BBox                              bb;
     int                               num_nodes;
+    int                               num_refs;
+    int                               num_prim_slots;
+    int                               num_input_prims;
+    int                               bvh_width;
+    bool                              compressed;
+    int                               tri_block;
+    bool                              shadow_order;
+    bool                              remap_hits;
+    float                             sah;
+    float                             layout_sah;
+    float                             built_layout_sah;
+    std::vector<int>                  refit_order;
+    std::vector<int>                  refit_offsets;
 };
 
 #endif // BVH_H
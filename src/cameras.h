@@ -22,6 +22,9 @@ public:
     virtual ~Camera() {}
     /// Generates a ray for a point on the image plane, represented by (u, v) in [-1,1]^2.
     virtual Ray gen_ray(float u, float v) const = 0;
+    /// Returns the footprint of the ray generated by gen_ray() for the same point, given the size of a pixel on the
+    /// image plane (in the same units as u and v).
+    virtual RayCone gen_cone(float u, float v, float pixel_size) const = 0;
     /// Projects a point onto the image plane and returns the corresponding (u, v, z) coordinates.
     virtual float3 project(const float3& p) const = 0;
     /// Unprojects a point on the image plane, represented by (u, v, z) with (u, v) in [-z, z]^2 and z in [0, inf[.
@@ -54,6 +57,12 @@ public:
         return Ray(eye, normalize(dir + u * right + v * up));
     }
 
+    RayCone gen_cone(float u, float v, float pixel_size) const override final {
+        // The angle between neighboring rays shrinks towards the border of the image
+        float d2 = 1.0f + u * u * w * w + v * v * h * h;
+        return RayCone(0.0f, pixel_size * w / d2);
+    }
+
     float3 project(const float3& p) const override final {
         auto d = normalize(p - eye);
         return float3(dot(d, right) / (w * w), dot(d, up) / (h * h), dot(d, dir));
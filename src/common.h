@@ -4,6 +4,13 @@
 #include <iostream>
 #include <cstdlib>
 #include <random>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 #define UNUSED(x) (void)(x)
 
@@ -69,6 +76,52 @@ T reflect(T v, T n) {
     return (2 * dot(n, v)) * n - v;
 }
 
+/// Allocates a block of memory whose address is a multiple of the given alignment (a power of two).
+inline void* aligned_malloc(size_t size, size_t alignment) {
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* ptr = nullptr;
+    return posix_memalign(&ptr, alignment, size) ? nullptr : ptr;
+#endif
+}
+
+/// Frees a block of memory allocated with aligned_malloc.
+inline void aligned_free(void* ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+struct AlignedDeleter {
+    bool owner;     ///< False for arrays that point to memory they do not own, see make_array_view()
+
+    AlignedDeleter(bool owner = true) : owner(owner) {}
+    void operator () (void* ptr) const { if (owner) aligned_free(ptr); }
+};
+
+/// Array of trivially destructible elements, allocated with aligned_malloc.
+template <typename T>
+using aligned_array = std::unique_ptr<T[], AlignedDeleter>;
+
+/// Allocates an array of n elements, aligned on the given boundary (a cache line by default).
+template <typename T>
+aligned_array<T> make_aligned_array(size_t n, size_t alignment = 64) {
+    static_assert(std::is_trivially_destructible<T>::value, "Elements of aligned arrays are not destroyed");
+    T* ptr = static_cast<T*>(aligned_malloc(std::max(n, size_t(1)) * sizeof(T), std::max(alignment, alignof(T))));
+    if (!ptr) throw std::bad_alloc();
+    for (size_t i = 0; i < n; i++) new (ptr + i) T;
+    return aligned_array<T>(ptr);
+}
+
+/// Returns an array that uses memory owned by another object (e.g. a memory-mapped file), which is not freed with the array.
+template <typename T>
+aligned_array<T> make_array_view(T* ptr) {
+    return aligned_array<T>(ptr, AlignedDeleter(false));
+}
+
 inline void error() {
     std::cerr << std::endl;
 }
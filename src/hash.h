@@ -25,6 +25,16 @@ inline uint32_t fnv_hash(uint32_t h, uint32_t d) {
     return h;
 }
 
+/// Mixes the bits of a 64-bit value, using the finalizer of MurmurHash3
+inline uint64_t murmur_mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
 /// Returns a seed for a sampler object, based on the current pixel id and iteration count
 inline uint32_t sampler_seed(uint32_t pixel, uint32_t iter) {
     return fnv_hash(fnv_hash(fnv_init(), pixel), iter);
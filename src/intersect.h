@@ -5,6 +5,7 @@
 
 #include "float4.h"
 #include "float3.h"
+#include "simd.h"
 
 /// Ray defined as org + t * dir, with t in [tmin, tmax].
 struct Ray {
@@ -20,16 +21,30 @@ struct Ray {
     {}
 };
 
+/// Footprint of a ray, approximated by a cone: its width at the origin of the ray, and the rate at which the width
+/// grows with the distance along the ray (the ray direction must be normalized).
+struct RayCone {
+    float width;
+    float spread;
+
+    RayCone() {}
+    RayCone(float w, float s) : width(w), spread(s) {}
+
+    /// Returns the width of the cone at the given distance along the ray.
+    float width_at(float t) const { return width + spread * t; }
+};
+
 /// Ray-triangle hit information.
 struct Hit {
     int tri;        ///< Triangle index, or -1 if no intersection was found
     float t;        ///< Time of intersection
     float u;        ///< First barycentric coordinate
     float v;        ///< Second barycentric coordinate
+    int inst;       ///< Instance index for two-level BVHs, or -1
 
     Hit() {}
-    Hit(int tri, float t, float u, float v)
-        : tri(tri), t(t), u(u), v(v)
+    Hit(int tri, float t, float u, float v, int inst = -1)
+        : tri(tri), t(t), u(u), v(v), inst(inst)
     {}
 };
 
@@ -78,4 +93,93 @@ inline bool intersect_ray_tri(const Ray& ray, const PrecomputedTri& tri, float&
     return false;
 }
 
+/// Block of M precomputed triangles stored as a structure of arrays, to intersect them all at once with SIMD instructions.
+/// Unused lanes are filled with degenerate triangles (all zeros), which are never intersected.
+template <int M>
+struct TriBlock {
+    float v0[3][M];
+    float e1[3][M];
+    float e2[3][M];
+    float n[3][M];
+
+    void set(int lane, const PrecomputedTri& tri) {
+        v0[0][lane] = tri.v0.x; v0[1][lane] = tri.v0.y; v0[2][lane] = tri.v0.z;
+        e1[0][lane] = tri.e1.x; e1[1][lane] = tri.e1.y; e1[2][lane] = tri.e1.z;
+        e2[0][lane] = tri.e2.x; e2[1][lane] = tri.e2.y; e2[2][lane] = tri.e2.z;
+        n[0][lane]  = tri.nx;   n[1][lane]  = tri.ny;   n[2][lane]  = tri.nz;
+    }
+
+    void clear(int lane) {
+        for (int i = 0; i < 3; i++)
+            v0[i][lane] = e1[i][lane] = e2[i][lane] = n[i][lane] = 0.0f;
+    }
+};
+
+/// Tests a ray against a block of triangles, using the same Moeller-Trumbore test as intersect_ray_tri.
+/// Returns a bit mask of the lanes that are intersected closer than t, along with the unnormalized hit parameters.
+template <int M>
+inline int test_ray_tri_block(const Ray& ray, const TriBlock<M>& tri, float t, vfloat<M>& t_, vfloat<M>& u_, vfloat<M>& v_, vfloat<M>& abs_det) {
+    typedef vfloat<M> V;
+    const V eps(-1e-9f);
+
+    const V nx = V::load(tri.n[0]), ny = V::load(tri.n[1]), nz = V::load(tri.n[2]);
+    const V cx = V::load(tri.v0[0]) - V(ray.org.x);
+    const V cy = V::load(tri.v0[1]) - V(ray.org.y);
+    const V cz = V::load(tri.v0[2]) - V(ray.org.z);
+    const V dx(ray.dir.x), dy(ray.dir.y), dz(ray.dir.z);
+
+    // r = cross(ray.dir, c)
+    const V rx = dy * cz - dz * cy;
+    const V ry = dz * cx - dx * cz;
+    const V rz = dx * cy - dy * cx;
+
+    const V det = nx * dx + ny * dy + nz * dz;
+    abs_det = abs(det);
+
+    u_ = prodsign(rx * V::load(tri.e2[0]) + ry * V::load(tri.e2[1]) + rz * V::load(tri.e2[2]), det);
+    v_ = prodsign(rx * V::load(tri.e1[0]) + ry * V::load(tri.e1[1]) + rz * V::load(tri.e1[2]), det);
+    const V w_ = abs_det - u_ - v_;
+    t_ = prodsign(nx * cx + ny * cy + nz * cz, det);
+
+    return mask_le(eps, u_) & mask_le(eps, v_) & mask_le(eps, w_) &
+           mask_le(abs_det * V(ray.tmin), t_) & mask_lt(t_, abs_det * V(t));
+}
+
+/// Intersects a ray with a block of triangles.
+/// Returns the lane of the closest intersection that is closer than t, or -1 if there is none.
+template <int M>
+inline int intersect_ray_tri_block(const Ray& ray, const TriBlock<M>& tri, float& t, float& u, float& v) {
+    vfloat<M> t_, u_, v_, abs_det;
+    int mask = test_ray_tri_block(ray, tri, t, t_, u_, v_, abs_det);
+    if (!mask) return -1;
+
+    float ts[M], us[M], vs[M], dets[M];
+    t_.store(ts);
+    u_.store(us);
+    v_.store(vs);
+    abs_det.store(dets);
+
+    // Select the closest intersection among the lanes that passed the test
+    int lane = -1;
+    for (; mask; mask &= mask - 1) {
+        const int i = first_bit(mask);
+        const float inv_det = 1.0f / dets[i];
+        const float ti = ts[i] * inv_det;
+        if (ti < t) {
+            t = ti;
+            u = us[i] * inv_det;
+            v = vs[i] * inv_det;
+            lane = i;
+        }
+    }
+    return lane;
+}
+
+/// Returns true if the ray intersects any triangle of the block within [ray.tmin, ray.tmax].
+template <int M>
+inline bool occluded_ray_tri_block(const Ray& ray, const TriBlock<M>& tri) {
+    vfloat<M> t_, u_, v_, abs_det;
+    return test_ray_tri_block(ray, tri, ray.tmax, t_, u_, v_, abs_det) != 0;
+}
+
 #endif // INTERSECT_H
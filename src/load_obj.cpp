@@ -3,9 +3,12 @@
 #include <cstring>
 #include <cstdlib>
 #include <cctype>
+#include <cstdint>
+#include <algorithm>
 
 #include "common.h"
 #include "load_obj.h"
+#include "mapped_file.h"
 
 inline void remove_eol(char* ptr) {
     int i = 0;
@@ -27,143 +30,296 @@ inline char* strip_spaces(char* ptr) {
     return ptr;
 }
 
-inline bool read_index(char** ptr, obj::Index& idx) {
-    char* base = *ptr;
+/// Minimum size of the parts of an OBJ file that are parsed in parallel.
+static constexpr size_t obj_min_chunk_size = 1 << 16;
+/// Maximum number of parts an OBJ file is split into.
+static constexpr size_t obj_max_chunks = 64;
 
-    // Detect end of line (negative indices are supported) 
-    base = strip_spaces(base);
-    if (!std::isdigit(*base) && *base != '-') return false;
+/// Same as std::isspace in the "C" locale.
+inline bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+/// Returns a pointer to the end of the line (the newline character, or the end of the buffer).
+inline const char* find_eol(const char* ptr, const char* end) {
+    auto eol = static_cast<const char*>(std::memchr(ptr, '\n', end - ptr));
+    return eol ? eol : end;
+}
+
+inline const char* skip_spaces(const char* ptr, const char* end) {
+    while (ptr < end && is_space(*ptr)) ptr++;
+    return ptr;
+}
+
+inline const char* skip_text(const char* ptr, const char* end) {
+    while (ptr < end && !is_space(*ptr)) ptr++;
+    return ptr;
+}
+
+/// Parses an integer like std::strtol, from a range of characters that is not null-terminated.
+/// The pointer is left unchanged if there is no integer to read.
+static int parse_int(const char*& ptr, const char* end) {
+    const char* p = skip_spaces(ptr, end);
+    const bool neg = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    if (p == end || !is_digit(*p)) return 0;
+
+    long long i = 0;
+    while (p < end && is_digit(*p)) i = i * 10 + (*p++ - '0');
+    ptr = p;
+    return neg ? -i : i;
+}
+
+/// Parses a float like std::strtof, from a range of characters that is not null-terminated.
+/// Decimal numbers with up to 7 significant digits and small exponents only need one exact float operation,
+/// which gives the same correctly rounded result as std::strtof. Other numbers are handed over to std::strtof.
+/// The pointer is left unchanged if there is no number to read.
+static float parse_float(const char*& ptr, const char* end) {
+    static const float powers[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+    const char* start = skip_spaces(ptr, end);
+    const char* p = start;
+    const bool neg = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+
+    // Accumulate the significant digits in an integer, leading zeros excluded
+    uint64_t m = 0;
+    int digits = 0, num_digits = 0, exp = 0;
+    auto add_digit = [&] (char c) {
+        num_digits++;
+        if (m == 0 && c == '0') return;
+        if (++digits <= 18) m = m * 10 + (c - '0');
+    };
+    while (p < end && is_digit(*p)) add_digit(*p++);
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && is_digit(*p)) {
+            add_digit(*p++);
+            exp--;
+        }
+    }
+
+    if (num_digits > 0 && p < end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        const bool neg_exp = q < end && *q == '-';
+        if (q < end && (*q == '-' || *q == '+')) q++;
+        if (q < end && is_digit(*q)) {
+            int e = 0;
+            while (q < end && is_digit(*q)) e = std::min(e * 10 + (*q++ - '0'), 100000);
+            exp += neg_exp ? -e : e;
+            p = q;
+        }
+    }
+
+    // Special values (infinities, NaNs, hexadecimal numbers) are followed by letters
+    const bool special = p < end && std::isalpha(static_cast<unsigned char>(*p));
+    if (num_digits == 0 && !special) return 0.0f;
+
+    if (!special && digits <= 18) {
+        if (m == 0) {
+            ptr = p;
+            return neg ? -0.0f : 0.0f;
+        }
+        while (m > (1 << 24) && m % 10 == 0) {
+            m /= 10;
+            exp++;
+        }
+        // Both operands are exactly representable: the result is correctly rounded
+        if (m <= (1 << 24) && exp >= -10 && exp <= 10) {
+            const float f = exp < 0 ? float(m) / powers[-exp] : float(m) * powers[exp];
+            ptr = p;
+            return neg ? -f : f;
+        }
+    }
+
+    char buf[128];
+    const size_t len = std::min(size_t(skip_text(start, end) - start), sizeof(buf) - 1);
+    std::memcpy(buf, start, len);
+    buf[len] = '\0';
+    char* buf_end;
+    const float f = std::strtof(buf, &buf_end);
+    if (buf_end != buf) ptr = start + (buf_end - buf);
+    return f;
+}
+
+inline bool read_index(const char*& ptr, const char* end, obj::Index& idx) {
+    const char* base = skip_spaces(ptr, end);
+
+    // Detect end of line (negative indices are supported)
+    if (base == end || (!is_digit(*base) && *base != '-')) return false;
 
     idx.v = 0;
     idx.t = 0;
     idx.n = 0;
 
-    idx.v = std::strtol(base, &base, 10);
+    idx.v = parse_int(base, end);
 
-    base = strip_spaces(base);
+    base = skip_spaces(base, end);
 
-    if (*base == '/') {
+    if (base < end && *base == '/') {
         base++;
 
         // Handle the case when there is no texture coordinate
-        if (*base != '/') {
-            idx.t = std::strtol(base, &base, 10);
+        if (base == end || *base != '/') {
+            idx.t = parse_int(base, end);
         }
 
-        base = strip_spaces(base);
+        base = skip_spaces(base, end);
 
-        if (*base == '/') {
+        if (base < end && *base == '/') {
             base++;
-            idx.n = std::strtol(base, &base, 10);
+            idx.n = parse_int(base, end);
         }
     }
 
-    *ptr = base;
+    ptr = base;
 
     return true;
 }
 
-static bool parse_obj(std::istream& stream, obj::File& file) {
-    // Add an empty object to the scene
-    int cur_object = 0;
-    file.objects.emplace_back();
-
-    // Add an empty group to this object
-    int cur_group = 0;
-    file.objects[0].groups.emplace_back();
-
-    // Add an empty material to the scene
-    int cur_mtl = 0;
-    file.materials.emplace_back("");
+/// Calls the given function with the beginning and end of every line that is not empty or a comment.
+/// Leading and trailing spaces are removed. Returns the number of lines in the range.
+template <typename F>
+static int for_each_line(const char* begin, const char* end, F f) {
+    int num_lines = 0;
+    for (const char* ptr = begin; ptr < end; num_lines++) {
+        const char* eol = find_eol(ptr, end);
+        const char* line = skip_spaces(ptr, eol);
+        ptr = eol + 1;
 
-    // Add dummy vertex, normal, and texcoord
-    file.vertices.emplace_back();
-    file.normals.emplace_back();
-    file.texcoords.emplace_back();
+        // Skip comments and empty lines
+        if (line == eol || *line == '#')
+            continue;
 
-    int err_count = 0, cur_line = 0;
-    const int max_line = 1024;
-    char line[max_line];
+        while (is_space(eol[-1])) eol--;
+        f(line, eol, num_lines);
+    }
+    return num_lines;
+}
 
-    while (stream.getline(line, max_line)) {
-        cur_line++;
+/// Returns the character following 'v' for vertex, normal and texture coordinate lines (' ', 'n' or 't'), and 0 otherwise.
+inline char vertex_type(const char* line, const char* eol) {
+    if (*line != 'v') return 0;
+    if (line + 1 == eol) return 'v';
+    if (line[1] == '\t') return ' ';
+    return line[1];
+}
 
-        // Strip spaces
-        char* ptr = strip_spaces(line);
+/// Group or object command, along with its position with respect to the faces of a chunk.
+struct ObjCommand {
+    size_t face;        ///< Number of faces before the command
+    bool object;        ///< True for an object, false for a group
+};
+
+struct ObjError {
+    int line;
+    std::string msg;
+};
+
+/// Part of an OBJ file that is parsed independently from the others. A chunk always starts at the beginning of a line.
+struct ObjChunk {
+    const char* begin;
+    const char* end;
+
+    int first_line;                             ///< Number of lines before the chunk
+    int num_lines;
+    size_t first_vertex;                        ///< Index of the first vertex of the chunk in the file
+    size_t first_normal;                        ///< Index of the first normal of the chunk in the file
+    size_t first_texcoord;                      ///< Index of the first texture coordinate of the chunk in the file
+    size_t num_vertices, num_normals, num_texcoords, num_faces;
+
+    std::vector<obj::Face> faces;               ///< Faces, with material indices local to the chunk (-1 for the material of the previous chunk)
+    std::vector<ObjCommand> commands;           ///< Group and object commands
+    std::vector<std::string> materials;         ///< Names of the materials used in the chunk
+    std::vector<int> material_map;              ///< Position of the materials of the chunk in the file
+    int last_material;                          ///< Last material used in the chunk, or -1
+    std::vector<std::string> mtl_libs;
+    std::vector<ObjError> errors;
+};
+
+/// Counts the lines and elements of a chunk.
+static void count_chunk(ObjChunk& chunk) {
+    chunk.num_vertices = chunk.num_normals = chunk.num_texcoords = chunk.num_faces = 0;
+    chunk.num_lines = for_each_line(chunk.begin, chunk.end, [&] (const char* line, const char* eol, int) {
+        switch (vertex_type(line, eol)) {
+            case ' ': chunk.num_vertices++;  break;
+            case 'n': chunk.num_normals++;   break;
+            case 't': chunk.num_texcoords++; break;
+            default:
+                if (*line == 'f') chunk.num_faces++;
+                break;
+        }
+    });
+}
 
-        // Skip comments and empty lines
-        if (*ptr == '\0' || *ptr == '#')
-            continue;
+/// Parses a chunk. The vertices, normals and texture coordinates are directly stored in the file, at the position of the chunk.
+static void parse_chunk(ObjChunk& chunk, obj::File& file) {
+    size_t cur_vertex = chunk.first_vertex, cur_normal = chunk.first_normal, cur_texcoord = chunk.first_texcoord;
+    int cur_mtl = -1;
+    chunk.faces.reserve(chunk.num_faces);
 
-        remove_eol(ptr);
+    auto report = [&] (int line, std::string msg) {
+        chunk.errors.push_back(ObjError{chunk.first_line + line + 1, std::move(msg)});
+    };
 
+    for_each_line(chunk.begin, chunk.end, [&] (const char* ptr, const char* eol, int line) {
         // Test each command in turn, the most frequent first
         if (*ptr == 'v') {
-            switch (ptr[1]) {
+            switch (vertex_type(ptr, eol)) {
                 case ' ':
-                case '\t':
                     {
-                        float3 v;
-                        v.x = std::strtof(ptr + 1, &ptr);
-                        v.y = std::strtof(ptr, &ptr);
-                        v.z = std::strtof(ptr, &ptr);
-                        file.vertices.push_back(v);
+                        float3& v = file.vertices[cur_vertex++];
+                        ptr++;
+                        v.x = parse_float(ptr, eol);
+                        v.y = parse_float(ptr, eol);
+                        v.z = parse_float(ptr, eol);
                     }
                     break;
                 case 'n':
                     {
-                        float3 n;
-                        n.x = std::strtof(ptr + 2, &ptr);
-                        n.y = std::strtof(ptr, &ptr);
-                        n.z = std::strtof(ptr, &ptr);
-                        file.normals.push_back(n);
+                        float3& n = file.normals[cur_normal++];
+                        ptr += 2;
+                        n.x = parse_float(ptr, eol);
+                        n.y = parse_float(ptr, eol);
+                        n.z = parse_float(ptr, eol);
                     }
                     break;
                 case 't':
                     {
-                        float2 t;
-                        t.x = std::strtof(ptr + 2, &ptr);
-                        t.y = std::strtof(ptr, &ptr);
-                        file.texcoords.push_back(t);
+                        float2& t = file.texcoords[cur_texcoord++];
+                        ptr += 2;
+                        t.x = parse_float(ptr, eol);
+                        t.y = parse_float(ptr, eol);
                     }
                     break;
                 default:
-                    error("Invalid vertex (line ", cur_line, ").");
-                    err_count++;
+                    report(line, "Invalid vertex");
                     break;
             }
-        } else if (*ptr == 'f' && std::isspace(ptr[1])) {
+        } else if (*ptr == 'f' && ptr + 1 < eol && is_space(ptr[1])) {
             obj::Face f;
 
             f.index_count = 0;
             f.material = cur_mtl;
 
-            bool valid = true;
             ptr += 2;
-            while(f.index_count < obj::Face::max_indices) {
+            while (f.index_count < obj::Face::max_indices) {
                 obj::Index index;
-                valid = read_index(&ptr, index);
-
-                if (valid) {
-                    f.indices[f.index_count++] = index;
-                } else {
-                    break;
-                }
+                if (!read_index(ptr, eol, index)) break;
+                f.indices[f.index_count++] = index;
             }
 
             if (f.index_count < 3) {
-                error("Invalid face (line ", cur_line, ").");
-                err_count++;
+                report(line, "Invalid face");
             } else {
                 // Convert relative indices to absolute
                 for (int i = 0; i < f.index_count; i++) {
-                    f.indices[i].v = (f.indices[i].v < 0) ? file.vertices.size()  + f.indices[i].v : f.indices[i].v;
-                    f.indices[i].t = (f.indices[i].t < 0) ? file.texcoords.size() + f.indices[i].t : f.indices[i].t;
-                    f.indices[i].n = (f.indices[i].n < 0) ? file.normals.size()   + f.indices[i].n : f.indices[i].n;
+                    f.indices[i].v = (f.indices[i].v < 0) ? cur_vertex   + f.indices[i].v : f.indices[i].v;
+                    f.indices[i].t = (f.indices[i].t < 0) ? cur_texcoord + f.indices[i].t : f.indices[i].t;
+                    f.indices[i].n = (f.indices[i].n < 0) ? cur_normal   + f.indices[i].n : f.indices[i].n;
                 }
 
                 // Check if the indices are valid or not
-                valid = true;
+                bool valid = true;
                 for (int i = 0; i < f.index_count; i++) {
                     if (f.indices[i].v <= 0 || f.indices[i].t < 0 || f.indices[i].n < 0) {
                         valid = false;
@@ -172,50 +328,128 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
                 }
 
                 if (valid) {
-                    file.objects[cur_object].groups[cur_group].faces.push_back(f);
+                    chunk.faces.push_back(f);
                 } else {
-                    error("Invalid indices in face definition (line ", cur_line, ").");
-                    err_count++;
+                    report(line, "Invalid indices in face definition");
                 }
             }
-        } else if (*ptr == 'g' && std::isspace(ptr[1])) {
-            file.objects[cur_object].groups.emplace_back();
-            cur_group++;
-        } else if (*ptr == 'o' && std::isspace(ptr[1])) {
-            file.objects.emplace_back();
-            cur_object++;
-
-            file.objects[cur_object].groups.emplace_back();
-            cur_group = 0;
-        } else if (!std::strncmp(ptr, "usemtl", 6) && std::isspace(ptr[6])) {
-            ptr += 6;
-
-            ptr = strip_spaces(ptr);
-            char* base = ptr;
-            ptr = strip_text(ptr);
+        } else if (*ptr == 'g' && ptr + 1 < eol && is_space(ptr[1])) {
+            chunk.commands.push_back(ObjCommand{chunk.faces.size(), false});
+        } else if (*ptr == 'o' && ptr + 1 < eol && is_space(ptr[1])) {
+            chunk.commands.push_back(ObjCommand{chunk.faces.size(), true});
+        } else if (eol - ptr > 6 && !std::strncmp(ptr, "usemtl", 6) && is_space(ptr[6])) {
+            ptr = skip_spaces(ptr + 6, eol);
+            const std::string mtl_name(ptr, skip_text(ptr, eol));
+
+            cur_mtl = std::find(chunk.materials.begin(), chunk.materials.end(), mtl_name) - chunk.materials.begin();
+            if (cur_mtl == (int)chunk.materials.size()) {
+                chunk.materials.push_back(mtl_name);
+            }
+        } else if (eol - ptr > 6 && !std::strncmp(ptr, "mtllib", 6) && is_space(ptr[6])) {
+            ptr = skip_spaces(ptr + 6, eol);
+            chunk.mtl_libs.emplace_back(ptr, skip_text(ptr, eol));
+        } else if (*ptr == 's' && ptr + 1 < eol && is_space(ptr[1])) {
+            // Ignore smooth commands
+        } else {
+            report(line, "Unknown command '" + std::string(ptr, eol) + "'");
+        }
+    });
 
-            const std::string mtl_name(base, ptr);
+    chunk.last_material = cur_mtl;
+}
 
-            cur_mtl = std::find(file.materials.begin(), file.materials.end(), mtl_name) - file.materials.begin();
-            if (cur_mtl == (int)file.materials.size()) {
+/// Parses an OBJ file stored in memory. The file is split into chunks at line boundaries, which are parsed in parallel.
+static bool parse_obj(const char* data, size_t size, obj::File& file) {
+    std::vector<ObjChunk> chunks;
+    const size_t chunk_size = std::max(size / obj_max_chunks, obj_min_chunk_size);
+    for (const char* ptr = data, *end = data + size; ptr < end;) {
+        chunks.emplace_back();
+        chunks.back().begin = ptr;
+        chunks.back().end = size_t(end - ptr) > chunk_size ? std::min(find_eol(ptr + chunk_size, end) + 1, end) : end;
+        ptr = chunks.back().end;
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)chunks.size(); i++)
+        count_chunk(chunks[i]);
+
+    // Compute the position of every chunk in the file. Index 0 holds a dummy vertex, normal, and texcoord.
+    int num_lines = 0;
+    size_t num_vertices = 1, num_normals = 1, num_texcoords = 1;
+    for (auto& chunk : chunks) {
+        chunk.first_line     = num_lines;
+        chunk.first_vertex   = num_vertices;
+        chunk.first_normal   = num_normals;
+        chunk.first_texcoord = num_texcoords;
+        num_lines     += chunk.num_lines;
+        num_vertices  += chunk.num_vertices;
+        num_normals   += chunk.num_normals;
+        num_texcoords += chunk.num_texcoords;
+    }
+    file.vertices.resize(num_vertices);
+    file.normals.resize(num_normals);
+    file.texcoords.resize(num_texcoords);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)chunks.size(); i++)
+        parse_chunk(chunks[i], file);
+
+    // Add an empty material to the scene, and give the materials their index in order of appearance
+    file.materials.emplace_back("");
+    int cur_mtl = 0;
+    int err_count = 0;
+    for (auto& chunk : chunks) {
+        for (auto& err : chunk.errors)
+            error(err.msg, " (line ", err.line, ").");
+        err_count += chunk.errors.size();
+
+        chunk.material_map.push_back(cur_mtl);
+        for (auto& mtl_name : chunk.materials) {
+            int mtl = std::find(file.materials.begin(), file.materials.end(), mtl_name) - file.materials.begin();
+            if (mtl == (int)file.materials.size()) {
                 file.materials.push_back(mtl_name);
             }
-        } else if (!std::strncmp(ptr, "mtllib", 6) && std::isspace(ptr[6])) {
-            ptr += 6;
-
-            ptr = strip_spaces(ptr);
-            char* base = ptr;
-            ptr = strip_text(ptr);
+            chunk.material_map.push_back(mtl);
+        }
+        cur_mtl = chunk.material_map[chunk.last_material + 1];
+    }
 
-            const std::string lib_name(base, ptr);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)chunks.size(); i++) {
+        auto& chunk = chunks[i];
+        for (auto& f : chunk.faces) f.material = chunk.material_map[f.material + 1];
+    }
 
-            file.mtl_libs.push_back(lib_name);
-        } else if (*ptr == 's' && std::isspace(ptr[1])) {
-            // Ignore smooth commands
-        } else {
-            error("Unknown command '", ptr, "' (line ", cur_line, ").");
-            err_count++;
+    // Add an empty object to the scene, with an empty group, and append the faces of every chunk in order
+    int cur_object = 0;
+    int cur_group = 0;
+    file.objects.emplace_back();
+    file.objects[0].groups.emplace_back();
+    for (auto& chunk : chunks) {
+        size_t cur_face = 0;
+        auto append_faces = [&] (size_t end) {
+            auto& faces = file.objects[cur_object].groups[cur_group].faces;
+            faces.insert(faces.end(), chunk.faces.begin() + cur_face, chunk.faces.begin() + end);
+            cur_face = end;
+        };
+
+        for (auto& cmd : chunk.commands) {
+            append_faces(cmd.face);
+            if (cmd.object) {
+                file.objects.emplace_back();
+                cur_object++;
+
+                file.objects[cur_object].groups.emplace_back();
+                cur_group = 0;
+            } else {
+                file.objects[cur_object].groups.emplace_back();
+                cur_group++;
+            }
         }
+        append_faces(chunk.faces.size());
+        std::vector<obj::Face>().swap(chunk.faces);
+
+        file.mtl_libs.insert(file.mtl_libs.end(), chunk.mtl_libs.begin(), chunk.mtl_libs.end());
     }
 
     return (err_count == 0);
@@ -338,9 +572,9 @@ static bool parse_mtl(std::istream& stream, obj::MaterialLib& mtl_lib) {
 }
 
 bool load_obj(const FilePath& path, obj::File& obj_file) {
-    // Parse the OBJ file
-    std::ifstream stream(path);
-    return stream && parse_obj(stream, obj_file);
+    // Parse the OBJ file directly from memory
+    MappedFile file(path);
+    return file.is_open() && parse_obj(file.data(), file.size(), obj_file);
 }
 
 bool load_mtl(const FilePath& path, obj::MaterialLib& mtl_lib) {
@@ -0,0 +1,392 @@
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <string>
+#include <sstream>
+#include <initializer_list>
+
+#include "common.h"
+#include "load_ply.h"
+#include "mapped_file.h"
+
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid };
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;               ///< Type of the value, or of the elements of a list
+    PlyType count_type;         ///< Type of the size of a list, or PlyType::Invalid for a single value
+
+    bool is_list() const { return count_type != PlyType::Invalid; }
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> props;
+};
+
+/// Location of a single value in the data of an element.
+struct PlyAttribute {
+    size_t offset;
+    PlyType type;
+};
+
+static PlyType parse_ply_type(const std::string& name) {
+    if (name == "char"   || name == "int8")    return PlyType::Int8;
+    if (name == "uchar"  || name == "uint8")   return PlyType::UInt8;
+    if (name == "short"  || name == "int16")   return PlyType::Int16;
+    if (name == "ushort" || name == "uint16")  return PlyType::UInt16;
+    if (name == "int"    || name == "int32")   return PlyType::Int32;
+    if (name == "uint"   || name == "uint32")  return PlyType::UInt32;
+    if (name == "float"  || name == "float32") return PlyType::Float32;
+    if (name == "double" || name == "float64") return PlyType::Float64;
+    return PlyType::Invalid;
+}
+
+static size_t type_size(PlyType type) {
+    switch (type) {
+        case PlyType::Int8:
+        case PlyType::UInt8:   return 1;
+        case PlyType::Int16:
+        case PlyType::UInt16:  return 2;
+        case PlyType::Int32:
+        case PlyType::UInt32:
+        case PlyType::Float32: return 4;
+        case PlyType::Float64: return 8;
+        default:               return 0;
+    }
+}
+
+/// Reads a value from the file, which may not be aligned.
+template <typename T>
+inline T read_raw(const char* ptr) {
+    T t;
+    std::memcpy(&t, ptr, sizeof(T));
+    return t;
+}
+
+inline float read_float(const char* ptr, PlyType type) {
+    switch (type) {
+        case PlyType::Float32: return read_raw<float>(ptr);
+        case PlyType::Float64: return read_raw<double>(ptr);
+        case PlyType::Int8:    return read_raw<int8_t>(ptr);
+        case PlyType::UInt8:   return read_raw<uint8_t>(ptr);
+        case PlyType::Int16:   return read_raw<int16_t>(ptr);
+        case PlyType::UInt16:  return read_raw<uint16_t>(ptr);
+        case PlyType::Int32:   return read_raw<int32_t>(ptr);
+        case PlyType::UInt32:  return read_raw<uint32_t>(ptr);
+        default:               return 0.0f;
+    }
+}
+
+inline int64_t read_int(const char* ptr, PlyType type) {
+    switch (type) {
+        case PlyType::Int32:   return read_raw<int32_t>(ptr);
+        case PlyType::UInt32:  return read_raw<uint32_t>(ptr);
+        case PlyType::UInt8:   return read_raw<uint8_t>(ptr);
+        case PlyType::Int8:    return read_raw<int8_t>(ptr);
+        case PlyType::Int16:   return read_raw<int16_t>(ptr);
+        case PlyType::UInt16:  return read_raw<uint16_t>(ptr);
+        case PlyType::Float32: return read_raw<float>(ptr);
+        case PlyType::Float64: return read_raw<double>(ptr);
+        default:               return 0;
+    }
+}
+
+/// Returns the size of an element in bytes, or 0 if its size varies because it contains lists.
+static size_t fixed_size(const PlyElement& elem) {
+    size_t size = 0;
+    for (auto& prop : elem.props) {
+        if (prop.is_list()) return 0;
+        size += type_size(prop.type);
+    }
+    return size;
+}
+
+/// Finds a property of an element with one of the given names. The element must not contain lists.
+static bool find_attribute(const PlyElement& elem, std::initializer_list<const char*> names, PlyAttribute& attr) {
+    size_t offset = 0;
+    for (auto& prop : elem.props) {
+        for (auto name : names) {
+            if (prop.name != name) continue;
+            attr.offset = offset;
+            attr.type = prop.type;
+            return true;
+        }
+        offset += type_size(prop.type);
+    }
+    return false;
+}
+
+/// Parses the text header of a PLY file, and returns the size of the header in bytes.
+static bool parse_ply_header(const char* data, size_t size, std::vector<PlyElement>& elements, size_t& header_size) {
+    if (size < 4 || std::memcmp(data, "ply", 3) != 0 || (data[3] != '\n' && data[3] != '\r')) {
+        error("Invalid PLY file signature.");
+        return false;
+    }
+
+    bool binary = false;
+    for (const char* line = data, *end = data + size; line < end;) {
+        auto eol = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        if (!eol) break;
+
+        std::istringstream stream(std::string(line, eol));
+        line = eol + 1;
+        std::string keyword;
+        stream >> keyword;
+
+        if (keyword == "format") {
+            std::string format;
+            stream >> format;
+            if (format != "binary_little_endian") {
+                error("Unsupported PLY format '", format, "' (only binary little-endian files are supported).");
+                return false;
+            }
+            binary = true;
+        } else if (keyword == "element") {
+            PlyElement elem;
+            if (!(stream >> elem.name >> elem.count)) {
+                error("Invalid PLY element declaration.");
+                return false;
+            }
+            elements.push_back(elem);
+        } else if (keyword == "property") {
+            PlyProperty prop;
+            std::string type, count_type;
+            stream >> type;
+            if (type == "list") stream >> count_type >> type;
+            stream >> prop.name;
+            prop.type = parse_ply_type(type);
+            prop.count_type = count_type.empty() ? PlyType::Invalid : parse_ply_type(count_type);
+            if (!stream || elements.empty() || prop.type == PlyType::Invalid ||
+                (!count_type.empty() && prop.count_type == PlyType::Invalid)) {
+                error("Invalid PLY property declaration.");
+                return false;
+            }
+            elements.back().props.push_back(prop);
+        } else if (keyword == "end_header") {
+            if (!binary) error("Missing PLY format declaration.");
+            header_size = line - data;
+            return binary;
+        }
+        // Other keywords (comment, obj_info) are ignored
+    }
+
+    error("Missing end of PLY header.");
+    return false;
+}
+
+/// Skips the data of an element. Returns nullptr if the file ends before the element.
+static const char* skip_element(const PlyElement& elem, const char* ptr, const char* end) {
+    const size_t stride = fixed_size(elem);
+    if (stride > 0) return size_t(end - ptr) / stride >= elem.count ? ptr + stride * elem.count : nullptr;
+
+    for (size_t i = 0; i < elem.count; i++) {
+        for (auto& prop : elem.props) {
+            const size_t count_size = prop.is_list() ? type_size(prop.count_type) : 0;
+            if (size_t(end - ptr) < count_size) return nullptr;
+            const int64_t count = prop.is_list() ? read_int(ptr, prop.count_type) : 1;
+            ptr += count_size;
+            if (count < 0 || size_t(end - ptr) / type_size(prop.type) < size_t(count)) return nullptr;
+            ptr += count * type_size(prop.type);
+        }
+    }
+    return ptr;
+}
+
+/// Reads the vertices of a PLY file, in parallel. Returns a pointer to the end of the vertex data, or nullptr on error.
+static const char* read_vertices(const PlyElement& elem, const char* ptr, const char* end,
+                                 std::vector<float3>& vertices,
+                                 std::vector<float3>& normals,
+                                 std::vector<float2>& texcoords) {
+    const size_t stride = fixed_size(elem);
+    if (stride == 0) {
+        error("PLY vertices cannot contain lists.");
+        return nullptr;
+    }
+    if (elem.count > size_t(INT_MAX)) {
+        error("Too many vertices in PLY file.");
+        return nullptr;
+    }
+    if (size_t(end - ptr) / stride < elem.count) {
+        error("Unexpected end of PLY file.");
+        return nullptr;
+    }
+
+    PlyAttribute x, y, z, nx, ny, nz, u, v;
+    if (!find_attribute(elem, { "x" }, x) ||
+        !find_attribute(elem, { "y" }, y) ||
+        !find_attribute(elem, { "z" }, z)) {
+        error("PLY vertices have no position.");
+        return nullptr;
+    }
+    const bool has_normals = find_attribute(elem, { "nx" }, nx) &&
+                             find_attribute(elem, { "ny" }, ny) &&
+                             find_attribute(elem, { "nz" }, nz);
+    const bool has_texcoords = find_attribute(elem, { "u", "s", "texture_u", "texture_s" }, u) &&
+                               find_attribute(elem, { "v", "t", "texture_v", "texture_t" }, v);
+
+    const int num_verts = elem.count;
+    vertices.resize(num_verts);
+    normals.resize(has_normals ? num_verts : 0);
+    texcoords.resize(num_verts);
+
+    #pragma omp parallel for
+    for (int i = 0; i < num_verts; i++) {
+        const char* vtx = ptr + i * stride;
+        vertices[i] = float3(read_float(vtx + x.offset, x.type),
+                             read_float(vtx + y.offset, y.type),
+                             read_float(vtx + z.offset, z.type));
+        if (has_normals) {
+            normals[i] = float3(read_float(vtx + nx.offset, nx.type),
+                                read_float(vtx + ny.offset, ny.type),
+                                read_float(vtx + nz.offset, nz.type));
+        }
+        texcoords[i] = has_texcoords
+            ? float2(read_float(vtx + u.offset, u.type), read_float(vtx + v.offset, v.type))
+            : float2(0.0f);
+    }
+
+    return ptr + stride * elem.count;
+}
+
+/// Reads the faces of a PLY file and splits them into triangles. Returns a pointer to the end of the face data, or
+/// nullptr on error.
+static const char* read_faces(const PlyElement& elem, const char* ptr, const char* end, int num_verts,
+                              std::vector<int>& indices, int material) {
+    int list = -1, num_lists = 0;
+    size_t before = 0, after = 0;
+    for (int i = 0, n = elem.props.size(); i < n; i++) {
+        const auto& prop = elem.props[i];
+        if (prop.is_list()) {
+            num_lists++;
+            if (list < 0 && (prop.name == "vertex_indices" || prop.name == "vertex_index")) list = i;
+        } else (list < 0 ? before : after) += type_size(prop.type);
+    }
+    if (list < 0) {
+        error("PLY faces have no vertex indices.");
+        return nullptr;
+    }
+
+    const PlyType count_type = elem.props[list].count_type;
+    const PlyType index_type = elem.props[list].type;
+    const size_t count_size = type_size(count_type);
+    const size_t index_size = type_size(index_type);
+
+    // Scanned meshes are usually made of triangles only: every face then has the same size, and the faces can be
+    // read in parallel. Otherwise, the faces are read one after the other.
+    const size_t tri_stride = before + count_size + 3 * index_size + after;
+    if (num_lists == 1 && elem.count <= size_t(INT_MAX) / 4 && size_t(end - ptr) / tri_stride >= elem.count) {
+        const int num_faces = elem.count;
+        indices.resize(num_faces * 4);
+
+        int non_tris = 0, invalid = 0;
+        #pragma omp parallel for reduction(+:non_tris) reduction(+:invalid)
+        for (int i = 0; i < num_faces; i++) {
+            const char* face = ptr + i * tri_stride + before;
+            if (read_int(face, count_type) != 3) {
+                non_tris++;
+                continue;
+            }
+            for (int j = 0; j < 3; j++) {
+                const int64_t id = read_int(face + count_size + j * index_size, index_type);
+                invalid += id < 0 || id >= num_verts;
+                indices[i * 4 + j] = id;
+            }
+            indices[i * 4 + 3] = material;
+        }
+
+        // When some faces are not triangles, the faces were not read at the right offsets
+        if (non_tris == 0 && invalid > 0) {
+            error("Invalid vertex index in PLY faces.");
+            return nullptr;
+        }
+        if (non_tris == 0) return ptr + tri_stride * elem.count;
+        indices.clear();
+    }
+
+    indices.reserve(elem.count * 4);
+    for (size_t i = 0; i < elem.count; i++) {
+        for (int j = 0, n = elem.props.size(); j < n; j++) {
+            const auto& prop = elem.props[j];
+            const size_t prop_count_size = prop.is_list() ? type_size(prop.count_type) : 0;
+            if (size_t(end - ptr) < prop_count_size) {
+                error("Unexpected end of PLY file.");
+                return nullptr;
+            }
+            const int64_t count = prop.is_list() ? read_int(ptr, prop.count_type) : 1;
+            ptr += prop_count_size;
+            if (count < 0 || size_t(end - ptr) / type_size(prop.type) < size_t(count)) {
+                error("Unexpected end of PLY file.");
+                return nullptr;
+            }
+
+            if (j == list) {
+                // Convert the polygon to a triangle fan
+                for (int64_t k = 0; k < count; k++) {
+                    const int64_t id = read_int(ptr + k * index_size, index_type);
+                    if (id < 0 || id >= num_verts) {
+                        error("Invalid vertex index in PLY face ", i, ".");
+                        return nullptr;
+                    }
+                }
+                for (int64_t k = 1; k < count - 1; k++) {
+                    indices.insert(indices.end(), {
+                        int(read_int(ptr, index_type)),
+                        int(read_int(ptr + k * index_size, index_type)),
+                        int(read_int(ptr + (k + 1) * index_size, index_type)),
+                        material
+                    });
+                }
+            }
+            ptr += count * type_size(prop.type);
+        }
+    }
+    return ptr;
+}
+
+/// Parses a PLY file stored in memory. Only the vertex and face elements are read, the other elements are skipped.
+static bool parse_ply(const char* data, size_t size,
+                      std::vector<float3>& vertices,
+                      std::vector<float3>& normals,
+                      std::vector<float2>& texcoords,
+                      std::vector<int>& indices,
+                      int material) {
+    std::vector<PlyElement> elements;
+    size_t header_size = 0;
+    if (!parse_ply_header(data, size, elements, header_size)) return false;
+
+    bool has_vertices = false;
+    const char* ptr = data + header_size;
+    const char* end = data + size;
+    for (auto& elem : elements) {
+        if (elem.name == "vertex") {
+            ptr = read_vertices(elem, ptr, end, vertices, normals, texcoords);
+            has_vertices = true;
+        } else if (elem.name == "face") {
+            if (!has_vertices) {
+                error("PLY faces must come after the vertices.");
+                return false;
+            }
+            // The elements after the faces are not needed
+            return read_faces(elem, ptr, end, vertices.size(), indices, material) != nullptr;
+        } else if (!(ptr = skip_element(elem, ptr, end))) {
+            error("Unexpected end of PLY file.");
+        }
+        if (!ptr) return false;
+    }
+
+    if (!has_vertices) error("PLY file has no vertices.");
+    return has_vertices;
+}
+
+bool load_ply(const FilePath& path,
+              std::vector<float3>& vertices,
+              std::vector<float3>& normals,
+              std::vector<float2>& texcoords,
+              std::vector<int>& indices,
+              int material) {
+    // Read the PLY file directly from memory
+    MappedFile file(path);
+    return file.is_open() && parse_ply(file.data(), file.size(), vertices, normals, texcoords, indices, material);
+}
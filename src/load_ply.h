@@ -0,0 +1,21 @@
+#ifndef LOAD_PLY_H
+#define LOAD_PLY_H
+
+#include <vector>
+
+#include "float2.h"
+#include "float3.h"
+#include "file_path.h"
+
+/// Loads a binary little-endian PLY file. The data is written directly in the layout of the scene: one position,
+/// normal and texture coordinate per vertex, and four indices per triangle, the last one being the given material.
+/// Polygons are split into triangle fans. The normals are left empty if the file has none, and the texture
+/// coordinates are set to zero if the file has none.
+bool load_ply(const FilePath& path,
+              std::vector<float3>& vertices,
+              std::vector<float3>& normals,
+              std::vector<float2>& texcoords,
+              std::vector<int>& indices,
+              int material);
+
+#endif // LOAD_PLY_H
@@ -19,8 +19,8 @@ static bool debug = false;
 
 typedef std::function<void (const Scene&, Image&, int)> RenderFunction;
 
-static const char* render_fn_names[] = { "DEBUG", "PT", "PPM" };
-static RenderFunction render_fns[] = { render_debug, render_pt, render_ppm };
+static const char* render_fn_names[] = { "DEBUG", "PT", "PPM", "WAVEFRONT PT", "WAVEFRONT PT (SORTED RAYS)" };
+static RenderFunction render_fns[] = { render_debug, render_pt, render_ppm, render_wavefront, render_wavefront_sorted };
 
 static constexpr int num_render_fns = sizeof(render_fns) / sizeof(render_fns[0]);
 
@@ -128,6 +128,23 @@ int main(int argc, char** argv) {
     double max_time;
     int max_samples;
     int render_fn;
+    std::string bvh_builder;
+    int bvh_bins;
+    float sbvh_budget;
+    int lbvh_bits;
+    int lbvh_sah_levels;
+    int bvh_optimize;
+    bool bvh_align;
+    bool bvh_compress;
+    int bvh_tri_block;
+    int bvh_width;
+    bool bvh_shadow_order;
+    float bvh_rebuild_threshold;
+    bool bvh_leaf_order;
+    bool compact_attributes;
+    std::string scene_cache;
+    bool stream_scene;
+    bool hot_reload;
 
     parser.add_option("help",      "h",    "Prints this message",               help,   false);
     parser.add_option("width",     "sx",   "Sets the window width, in pixels",  width,  1080, "px");
@@ -138,7 +155,25 @@ int main(int argc, char** argv) {
     parser.add_option("samples",   "s",    "Sets the desired number of samples", max_samples, 0);
     parser.add_option("time",      "t",    "Sets the desired render time in seconds", max_time, 0.0);
 
-    parser.add_option("algo",      "a",    "Sets the algorithm used for rendering: debug vis. (0), PT (1), BPT (2), PPM (3)", render_fn, 0);
+    parser.add_option("algo",      "a",    "Sets the algorithm used for rendering: debug vis. (0), PT (1), PPM (2), wavefront PT (3), wavefront PT with sorted rays (4)", render_fn, 0);
+
+    parser.add_option("bvh-builder", "bb", "Sets the BVH construction algorithm: sweep, binned, spatial or linear", bvh_builder, std::string("sweep"), "name");
+    parser.add_option("bvh-bins",  "bn",   "Sets the number of bins per axis for the binned and spatial BVH builders", bvh_bins, 16);
+    parser.add_option("sbvh-budget", "sb", "Sets the maximum number of references per triangle for the spatial BVH builder", sbvh_budget, 1.5f);
+    parser.add_option("lbvh-bits", "lb",   "Sets the number of bits of the Morton codes for the linear BVH builder: 30 or 63", lbvh_bits, 30);
+    parser.add_option("lbvh-sah-levels", "ls", "Sets the number of top levels of the linear BVH that are split with the SAH", lbvh_sah_levels, 0);
+    parser.add_option("bvh-optimize", "bo", "Sets the number of treelet restructuring passes run on the BVH after construction", bvh_optimize, 0);
+    parser.add_option("bvh-align", "ba",   "Aligns pairs of sibling BVH nodes on cache lines", bvh_align, false);
+    parser.add_option("bvh-compress", "bc", "Quantizes the bounding boxes of wide BVH nodes to 8 bits", bvh_compress, false);
+    parser.add_option("bvh-tri-block", "bt", "Sets the number of triangles per SIMD block in the BVH leaves: 1, 4 or 8", bvh_tri_block, 1);
+    parser.add_option("bvh-width", "bw",   "Sets the number of children per BVH node: 2, 4 or 8", bvh_width, 2);
+    parser.add_option("bvh-shadow-order", "bs", "Visits the BVH in approximate front-to-back order for shadow rays", bvh_shadow_order, false);
+    parser.add_option("bvh-rebuild-threshold", "br", "Sets the SAH cost increase ratio above which a refitted BVH is rebuilt (when meshes are deformed during hot reloading)", bvh_rebuild_threshold, 1.5f);
+    parser.add_option("bvh-leaf-order", "bl", "Stores the shading data of the triangles in the order of the BVH leaves", bvh_leaf_order, false);
+    parser.add_option("compact-attributes", "ca", "Stores normals and texture coordinates in compressed form (octahedral normals, half-precision texture coordinates)", compact_attributes, false);
+    parser.add_option("scene-cache", "sc", "Sets the directory where the geometry and BVH of the scene are cached between runs", scene_cache, std::string(""), "dir");
+    parser.add_option("stream-scene", "ss", "Opens the window immediately and adds the meshes of the scene to the rendering as they are loaded", stream_scene, false);
+    parser.add_option("hot-reload", "hr", "Reloads the scene when its files are modified, only rebuilding the parts that depend on them", hot_reload, false);
 
     parser.parse();
     if (help) {
@@ -154,11 +189,100 @@ int main(int argc, char** argv) {
         warn("Too many configuration files specified, all but the first will be ignored.");
     }
 
+    BvhSettings bvh_settings;
+    if (bvh_builder == "sweep") {
+        bvh_settings.builder = BvhSettings::Builder::Sweep;
+    } else if (bvh_builder == "binned") {
+        bvh_settings.builder = BvhSettings::Builder::Binned;
+    } else if (bvh_builder == "spatial") {
+        bvh_settings.builder = BvhSettings::Builder::Spatial;
+    } else if (bvh_builder == "linear") {
+        bvh_settings.builder = BvhSettings::Builder::Linear;
+    } else {
+        error("Unknown BVH builder '", bvh_builder, "'. Exiting.");
+        return 1;
+    }
+
+    if (bvh_bins < 2 || bvh_bins > 64) {
+        error("Invalid number of BVH bins (must be between 2 and 64). Exiting.");
+        return 1;
+    }
+    bvh_settings.num_bins = bvh_bins;
+
+    if (sbvh_budget < 1.0f) {
+        error("Invalid spatial BVH budget (must be at least 1). Exiting.");
+        return 1;
+    }
+    bvh_settings.spatial_budget = sbvh_budget;
+
+    if (lbvh_bits != 30 && lbvh_bits != 63) {
+        error("Invalid number of Morton code bits (must be 30 or 63). Exiting.");
+        return 1;
+    }
+    bvh_settings.morton_bits = lbvh_bits;
+
+    if (lbvh_sah_levels < 0) {
+        error("Invalid number of SAH levels for the linear BVH (must be positive). Exiting.");
+        return 1;
+    }
+    bvh_settings.sah_levels = lbvh_sah_levels;
+
+    if (bvh_optimize < 0) {
+        error("Invalid number of BVH optimization passes (must be positive). Exiting.");
+        return 1;
+    }
+    bvh_settings.optimize_passes = bvh_optimize;
+    bvh_settings.align_nodes = bvh_align;
+
+    if (bvh_width != 2 && bvh_width != 4 && bvh_width != 8) {
+        error("Invalid BVH width (must be 2, 4 or 8). Exiting.");
+        return 1;
+    }
+    bvh_settings.width = bvh_width;
+
+    if (bvh_compress && bvh_width == 2) {
+        error("Compressed BVH nodes require a BVH width of 4 or 8. Exiting.");
+        return 1;
+    }
+    bvh_settings.compress_nodes = bvh_compress;
+
+    if (bvh_tri_block != 1 && bvh_tri_block != 4 && bvh_tri_block != 8) {
+        error("Invalid BVH triangle block size (must be 1, 4 or 8). Exiting.");
+        return 1;
+    }
+    bvh_settings.tri_block = bvh_tri_block;
+    bvh_settings.shadow_order = bvh_shadow_order;
+
+    if (bvh_rebuild_threshold < 1.0f) {
+        error("Invalid BVH rebuild threshold (must be at least 1). Exiting.");
+        return 1;
+    }
+    bvh_settings.rebuild_threshold = bvh_rebuild_threshold;
+    bvh_settings.leaf_order = bvh_leaf_order;
+
+    if (stream_scene && (!scene_cache.empty() || compact_attributes)) {
+        error("Scene streaming cannot be combined with the scene cache or compact attributes. Exiting.");
+        return 1;
+    }
+
+    if (hot_reload && (stream_scene || !scene_cache.empty())) {
+        error("Hot reloading cannot be combined with scene streaming or the scene cache. Exiting.");
+        return 1;
+    }
+
     Scene scene;
     scene.width = width;
     scene.height = height;
-    if (!load_scene(args[0], scene))
-        return 1;
+    scene.bvh_settings = bvh_settings;
+    scene.compact_attributes = compact_attributes;
+    scene.cache_dir = scene_cache;
+    SceneStream stream;
+    SceneReloader reloader;
+    const bool loaded = hot_reload   ? reloader.load(args[0], scene) :
+                        stream_scene ? stream.start(args[0], scene) :
+                                       load_scene(args[0], scene);
+    if (!loaded) return 1;
+    bool streaming = stream_scene;
 
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         error("Cannot initialize SDL.");
@@ -188,8 +312,26 @@ int main(int argc, char** argv) {
     while (!done) {
         using namespace std::chrono;
 
+        if (streaming) {
+            if (stream.update(scene)) accum = 0;
+            if (stream.done()) {
+                streaming = false;
+                if (!validate_scene(scene)) {
+                    SDL_DestroyWindow(window);
+                    SDL_Quit();
+                    return 1;
+                }
+            }
+        }
+
+        if (hot_reload && reloader.update(scene)) accum = 0;
+
+        // A streamed scene cannot be rendered before its first meshes and lights are loaded, nor a reloaded scene without them
+        const bool renderable = scene.bvh.node_count() > 0 && !scene.lights.empty();
 #ifndef NDEBUG
-        if (debug || (debug_xmin >= debug_xmax && debug_ymin >= debug_ymax)) {
+        if (renderable && (debug || (debug_xmin >= debug_xmax && debug_ymin >= debug_ymax))) {
+#else
+        if (renderable) {
 #endif
             if (accum++ == 0) {
                 total_time = 0;
@@ -209,8 +351,8 @@ int main(int argc, char** argv) {
 #ifndef NDEBUG
             if (debug) info("Debug information dumped.");
             debug = false;
-        }
 #endif
+        }
 
         if (frames > 20 || (frames > 0 && frame_time > 5000)) {
             info("Average frame time: ", frame_time / frames, " ms.");
@@ -223,7 +365,7 @@ int main(int argc, char** argv) {
         for (int y = 0; y < img.height; y++) {
             uint32_t* row = (uint32_t*)((uint8_t*)screen->pixels + screen->pitch * y);
             for (int x = 0; x < img.width; x++) {
-                auto pix = gamma(img(x, y) / accum);
+                auto pix = gamma(img(x, y) / std::max(accum, 1));
                 const uint8_t r = clamp(pix.x, 0.0f, 1.0f) * 255.0f;
                 const uint8_t g = clamp(pix.y, 0.0f, 1.0f) * 255.0f;
                 const uint8_t b = clamp(pix.z, 0.0f, 1.0f) * 255.0f;
@@ -256,12 +398,12 @@ int main(int argc, char** argv) {
 
         SDL_UpdateWindowSurface(window);
         done = handle_events(window, scene, render_fn, accum);
-        done |= max_samples != 0 && total_frames >= max_samples;
-        done |= max_time != 0.0  && total_time   >= max_time;
+        done |= !streaming && max_samples != 0 && total_frames >= max_samples;
+        done |= !streaming && max_time != 0.0  && total_time   >= max_time;
     }
 
     for (auto& pix : img.pixels)
-        pix = clamp(gamma(pix / accum), rgba(0), rgba(1));
+        pix = clamp(gamma(pix / std::max(accum, 1)), rgba(0), rgba(1));
 
     if (!save_png(img, output_image)) {
         error("Failed to save image to '", output_image, "'.");
@@ -0,0 +1,71 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "mapped_file.h"
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string& path, bool copy_on_write)
+    : data_(nullptr), size_(0), open_(false), file_(INVALID_HANDLE_VALUE), mapping_(nullptr)
+{
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) return;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size)) return;
+    size_ = size.QuadPart;
+
+    // Empty files cannot be mapped
+    if (size_ == 0) {
+        open_ = true;
+        return;
+    }
+
+    mapping_ = CreateFileMappingA(file_, nullptr, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_) return;
+    data_ = static_cast<char*>(MapViewOfFile(mapping_, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0));
+    open_ = data_ != nullptr;
+}
+
+MappedFile::~MappedFile() {
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+}
+#else
+MappedFile::MappedFile(const std::string& path, bool copy_on_write)
+    : data_(nullptr), size_(0), open_(false)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        size_ = st.st_size;
+        if (size_ == 0) {
+            // Empty files cannot be mapped
+            open_ = true;
+        } else {
+            void* ptr = mmap(nullptr, size_, copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED) {
+                data_ = static_cast<char*>(ptr);
+                open_ = true;
+            }
+        }
+    }
+
+    // The mapping stays valid after the file is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_) munmap(data_, size_);
+}
+#endif
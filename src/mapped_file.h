@@ -0,0 +1,35 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+/// View of a file mapped in memory. The contents are not null-terminated.
+class MappedFile {
+public:
+    /// Maps a file in memory. The mapping is read-only, unless copy_on_write is set: the pages can then be modified,
+    /// without changing the file, and are only copied when written to (otherwise they are shared with other processes).
+    MappedFile(const std::string& path, bool copy_on_write = false);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator = (const MappedFile&) = delete;
+
+    /// Returns true if the file could be opened and mapped.
+    bool is_open() const { return open_; }
+    const char* data() const { return data_; }
+    /// Returns the contents of the file, which can only be modified if the file is mapped with copy_on_write.
+    char* data() { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    char* data_;
+    size_t size_;
+    bool open_;
+#ifdef _WIN32
+    void* file_;
+    void* mapping_;
+#endif
+};
+
+#endif // MAPPED_FILE_H
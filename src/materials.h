@@ -27,6 +27,7 @@ struct SurfaceParams {
     bool entering;              ///< True if entering the surface
     float3 point;               ///< Hit point in world coordinates
     float2 uv;                  ///< Texture coordinates
+    float footprint;            ///< Width of the ray footprint in texture space (0 for point lookups in the textures)
     float3 face_normal;         ///< Geometric normal
     LocalCoords coords;         ///< Local coordinates at the hit point, w.r.t shading normal
 };
@@ -96,12 +97,12 @@ public:
     {}
 
     rgb eval(const float3&, const SurfaceParams& surf, const float3&) const override final {
-        return tex(surf.uv.x, surf.uv.y) * kd;
+        return tex(surf.uv.x, surf.uv.y, surf.footprint) * kd;
     }
 
     BsdfSample sample(Sampler& sampler, const SurfaceParams& surf, const float3&, bool) const override final {
         auto sample = sample_cosine_hemisphere(surf.coords, sampler(), sampler());
-        return make_sample(sample.dir, sample.pdf, tex(surf.uv.x, surf.uv.y) * (std::max(dot(sample.dir, surf.coords.n), 0.0f) * kd), surf);
+        return make_sample(sample.dir, sample.pdf, tex(surf.uv.x, surf.uv.y, surf.footprint) * (std::max(dot(sample.dir, surf.coords.n), 0.0f) * kd), surf);
     }
 
     float pdf(const float3& in, const SurfaceParams& surf, const float3&) const override final {
@@ -126,14 +127,14 @@ public:
 
     rgb eval(const float3& in, const SurfaceParams& surf, const float3& out) const override final {
         auto p = std::max(dot(in, reflect(out, surf.coords.n)), 0.0f);
-        return tex(surf.uv.x, surf.uv.y) * std::pow(p, ns) * ks;
+        return tex(surf.uv.x, surf.uv.y, surf.footprint) * std::pow(p, ns) * ks;
     }
 
     BsdfSample sample(Sampler& sampler, const SurfaceParams& surf, const float3& out, bool) const override final {
         auto coords = gen_local_coords(reflect(out, surf.coords.n));
         auto sample = sample_cosine_power_hemisphere(coords, ns, sampler(), sampler());
         auto p = std::max(dot(sample.dir, reflect(out, surf.coords.n)), 0.0f);
-        return make_sample(sample.dir, sample.pdf, tex(surf.uv.x, surf.uv.y) * (std::max(dot(sample.dir, surf.coords.n), 0.0f) * std::pow(p, ns) * ks), surf);
+        return make_sample(sample.dir, sample.pdf, tex(surf.uv.x, surf.uv.y, surf.footprint) * (std::max(dot(sample.dir, surf.coords.n), 0.0f) * std::pow(p, ns) * ks), surf);
     }
 
     float pdf(const float3& in, const SurfaceParams& surf, const float3& out) const override final {
@@ -0,0 +1,41 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <cstdint>
+
+#include "float3.h"
+#include "common.h"
+
+/// Spreads the lowest 10 bits of an integer so that there are two zero bits between each of them.
+inline uint32_t expand_bits(uint32_t x) {
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x <<  8)) & 0x0300F00F;
+    x = (x | (x <<  4)) & 0x030C30C3;
+    x = (x | (x <<  2)) & 0x09249249;
+    return x;
+}
+
+/// Spreads the lowest 21 bits of an integer so that there are two zero bits between each of them.
+inline uint64_t expand_bits(uint64_t x) {
+    x &= 0x1FFFFF;
+    x = (x | (x << 32)) & 0x001F00000000FFFFull;
+    x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+    x = (x | (x <<  8)) & 0x100F00F00F00F00Full;
+    x = (x | (x <<  4)) & 0x10C30C30C30C30C3ull;
+    x = (x | (x <<  2)) & 0x1249249249249249ull;
+    return x;
+}
+
+/// Computes the Morton code of a point, given in normalized coordinates in [0, 1].
+template <typename Key>
+inline Key morton_code(const float3& p) {
+    constexpr int bits_per_axis = sizeof(Key) == 4 ? 10 : 21;
+    constexpr float scale = float(1 << bits_per_axis);
+    const Key x = clamp(int(p.x * scale), 0, (1 << bits_per_axis) - 1);
+    const Key y = clamp(int(p.y * scale), 0, (1 << bits_per_axis) - 1);
+    const Key z = clamp(int(p.z * scale), 0, (1 << bits_per_axis) - 1);
+    return (expand_bits(x) << 2) | (expand_bits(y) << 1) | expand_bits(z);
+}
+
+#endif // MORTON_H
@@ -0,0 +1,94 @@
+#ifndef PACKING_H
+#define PACKING_H
+
+#include <cmath>
+#include <cstdint>
+
+#include "float2.h"
+#include "float3.h"
+#include "common.h"
+
+/// Converts a float to a half-precision float, rounding to the nearest value.
+inline uint16_t float_to_half(float f) {
+    uint32_t x = float_as_int(f);
+    const uint32_t sign = (x >> 16) & 0x8000;
+    x &= 0x7FFFFFFF;
+
+    // Values that are too large become infinities, NaNs stay NaNs
+    if (x >= 0x47800000) return sign | (x > 0x7F800000 ? 0x7E00 : 0x7C00);
+
+    // Values below the smallest normal half become denormals
+    if (x < 0x38800000) {
+        if (x < 0x33000000) return sign;
+        const uint32_t shift = 126 - (x >> 23);
+        const uint32_t m = (x & 0x7FFFFF) | 0x800000;
+        uint32_t h = m >> shift;
+        const uint32_t rem = m & ((1u << shift) - 1), mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (h & 1))) h++;
+        return sign | h;
+    }
+
+    // Rebias the exponent and round the mantissa to nearest even, a carry correctly overflows into the exponent
+    uint32_t h = (x - 0x38000000) >> 13;
+    const uint32_t rem = x & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+    return sign | h;
+}
+
+/// Converts a half-precision float to a float.
+inline float half_to_float(uint16_t h) {
+    const uint32_t sign = uint32_t(h & 0x8000) << 16;
+    const uint32_t e = (h >> 10) & 0x1F;
+    const uint32_t m = h & 0x3FF;
+    if (e == 0)  return int_as_float(sign | float_as_int(float(m) * 5.9604645e-8f));
+    if (e == 31) return int_as_float(sign | 0x7F800000 | (m << 13));
+    return int_as_float(sign | ((e + 112) << 23) | (m << 13));
+}
+
+/// Packs texture coordinates into two half-precision floats.
+inline uint32_t pack_texcoords(const float2& uv) {
+    return uint32_t(float_to_half(uv.x)) | (uint32_t(float_to_half(uv.y)) << 16);
+}
+
+/// Unpacks texture coordinates stored as two half-precision floats.
+inline float2 unpack_texcoords(uint32_t p) {
+    return float2(half_to_float(p & 0xFFFF), half_to_float(p >> 16));
+}
+
+/// Packs a normalized vector into 32 bits, using an octahedral mapping with 16 bits per coordinate.
+/// The maximum angular error is below 0.01 degrees. Zero or non-finite vectors (e.g. the normals of degenerate
+/// triangles) are packed as +Z.
+inline uint32_t pack_normal(const float3& n) {
+    const float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+    if (!(l1 > 0.0f) || !std::isfinite(l1)) return 0;
+    const float inv_l1 = 1.0f / l1;
+    float x = n.x * inv_l1;
+    float y = n.y * inv_l1;
+
+    // Fold the lower hemisphere over the diagonals of the octahedron
+    if (n.z < 0) {
+        const float fx = (1.0f - std::fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+        const float fy = (1.0f - std::fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
+
+    const int qx = int(std::round(clamp(x, -1.0f, 1.0f) * 32767.0f));
+    const int qy = int(std::round(clamp(y, -1.0f, 1.0f) * 32767.0f));
+    return uint32_t(uint16_t(qx)) | (uint32_t(uint16_t(qy)) << 16);
+}
+
+/// Unpacks a vector stored with pack_normal(). The result is normalized.
+inline float3 unpack_normal(uint32_t p) {
+    const float x = int16_t(p & 0xFFFF) * (1.0f / 32767.0f);
+    const float y = int16_t(p >> 16)    * (1.0f / 32767.0f);
+    float3 n(x, y, 1.0f - std::fabs(x) - std::fabs(y));
+
+    // Unfold the lower hemisphere
+    const float t = std::max(-n.z, 0.0f);
+    n.x += n.x >= 0 ? -t : t;
+    n.y += n.y >= 0 ? -t : t;
+    return normalize(n);
+}
+
+#endif // PACKING_H
@@ -0,0 +1,77 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <algorithm>
+#include <vector>
+
+/// Sorts an array of unsigned integer keys and the associated values, using a parallel LSD radix sort.
+/// Only the lowest 'bits' bits of the keys are considered. The sort is stable, and the temporary
+/// arrays must be able to hold n elements. The result is stored in the original arrays.
+template <typename Key, typename Value>
+void radix_sort(Key* keys, Value* values, Key* tmp_keys, Value* tmp_values, int n, int bits = sizeof(Key) * 8) {
+    constexpr int digit_bits = 8;
+    constexpr int radix = 1 << digit_bits;
+    constexpr int chunk_size = 1 << 14;
+    constexpr int max_chunks = 64;
+
+    const int num_chunks = std::max(1, std::min(max_chunks, n / chunk_size));
+    const int per_chunk  = (n + num_chunks - 1) / num_chunks;
+
+    // Histograms for every chunk, stored digit-major so that a prefix sum gives the scatter offsets
+    std::vector<int> offsets(radix * num_chunks);
+
+    Key*   src_keys   = keys;
+    Value* src_values = values;
+    Key*   dst_keys   = tmp_keys;
+    Value* dst_values = tmp_values;
+
+    for (int shift = 0; shift < bits; shift += digit_bits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+
+        #pragma omp parallel for
+        for (int c = 0; c < num_chunks; c++) {
+            const int begin = std::min(n, c * per_chunk);
+            const int end   = std::min(n, begin + per_chunk);
+            for (int i = begin; i < end; i++)
+                offsets[((src_keys[i] >> shift) & (radix - 1)) * num_chunks + c]++;
+        }
+
+        // Skip the pass if all the keys have the same digit
+        bool same_digit = false;
+        for (int d = 0; d < radix; d++) {
+            int count = 0;
+            for (int c = 0; c < num_chunks; c++) count += offsets[d * num_chunks + c];
+            if (count == n) same_digit = true;
+            if (count) break;
+        }
+        if (same_digit) continue;
+
+        int sum = 0;
+        for (auto& offset : offsets) {
+            const int count = offset;
+            offset = sum;
+            sum += count;
+        }
+
+        #pragma omp parallel for
+        for (int c = 0; c < num_chunks; c++) {
+            const int begin = std::min(n, c * per_chunk);
+            const int end   = std::min(n, begin + per_chunk);
+            for (int i = begin; i < end; i++) {
+                const int j = offsets[((src_keys[i] >> shift) & (radix - 1)) * num_chunks + c]++;
+                dst_keys[j]   = src_keys[i];
+                dst_values[j] = src_values[i];
+            }
+        }
+
+        std::swap(src_keys, dst_keys);
+        std::swap(src_values, dst_values);
+    }
+
+    if (src_keys != keys) {
+        std::copy(src_keys, src_keys + n, keys);
+        std::copy(src_values, src_values + n, values);
+    }
+}
+
+#endif // RADIX_SORT_H
@@ -0,0 +1,70 @@
+#ifndef RAY_SORT_H
+#define RAY_SORT_H
+
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+#include "intersect.h"
+#include "bbox.h"
+#include "morton.h"
+#include "radix_sort.h"
+
+/// Reorders batches of incoherent rays (e.g. diffuse bounces), so that consecutive rays have similar origins and directions.
+/// They then traverse the same parts of the BVH one after the other, which makes better use of the caches.
+/// The sort key is made of the direction octant, followed by the Morton code of the origin within the batch.
+class RaySorter {
+public:
+    /// Sorts a batch of rays, the result is available with order().
+    /// If a mask is given, the rays for which it is zero are placed at the end, and the order of these is unspecified.
+    void sort(const Ray* rays, int n, const uint8_t* mask = nullptr) {
+        keys.resize(n);
+        ids.resize(n);
+        tmp_keys.resize(n);
+        tmp_ids.resize(n);
+
+        // Bounding box of the origins, used to quantize them
+        BBox bb = BBox::empty();
+        #pragma omp parallel
+        {
+            BBox local_bb = BBox::empty();
+            #pragma omp for nowait
+            for (int i = 0; i < n; i++) {
+                if (!mask || mask[i]) local_bb = extend(local_bb, rays[i].org);
+            }
+            #pragma omp critical
+            { bb = extend(bb, local_bb); }
+        }
+
+        const float3 extents = bb.max - bb.min;
+        const float3 scale(extents.x > 0 ? 1.0f / extents.x : 0.0f,
+                           extents.y > 0 ? 1.0f / extents.y : 0.0f,
+                           extents.z > 0 ? 1.0f / extents.z : 0.0f);
+
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            ids[i] = i;
+            if (mask && !mask[i]) {
+                keys[i] = 1u << (key_bits - 1);
+                continue;
+            }
+            const auto& dir = rays[i].dir;
+            const uint32_t octant = (dir.x < 0 ? 4 : 0) | (dir.y < 0 ? 2 : 0) | (dir.z < 0 ? 1 : 0);
+            keys[i] = (octant << (key_bits - 4)) | (morton_code<uint32_t>((rays[i].org - bb.min) * scale) >> (30 - (key_bits - 4)));
+        }
+
+        radix_sort(keys.data(), ids.data(), tmp_keys.data(), tmp_ids.data(), n, key_bits);
+    }
+
+    /// Returns the indices of the rays of the last batch, in sorted order.
+    const int* order() const { return ids.data(); }
+
+private:
+    /// Number of bits in the sort keys: 1 for the mask, 3 for the octant and 9 per axis for the origin
+    static constexpr int key_bits = 31;
+
+    std::vector<uint32_t> keys, tmp_keys;
+    std::vector<int> ids, tmp_ids;
+};
+
+#endif // RAY_SORT_H
@@ -13,5 +13,9 @@ void render_pt(const Scene& scene, Image& img, int iter);
 void render_bpt(const Scene& scene, Image& img, int iter);
 /// Renders an image using Progressive Photon Mapping.
 void render_ppm(const Scene& scene, Image& img, int iter);
+/// Renders an image using a wavefront Path Tracer, which processes all the paths of the image one stage at a time.
+void render_wavefront(const Scene& scene, Image& img, int iter);
+/// Same as render_wavefront, but reorders the rays by direction and origin before tracing them.
+void render_wavefront_sorted(const Scene& scene, Image& img, int iter);
 
 #endif // RENDER_H
@@ -1,56 +1,154 @@
 #define YAML_CPP_DLL
 #include <chrono>
+#include <algorithm>
 #include <fstream>
+#include <sstream>
+#include <random>
+#include <cstdio>
 #include <cassert>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <unordered_set>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
 
 #include <yaml-cpp/yaml.h>
 
 #include "scene.h"
 #include "load_obj.h"
+#include "load_ply.h"
+#include "serialize.h"
+#include "radix_sort.h"
+#include "hash.h"
  
-struct TriIdx {
-    int v0, v1, v2, m;
-    TriIdx(int v0, int v1, int v2, int m)
-        : v0(v0), v1(v1), v2(v2), m(m)
-    {}
+struct CompareIndex {
+    bool operator () (const obj::Index& a, const obj::Index& b) const {
+        return a.v == b.v && a.t == b.t && a.n == b.n;
+    }
 };
 
-struct HashIndex {
-    size_t operator () (const obj::Index& i) const {
-        unsigned h = 0, g;
+/// Hashes the indices of a face corner, so that distinct corners rarely collide.
+static uint64_t hash_index(const obj::Index& i) {
+    return murmur_mix64(murmur_mix64((uint64_t(uint32_t(i.v)) << 32) | uint32_t(i.t)) ^ uint32_t(i.n));
+}
 
-        h = (h << 4) + i.v;
-        g = h & 0xF0000000;
-        h = g ? (h ^ (g >> 24)) : h;
-        h &= ~g;
+/// Removes the duplicate vertices of an OBJ object, by sorting its face corners by hash in parallel.
+/// The vertices are numbered in order of first appearance. Returns the vertex index of every face corner,
+/// in the order of the faces, and stores the OBJ indices of the unique vertices in 'vertices'.
+static std::vector<int> dedup_vertices(const obj::Object& obj, std::vector<obj::Index>& vertices) {
+    std::vector<obj::Index> corners;
+    for (auto& group : obj.groups) {
+        for (auto& face : group.faces)
+            corners.insert(corners.end(), face.indices, face.indices + face.index_count);
+    }
+    const int n = corners.size();
 
-        h = (h << 4) + i.t;
-        g = h & 0xF0000000;
-        h = g ? (h ^ (g >> 24)) : h;
-        h &= ~g;
+    std::vector<uint64_t> keys(n), tmp_keys(n);
+    std::vector<int> order(n), first(n);
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        keys[i] = hash_index(corners[i]);
+        order[i] = i;
+    }
+    radix_sort(keys.data(), order.data(), tmp_keys.data(), first.data(), n);
+    std::vector<uint64_t>().swap(tmp_keys);
 
-        h = (h << 4) + i.n;
-        g = h & 0xF0000000;
-        h = g ? (h ^ (g >> 24)) : h;
-        h &= ~g;
+    // The sort is stable: in a run of equal hashes, the first corner with given indices is their first appearance.
+    // Different indices in the same run (hash collisions) are told apart by comparing them.
+    #pragma omp parallel for schedule(dynamic, 4096)
+    for (int i = 0; i < n; i++) {
+        if (i > 0 && keys[i] == keys[i - 1]) continue;
+        int end = i + 1;
+        while (end < n && keys[end] == keys[i]) end++;
+        for (int j = i; j < end; j++) {
+            int k = i;
+            while (!CompareIndex()(corners[order[k]], corners[order[j]])) k++;
+            first[order[j]] = order[k];
+        }
+    }
 
-        return h;
+    std::vector<int> ids(n);
+    int num_verts = 0;
+    for (int i = 0; i < n; i++) {
+        if (first[i] == i) ids[i] = num_verts++;
     }
-};
 
-struct CompareIndex {
-    bool operator () (const obj::Index& a, const obj::Index& b) const {
-        return a.v == b.v && a.t == b.t && a.n == b.n;
+    vertices.resize(num_verts);
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        if (first[i] == i) vertices[ids[i]] = corners[i];
+        else ids[i] = ids[first[i]];
     }
-};
+    return ids;
+}
 
 typedef std::unordered_map<std::string, int> TextureMap;
 
+/// Information about a mesh that is needed to recreate its materials and lights without loading its OBJ file again.
+struct MeshInfo {
+    std::string file;
+    int first_tri;                          ///< Index of the first triangle of the mesh in the scene
+    int num_tris;
+    std::vector<std::string> materials;     ///< Names of the materials of the OBJ file
+    std::vector<std::string> mtl_libs;      ///< MTL files referenced by the OBJ file
+    std::vector<int> light_tris;            ///< Emissive triangles, as pairs of a triangle index and a material index in the OBJ file
+};
+
+/// State of the scene cache during loading. The mesh data and the BVHs of a cached scene are directly stored in the scene.
+struct SceneCache {
+    uint64_t key;                   ///< Hash of the scene file and of the BVH settings
+    bool hit;                       ///< Set if the scene was found in the cache: the meshes are then not loaded again
+    bool complete;                  ///< Cleared if a mesh cannot be loaded, in which case the scene is not cached
+    std::vector<MeshInfo> meshes;   ///< Meshes of the scene, in loading order
+    size_t next_mesh;               ///< Next mesh to recreate from the cache
+    int num_static_tris;            ///< Number of triangles that are not instanced
+
+    SceneCache() : key(0), hit(false), complete(true), next_mesh(0), num_static_tris(0) {}
+};
+
+/// Contents of an OBJ file and of its MTL files, or of a PLY file, loaded concurrently with the other meshes of the
+/// scene. The triangles are stored as in Scene::indices, but with vertex indices relative to the mesh and material
+/// indices relative to the materials of the file.
+struct MeshData {
+    bool loaded;                            ///< Cleared if the mesh file cannot be loaded
+    std::string missing_mtl;                ///< MTL file that cannot be loaded, if any
+    std::vector<std::string> materials;
+    std::vector<std::string> mtl_libs;
+    obj::MaterialLib mat_lib;
+    std::vector<float3> vertices;
+    std::vector<float2> texcoords;
+    std::vector<float3> normals;
+    std::vector<int> indices;
+    std::vector<float3> face_normals;
+    bool recomputed_normals;                ///< Set if some objects have no normals, which are then computed from the geometry
+
+    MeshData() : loaded(false), recomputed_normals(false) {}
+};
+
+/// Meshes and texture images of a scene. They are loaded concurrently, and then added to the scene in order,
+/// so that the result does not depend on the scheduling of the loading tasks.
+struct SceneAssets {
+    std::unordered_map<std::string, MeshData> meshes;
+    std::unordered_map<std::string, Image> images;      ///< Decoded images (empty if they cannot be decoded)
+    bool keep_images;                                   ///< Copies the images into the textures instead of moving them
+
+    SceneAssets() : keep_images(false) {}
+};
+
 static void compute_face_normals(const std::vector<int>& indices,
                                  const std::vector<float3>& vertices,
                                  std::vector<float3>& face_normals,
                                  int first_index) {
-    for (int i = first_index, k = indices.size(); i < k; i += 4) {
+    const int num_indices = indices.size();
+    #pragma omp parallel for
+    for (int i = first_index; i < num_indices; i += 4) {
         const float3& v0 = vertices[indices[i + 0]];
         const float3& v1 = vertices[indices[i + 1]];
         const float3& v2 = vertices[indices[i + 2]];
@@ -73,7 +171,8 @@ static void recompute_normals(const std::vector<int>& indices,
     }
 }
 
-static int load_texture(const FilePath& path, TextureMap& tex_map, Scene& scene) {
+/// Creates a texture from an image file. The image is normally decoded in advance, see load_assets().
+static int load_texture(const FilePath& path, TextureMap& tex_map, SceneAssets& assets, Scene& scene) {
     auto it = tex_map.find(path);
     if (it != tex_map.end())
         return it->second;
@@ -81,9 +180,13 @@ static int load_texture(const FilePath& path, TextureMap& tex_map, Scene& scene)
     int id = -1;
 
     Image img;
-    if (load_png(path, img) || load_tga(path, img)) {
+    auto decoded = assets.images.find(path);
+    if (decoded != assets.images.end() && assets.keep_images) img = decoded->second;
+    else if (decoded != assets.images.end()) img = std::move(decoded->second);
+    else if (!load_png(path, img) && !load_tga(path, img)) img.resize(0, 0);
+
+    if (img.width * img.height > 0) {
         id = scene.textures.size();
-        assert(img.width * img.height > 0);
         scene.textures.emplace_back(new ImageTexture(std::move(img)));
     } else {
         warn("Invalid PNG/TGA texture '", path.path(), "'.");
@@ -93,25 +196,13 @@ static int load_texture(const FilePath& path, TextureMap& tex_map, Scene& scene)
     return id;
 }
 
-static bool load_mesh(const std::string& file, TextureMap& tex_map, Scene& scene) {
-    FilePath path(file);
-
-    obj::File obj_file;
-    if (!load_obj(path, obj_file)) {
-        error("Cannot open OBJ file '", file, "'.");
-        return false;
-    }
-
-    obj::MaterialLib mat_lib;
-    for (auto& lib_file : obj_file.mtl_libs) {
-        if (!load_mtl(path.base_name() + "/" + lib_file, mat_lib)) {
-            error("Cannot open MTL file '", lib_file, "'.");
-            return false;
-        }
-    }
-
-    const int mtl_offset = scene.materials.size();
-
+/// Creates the materials of an OBJ file, given their names and the MTL files that define them.
+/// Returns the emission of every material in map_ke.
+static void load_materials(const FilePath& path,
+                           const std::vector<std::string>& materials,
+                           const obj::MaterialLib& mat_lib,
+                           TextureMap& tex_map, SceneAssets& assets, Scene& scene,
+                           std::vector<rgb>& map_ke) {
     // Create a dummy constant texture color for incorrect texture references
     auto dummy_tex  = new ConstantTexture(rgb(1.0f, 0.0f, 1.0f));
     auto dummy_bsdf = new DiffuseBsdf(*dummy_tex);
@@ -121,13 +212,13 @@ static bool load_mesh(const std::string& file, TextureMap& tex_map, Scene& scene
     scene.bsdfs.emplace_back(dummy_bsdf);
     scene.materials.emplace_back(dummy_bsdf);
 
-    std::vector<rgb> map_ke(obj_file.materials.size(), rgb(0.0f));
+    map_ke.assign(materials.size(), rgb(0.0f));
 
     // Create the materials for this OBJ file
-    for (int i = 1, n = obj_file.materials.size(); i < n; i++) {
-        auto it = mat_lib.find(obj_file.materials[i]);
+    for (int i = 1, n = materials.size(); i < n; i++) {
+        auto it = mat_lib.find(materials[i]);
         if (it == mat_lib.end()) {
-            warn("Cannot find material '", obj_file.materials[i], "'.");
+            warn("Cannot find material '", materials[i], "'.");
             scene.materials.emplace_back(scene.bsdfs[0].get());
             continue;
         }
@@ -143,16 +234,15 @@ static bool load_mesh(const std::string& file, TextureMap& tex_map, Scene& scene
             default:
                 Texture* diff_tex = nullptr;
                 if (mat.map_kd != "") {
-                    int id = load_texture(path.base_name() + "/" + mat.map_kd, tex_map, scene);
+                    int id = load_texture(path.base_name() + "/" + mat.map_kd, tex_map, assets, scene);
                     diff_tex = id >= 0 ? scene.textures[id].get() : nullptr;
                 }
 
                 Texture* spec_tex = nullptr;
                 if (mat.map_ks != "") {
-                    int id = load_texture(path.base_name() + "/" + mat.map_ks, tex_map, scene);
+                    int id = load_texture(path.base_name() + "/" + mat.map_ks, tex_map, assets, scene);
                     spec_tex = id >= 0 ? scene.textures[id].get() : nullptr;
                 }
-
                 auto kd = dot(mat.kd, luminance);
                 auto ks = dot(mat.ks, luminance);
                 Bsdf* diff = nullptr, *spec = nullptr;
@@ -191,113 +281,378 @@ static bool load_mesh(const std::string& file, TextureMap& tex_map, Scene& scene
         scene.materials.emplace_back(bsdf);
     }
 
+}
+
+/// Returns the texture files that load_materials() uses for the materials of a mesh.
+static void texture_files(const FilePath& path, const MeshData& data, std::vector<std::string>& files) {
+    for (int i = 1, n = data.materials.size(); i < n; i++) {
+        auto it = data.mat_lib.find(data.materials[i]);
+        if (it == data.mat_lib.end() || it->second.illum == 5 || it->second.illum == 7) continue;
+        if (it->second.map_kd != "") files.push_back(FilePath(path.base_name() + "/" + it->second.map_kd).path());
+        if (it->second.map_ks != "") files.push_back(FilePath(path.base_name() + "/" + it->second.map_ks).path());
+    }
+}
+
+/// Name of the material given to the triangles of PLY files, which have no materials.
+static const char* ply_material = "ply_default";
+
+/// Returns true if a mesh file is a PLY file, based on its extension.
+static bool is_ply_file(const FilePath& path) {
+    auto ext = path.extension();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == "ply";
+}
+
+/// Loads the MTL files of a mesh. PLY files have no MTL files, and use a plain diffuse material instead.
+static void load_mtl_libs(const FilePath& path, MeshData& data) {
+    if (is_ply_file(path)) {
+        obj::Material mat = obj::Material();
+        mat.kd = rgb(0.8f);
+        mat.ni = 1.0f;
+        mat.d = 1.0f;
+        mat.illum = 1;
+        data.mat_lib[ply_material] = mat;
+        return;
+    }
+
+    for (auto& lib_file : data.mtl_libs) {
+        if (!load_mtl(path.base_name() + "/" + lib_file, data.mat_lib)) {
+            data.missing_mtl = lib_file;
+            return;
+        }
+    }
+}
+
+/// Loads a PLY file, directly in the layout of the scene, and computes the normals if the file has none.
+static void load_ply_data(const FilePath& path, MeshData& data) {
+    if (!load_ply(path, data.vertices, data.normals, data.texcoords, data.indices, 1)) return;
+
+    // Like objects of OBJ files, files without triangles (e.g. point clouds) do not add any vertex to the scene
+    if (data.indices.empty()) {
+        std::vector<float3>().swap(data.vertices);
+        std::vector<float3>().swap(data.normals);
+        std::vector<float2>().swap(data.texcoords);
+    }
+
+    data.loaded    = true;
+    data.materials = { "", ply_material };
+    load_mtl_libs(path, data);
+
+    data.face_normals.resize(data.indices.size() / 4);
+    compute_face_normals(data.indices, data.vertices, data.face_normals, 0);
+
+    if (data.normals.empty()) {
+        data.recomputed_normals = true;
+        data.normals.resize(data.vertices.size(), float3(0.0f));
+        recompute_normals(data.indices, data.face_normals, data.normals, 0);
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < (int)data.normals.size(); i++)
+        data.normals[i] = normalize(data.normals[i]);
+}
+
+/// Loads an OBJ file and its MTL files, converts the faces to triangles and computes the normals.
+static void load_mesh_data(const FilePath& path, MeshData& data) {
+    if (is_ply_file(path)) return load_ply_data(path, data);
+
+    obj::File obj_file;
+    if (!load_obj(path, obj_file)) return;
+
+    data.loaded     = true;
+    data.materials  = std::move(obj_file.materials);
+    data.mtl_libs   = std::move(obj_file.mtl_libs);
+    load_mtl_libs(path, data);
+
     for (auto& obj: obj_file.objects) {
-        // Convert the faces to triangles & build the new list of indices
-        std::vector<TriIdx> triangles;
-        std::unordered_map<obj::Index, int, HashIndex, CompareIndex> mapping;
+        std::vector<obj::Index> vertices;
+        const auto ids = dedup_vertices(obj, vertices);
 
         bool has_normals = false;
         bool has_texcoords = false;
+        for (auto& v : vertices) {
+            has_normals |= (v.n != 0);
+            has_texcoords |= (v.t != 0);
+        }
+
+        // Convert the faces to triangles & build the new list of indices
+        const int vtx_offset = data.vertices.size();
+        const int idx_offset = data.indices.size();
+        int corner = 0;
         for (auto& group : obj.groups) {
             for (auto& face : group.faces) {
-                for (int i = 0; i < face.index_count; i++) {
-                    auto map = mapping.find(face.indices[i]);
-                    if (map == mapping.end()) {
-                        has_normals |= (face.indices[i].n != 0);
-                        has_texcoords |= (face.indices[i].t != 0);
-
-                        mapping.insert(std::make_pair(face.indices[i], mapping.size()));
-                    }
-                }
-
-                const int mtl_idx = face.material + mtl_offset;
-                const int v0 = mapping[face.indices[0]];
-                int prev = mapping[face.indices[1]];
+                const int v0 = ids[corner] + vtx_offset;
+                int prev = ids[corner + 1] + vtx_offset;
 
                 for (int i = 1; i < face.index_count - 1; i++) {
-                    const int next = mapping[face.indices[i + 1]];
-
-                    int new_mtl_idx = mtl_idx;
-                    auto& ke = map_ke[mtl_idx - mtl_offset];
-                    if (lensqr(ke) > 0.0f) {
-                        // This triangle is a light
-                        scene.lights.emplace_back(
-                            new TriangleLight(obj_file.vertices[face.indices[0 + 0].v],
-                                              obj_file.vertices[face.indices[i + 0].v],
-                                              obj_file.vertices[face.indices[i + 1].v],
-                                              ke));
-                        new_mtl_idx = scene.materials.size();
-                        scene.materials.emplace_back(
-                            scene.materials[mtl_idx].bsdf,
-                            scene.lights.back().get());
-                    }
-                    triangles.emplace_back(v0, prev, next, new_mtl_idx);
+                    const int next = ids[corner + i + 1] + vtx_offset;
+                    data.indices.insert(data.indices.end(), {v0, prev, next, face.material});
                     prev = next;
                 }
+                corner += face.index_count;
             }
         }
 
-        if (triangles.size() == 0) continue;
+        if (int(data.indices.size()) == idx_offset) continue;
 
-        // Add this object to the scene
-        const int vtx_offset = scene.vertices.size();
-        const int idx_offset = scene.indices.size();
-        scene.indices.resize(idx_offset + 4 * triangles.size());
-        scene.vertices.resize(vtx_offset + mapping.size());
-        scene.texcoords.resize(vtx_offset + mapping.size());
-        scene.normals.resize(vtx_offset + mapping.size());
+        // Add the vertices of this object to the mesh
+        data.vertices.resize(vtx_offset + vertices.size());
+        data.texcoords.resize(vtx_offset + vertices.size());
+        data.normals.resize(vtx_offset + vertices.size());
 
-        for (int i = 0, n = triangles.size(); i < n; i++) {
-            auto& t = triangles[i];
-            scene.indices[idx_offset + i * 4 + 0] = t.v0 + vtx_offset;
-            scene.indices[idx_offset + i * 4 + 1] = t.v1 + vtx_offset;
-            scene.indices[idx_offset + i * 4 + 2] = t.v2 + vtx_offset;
-            scene.indices[idx_offset + i * 4 + 3] = t.m;
-        }
-
-        for (auto& p : mapping) {
-            const auto& v = obj_file.vertices[p.first.v];
-            scene.vertices[vtx_offset + p.second].x = v.x;
-            scene.vertices[vtx_offset + p.second].y = v.y;
-            scene.vertices[vtx_offset + p.second].z = v.z;
+        for (int i = 0, n = vertices.size(); i < n; i++) {
+            const auto& v = obj_file.vertices[vertices[i].v];
+            data.vertices[vtx_offset + i].x = v.x;
+            data.vertices[vtx_offset + i].y = v.y;
+            data.vertices[vtx_offset + i].z = v.z;
         }
 
         if (has_texcoords) {
-            for (auto& p : mapping) {
-                const auto& t = obj_file.texcoords[p.first.t];
-                scene.texcoords[vtx_offset + p.second] = t;
-            }
-        } else std::fill(scene.texcoords.begin() + vtx_offset, scene.texcoords.end(), float2(0.0f));
+            for (int i = 0, n = vertices.size(); i < n; i++)
+                data.texcoords[vtx_offset + i] = obj_file.texcoords[vertices[i].t];
+        } else std::fill(data.texcoords.begin() + vtx_offset, data.texcoords.end(), float2(0.0f));
 
-        // Compute the geometric normals for this mesh
-        scene.face_normals.resize(scene.face_normals.size() + triangles.size());
-        compute_face_normals(scene.indices, scene.vertices, scene.face_normals, idx_offset);
+        // Compute the geometric normals for this object
+        data.face_normals.resize(data.indices.size() / 4);
+        compute_face_normals(data.indices, data.vertices, data.face_normals, idx_offset);
 
         if (has_normals) {
-            // Set up mesh normals
-            for (auto& p : mapping) {
-                const auto& n = obj_file.normals[p.first.n];
-                scene.normals[vtx_offset + p.second] = n;
-            }
+            for (int i = 0, n = vertices.size(); i < n; i++)
+                data.normals[vtx_offset + i] = obj_file.normals[vertices[i].n];
         } else {
             // Recompute normals
-            warn("No normals are present, recomputing smooth normals from geometry.");
-            std::fill(scene.normals.begin() + vtx_offset, scene.normals.end(), float3(0.0f));
-            recompute_normals(scene.indices, scene.face_normals, scene.normals, idx_offset);
+            data.recomputed_normals = true;
+            std::fill(data.normals.begin() + vtx_offset, data.normals.end(), float3(0.0f));
+            recompute_normals(data.indices, data.face_normals, data.normals, idx_offset);
         }
     }
 
     // Re-normalize all the values in the OBJ file to handle invalid meshes
-    for (auto& n : scene.normals)
+    for (auto& n : data.normals)
         n = normalize(n);
+}
 
-    return true;
+/// Loads the given meshes and the textures that they use, unless they are already loaded. The meshes are loaded in
+/// parallel, and then the textures. When the scene is found in the cache, only the MTL files of the meshes are loaded.
+static void load_assets(const std::vector<std::string>& files, const SceneCache& cache, SceneAssets& assets) {
+    std::vector<std::pair<std::string, MeshData*>> meshes;
+    for (auto& file : files) {
+        auto it = assets.meshes.emplace(file, MeshData());
+        if (it.second) meshes.emplace_back(file, &it.first->second);
+    }
+
+    // A single mesh is loaded with the parallel OBJ or PLY parser instead
+    #pragma omp parallel for schedule(dynamic, 1) if (meshes.size() > 1)
+    for (int i = 0; i < (int)meshes.size(); i++) {
+        const FilePath path(meshes[i].first);
+        MeshData& data = *meshes[i].second;
+        if (!cache.hit) {
+            load_mesh_data(path, data);
+            continue;
+        }
+
+        auto info = std::find_if(cache.meshes.begin(), cache.meshes.end(), [&] (const MeshInfo& mesh) {
+            return mesh.file == meshes[i].first;
+        });
+        if (info == cache.meshes.end()) continue;
+        data.loaded     = true;
+        data.materials  = info->materials;
+        data.mtl_libs   = info->mtl_libs;
+        load_mtl_libs(path, data);
+    }
+
+    std::vector<std::pair<std::string, Image*>> images;
+    for (auto& file : files) {
+        std::vector<std::string> tex_files;
+        texture_files(FilePath(file), assets.meshes[file], tex_files);
+        for (auto& tex_file : tex_files) {
+            auto it = assets.images.emplace(tex_file, Image());
+            if (it.second) images.emplace_back(tex_file, &it.first->second);
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < (int)images.size(); i++) {
+        Image& img = *images[i].second;
+        if (!load_png(images[i].first, img) && !load_tga(images[i].first, img))
+            img.resize(0, 0);
+    }
+}
+
+/// Recreates the materials and lights of a mesh whose triangles have been loaded from the scene cache.
+static const MeshInfo* load_cached_mesh(const std::string& file, TextureMap& tex_map, SceneAssets& assets, Scene& scene, SceneCache& cache) {
+    auto data = assets.meshes.find(file);
+    if (cache.next_mesh >= cache.meshes.size() || cache.meshes[cache.next_mesh].file != file || data == assets.meshes.end()) {
+        error("The scene cache does not match the mesh '", file, "'.");
+        return nullptr;
+    }
+    if (!data->second.missing_mtl.empty()) {
+        error("Cannot open MTL file '", data->second.missing_mtl, "'.");
+        return nullptr;
+    }
+    const MeshInfo& info = cache.meshes[cache.next_mesh++];
+
+    const int mtl_offset = scene.materials.size();
+    std::vector<rgb> map_ke;
+    load_materials(FilePath(file), info.materials, data->second.mat_lib, tex_map, assets, scene, map_ke);
+
+    for (size_t i = 0; i < info.light_tris.size(); i += 2) {
+        const int* idx = &scene.indices[info.light_tris[i] * 4];
+        const int mtl_idx = info.light_tris[i + 1] + mtl_offset;
+        scene.lights.emplace_back(
+            new TriangleLight(scene.vertices[idx[0]],
+                              scene.vertices[idx[1]],
+                              scene.vertices[idx[2]],
+                              map_ke[mtl_idx - mtl_offset]));
+        assert(idx[3] == (int)scene.materials.size());
+        scene.materials.emplace_back(
+            scene.materials[mtl_idx].bsdf,
+            scene.lights.back().get());
+    }
+
+    return &info;
+}
+
+/// Appends the triangles of a mesh loaded with load_assets() to the scene. Emissive materials create lights, unless
+/// lights are disabled (for instanced meshes, whose vertices are not in world space). When the scene is found in the
+/// cache, only the materials and lights are created. Returns information about the mesh, which stays valid until the
+/// next mesh is loaded, or nullptr if the mesh cannot be loaded.
+static const MeshInfo* load_mesh(const std::string& file, TextureMap& tex_map, SceneAssets& assets, Scene& scene, SceneCache& cache, bool create_lights = true) {
+    if (cache.hit) return load_cached_mesh(file, tex_map, assets, scene, cache);
+
+    auto it = assets.meshes.find(file);
+    if (it == assets.meshes.end() || !it->second.loaded) {
+        error("Cannot open mesh file '", file, "'.");
+        cache.complete = false;
+        return nullptr;
+    }
+    const MeshData& data = it->second;
+    if (!data.missing_mtl.empty()) {
+        error("Cannot open MTL file '", data.missing_mtl, "'.");
+        cache.complete = false;
+        return nullptr;
+    }
+
+    MeshInfo info;
+    info.file = file;
+    info.first_tri = scene.indices.size() / 4;
+    info.num_tris = data.indices.size() / 4;
+    info.materials = data.materials;
+    info.mtl_libs = data.mtl_libs;
+
+    const int mtl_offset = scene.materials.size();
+    std::vector<rgb> map_ke;
+    load_materials(FilePath(file), data.materials, data.mat_lib, tex_map, assets, scene, map_ke);
+
+    if (data.recomputed_normals)
+        warn("No normals are present in '", file, "', recomputing smooth normals from geometry.");
+
+    // Lights may add vertices without normals or texture coordinates
+    const int vtx_offset = scene.vertices.size();
+    scene.vertices.insert(scene.vertices.end(), data.vertices.begin(), data.vertices.end());
+    scene.texcoords.resize(vtx_offset);
+    scene.texcoords.insert(scene.texcoords.end(), data.texcoords.begin(), data.texcoords.end());
+    scene.normals.resize(vtx_offset);
+    scene.normals.insert(scene.normals.end(), data.normals.begin(), data.normals.end());
+    scene.face_normals.insert(scene.face_normals.end(), data.face_normals.begin(), data.face_normals.end());
+
+    bool ignored_lights = false;
+    scene.indices.resize(scene.indices.size() + data.indices.size());
+    for (int i = 0; i < info.num_tris; i++) {
+        const int* idx = &data.indices[i * 4];
+        int mtl_idx = idx[3] + mtl_offset;
+
+        auto& ke = map_ke[idx[3]];
+        if (lensqr(ke) > 0.0f && !create_lights) {
+            ignored_lights = true;
+        } else if (lensqr(ke) > 0.0f) {
+            // This triangle is a light
+            info.light_tris.push_back(info.first_tri + i);
+            info.light_tris.push_back(idx[3]);
+            scene.lights.emplace_back(
+                new TriangleLight(data.vertices[idx[0]],
+                                  data.vertices[idx[1]],
+                                  data.vertices[idx[2]],
+                                  ke));
+            scene.materials.emplace_back(
+                scene.materials[mtl_idx].bsdf,
+                scene.lights.back().get());
+            mtl_idx = scene.materials.size() - 1;
+        }
+
+        int* tri = &scene.indices[(info.first_tri + i) * 4];
+        tri[0] = idx[0] + vtx_offset;
+        tri[1] = idx[1] + vtx_offset;
+        tri[2] = idx[2] + vtx_offset;
+        tri[3] = mtl_idx;
+    }
+
+    if (ignored_lights)
+        warn("Emissive materials are not supported on instanced meshes, the emission of '", file, "' is ignored.");
+
+    cache.meshes.push_back(std::move(info));
+    return &cache.meshes.back();
 }
 
 static float3 parse_float3(const YAML::Node& node) {
     return float3(node[0].as<float>(), node[1].as<float>(), node[2].as<float>());
 }
 
+/// Range of triangles of a mesh that is instanced in the scene.
+struct InstancedMesh {
+    int first_tri;
+    int num_tris;
+};
+
+/// Instance of a mesh, as given in the scene file.
+struct MeshInstance {
+    int mesh;
+    Transform to_world;
+};
+
+typedef std::unordered_map<std::string, int> MeshMap;
+
+/// Parses the transformation of an instance, made of a scaling, a rotation and a translation, applied in that order.
+static Transform parse_transform(const YAML::Node& node) {
+    auto translate = Transform::identity();
+    auto rotate    = Transform::identity();
+    auto scale     = Transform::identity();
+
+    if (node["translate"]) translate = Transform::translation(parse_float3(node["translate"]));
+    if (auto r = node["rotate"]) rotate = Transform::rotation(parse_float3(r), r[3].as<float>());
+    if (auto s = node["scale"]) scale = Transform::scaling(s.IsScalar() ? float3(s.as<float>()) : parse_float3(s));
+
+    return translate * rotate * scale;
+}
+
+/// Returns the transformation of an instance, which must be invertible.
+static Transform parse_instance_transform(const YAML::Node& node) {
+    const auto to_world = parse_transform(node);
+    if (std::fabs(dot(float3(to_world.rows[0]), cross(float3(to_world.rows[1]), float3(to_world.rows[2])))) < 1e-12f)
+        throw YAML::Exception(node.Mark(), "singular instance transformation");
+    return to_world;
+}
+
+static void setup_instance(Scene& scene, const YAML::Node& node, const FilePath& config_path, TextureMap& tex_map, SceneAssets& assets, SceneCache& cache,
+                           MeshMap& mesh_map, std::vector<InstancedMesh>& meshes, std::vector<MeshInstance>& instances) {
+    auto file = config_path.base_name() + "/" + node["mesh"].as<std::string>();
+
+    // Every mesh is only loaded once, no matter how many times it is instanced
+    auto it = mesh_map.find(file);
+    if (it == mesh_map.end()) {
+        auto info = load_mesh(file, tex_map, assets, scene, cache, false);
+        if (!info) return;
+        if (info->num_tris == 0) {
+            warn("The instanced mesh '", file, "' has no triangles.");
+            return;
+        }
+        it = mesh_map.emplace(file, meshes.size()).first;
+        meshes.push_back(InstancedMesh{info->first_tri, info->num_tris});
+    }
+
+    instances.push_back(MeshInstance{it->second, parse_instance_transform(node)});
+}
+
 static void setup_camera(Scene& scene, const YAML::Node& node) {
     if (node.Tag() == "!perspective_camera") {
         scene.camera.reset(new PerspectiveCamera(
@@ -311,33 +666,42 @@ static void setup_camera(Scene& scene, const YAML::Node& node) {
     }
 }
 
-static void setup_light(Scene& scene, const YAML::Node& node) {
+/// Creates a light. The triangle of a triangle light is only added to the scene if add_geometry is set
+/// (it is already present when the scene is loaded from the cache).
+static void setup_light(Scene& scene, const YAML::Node& node, bool add_geometry) {
     if (node.Tag() == "!point_light") {
         scene.lights.emplace_back(new PointLight(
             parse_float3(node["position"]),
             parse_float3(node["color"])));
     } else if (node.Tag() == "!triangle_light") {
-        int first = scene.vertices.size();
-        scene.vertices.emplace_back(parse_float3(node["v0"]));
-        scene.vertices.emplace_back(parse_float3(node["v1"]));
-        scene.vertices.emplace_back(parse_float3(node["v2"]));
+        const float3 v0 = parse_float3(node["v0"]);
+        const float3 v1 = parse_float3(node["v1"]);
+        const float3 v2 = parse_float3(node["v2"]);
         auto color = parse_float3(node["color"]);
-        scene.lights.emplace_back(new TriangleLight(
-            scene.vertices[first + 0],
-            scene.vertices[first + 1],
-            scene.vertices[first + 2],
-            color));
+        scene.lights.emplace_back(new TriangleLight(v0, v1, v2, color));
         int mat = scene.materials.size();
-        scene.indices.insert(scene.indices.end(),
-            {first, first + 1, first + 2, mat});
+        if (add_geometry) {
+            int first = scene.vertices.size();
+            scene.vertices.insert(scene.vertices.end(), {v0, v1, v2});
+            scene.indices.insert(scene.indices.end(),
+                {first, first + 1, first + 2, mat});
+            scene.face_normals.emplace_back(normalize(cross(v1 - v0, v2 - v0)));
+        }
         scene.materials.emplace_back(nullptr, scene.lights.back().get());
     } else {
         throw YAML::Exception(node.Mark(), "unknown light type");
     }
 }
 
+/// Gives a normal and texture coordinates to the vertices that have none (those of the triangle lights), so that the
+/// shading data can be read for every vertex of the scene.
+static void pad_vertex_attributes(Scene& scene) {
+    scene.normals.resize(scene.vertices.size());
+    scene.texcoords.resize(scene.vertices.size());
+}
+
 bool validate_scene(const Scene& scene) {
-    if (scene.vertices.size() == 0) {
+    if (scene.indices.empty()) {
         error("There is no mesh in the scene.");
         return false;
     }
@@ -355,6 +719,352 @@ bool validate_scene(const Scene& scene) {
     return true;
 }
 
+/// Returns the offset that is added to the hits of every bottom-level BVH of the scene: the index of its first
+/// triangle, or the index of its first shading record when the shading data is stored in leaf order.
+static std::vector<int> mesh_bvh_offsets(const Scene& scene) {
+    if (!scene.bvh_settings.leaf_order) return scene.mesh_bvh_tris;
+
+    std::vector<int> offsets(scene.mesh_bvhs.size());
+    for (int i = 0, offset = 0, n = offsets.size(); i < n; i++) {
+        offsets[i] = offset;
+        offset += scene.mesh_bvhs[i]->prim_slot_count();
+    }
+    return offsets;
+}
+
+/// Copies the shading data of the triangles referenced by a BVH in the order of its leaves, starting at the given record.
+static void pack_shading_data(Scene& scene, const Bvh& bvh, int first_tri, int first_record) {
+    #pragma omp parallel for
+    for (int i = 0; i < bvh.prim_slot_count(); i++) {
+        const int tri = bvh.prim_id(i);
+        // Padding slots are never reported by the traversal
+        if (tri < 0) continue;
+
+        const int* idx = &scene.indices[(first_tri + tri) * 4];
+        const float3& v0 = scene.vertices[idx[0]];
+        const float3& v1 = scene.vertices[idx[1]];
+        const float3& v2 = scene.vertices[idx[2]];
+        if (scene.compact_attributes) {
+            PackedShadingTri& rec = scene.packed_shading_tris[first_record + i];
+            for (int j = 0; j < 3; j++) {
+                rec.normals[j]   = scene.packed_normals[idx[j]];
+                rec.texcoords[j] = scene.packed_texcoords[idx[j]];
+            }
+            rec.face_normal = scene.packed_face_normals[first_tri + tri];
+            rec.material    = idx[3];
+            rec.uv_scale    = uv_scale(v0, v1, v2,
+                                       unpack_texcoords(rec.texcoords[0]),
+                                       unpack_texcoords(rec.texcoords[1]),
+                                       unpack_texcoords(rec.texcoords[2]));
+        } else {
+            ShadingTri& rec = scene.shading_tris[first_record + i];
+            for (int j = 0; j < 3; j++) {
+                rec.normals[j]   = scene.normals[idx[j]];
+                rec.texcoords[j] = scene.texcoords[idx[j]];
+            }
+            rec.face_normal = scene.face_normals[first_tri + tri];
+            rec.material    = idx[3];
+            rec.uv_scale    = uv_scale(v0, v1, v2, rec.texcoords[0], rec.texcoords[1], rec.texcoords[2]);
+        }
+    }
+}
+
+/// Stores the shading data of the whole scene in the order of the BVH leaves. Triangles that are referenced several
+/// times (with spatial splits) are duplicated.
+static void pack_shading_data(Scene& scene) {
+    auto resize = [&] (size_t n) {
+        if (scene.compact_attributes) scene.packed_shading_tris.resize(n);
+        else                          scene.shading_tris.resize(n);
+    };
+
+    if (scene.bvh.instance_count() == 0) {
+        resize(scene.bvh.prim_slot_count());
+        pack_shading_data(scene, scene.bvh, 0, 0);
+        return;
+    }
+
+    auto offsets = mesh_bvh_offsets(scene);
+    resize(offsets.back() + scene.mesh_bvhs.back()->prim_slot_count());
+    for (int i = 0, n = scene.mesh_bvhs.size(); i < n; i++)
+        pack_shading_data(scene, *scene.mesh_bvhs[i], scene.mesh_bvh_tris[i], offsets[i]);
+}
+
+/// Returns the memory used by the normals, face normals, texture coordinates and shading records, in bytes.
+static size_t shading_memory(const Scene& scene) {
+    return scene.normals.size() * sizeof(float3) +
+           scene.face_normals.size() * sizeof(float3) +
+           scene.texcoords.size() * sizeof(float2) +
+           scene.shading_tris.size() * sizeof(ShadingTri) +
+           (scene.packed_normals.size() + scene.packed_face_normals.size() + scene.packed_texcoords.size()) * sizeof(uint32_t) +
+           scene.packed_shading_tris.size() * sizeof(PackedShadingTri);
+}
+
+/// Replaces the normals, face normals and texture coordinates of the scene by their compressed versions.
+static void compress_attributes(Scene& scene) {
+    scene.packed_normals.resize(scene.normals.size());
+    scene.packed_face_normals.resize(scene.face_normals.size());
+    scene.packed_texcoords.resize(scene.texcoords.size());
+
+    #pragma omp parallel for
+    for (int i = 0; i < (int)scene.normals.size(); i++)
+        scene.packed_normals[i] = pack_normal(scene.normals[i]);
+
+    #pragma omp parallel for
+    for (int i = 0; i < (int)scene.face_normals.size(); i++)
+        scene.packed_face_normals[i] = pack_normal(scene.face_normals[i]);
+
+    #pragma omp parallel for
+    for (int i = 0; i < (int)scene.texcoords.size(); i++)
+        scene.packed_texcoords[i] = pack_texcoords(scene.texcoords[i]);
+
+    // Release the memory of the uncompressed data
+    std::vector<float3>().swap(scene.normals);
+    std::vector<float3>().swap(scene.face_normals);
+    std::vector<float2>().swap(scene.texcoords);
+}
+
+/// Identifies scene cache files.
+static constexpr uint64_t scene_cache_magic = 0x454843414353594Eull;
+/// Version of the scene cache format, to be increased whenever the format or the contents of the cache change.
+static constexpr uint32_t scene_cache_version = 2;
+
+/// Hashes a block of memory using the 64-bit version of FNV-1a.
+static uint64_t hash_bytes(uint64_t h, const void* data, size_t size) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ bytes[i]) * 0x100000001B3ull;
+    return h;
+}
+
+template <typename T>
+static uint64_t hash_value(uint64_t h, const T& t) {
+    return hash_bytes(h, &t, sizeof(T));
+}
+
+/// Computes the key of a scene in the cache, from the contents of the scene file and the settings that change the BVH.
+/// The files referenced by the scene are checked separately, when the cache is loaded.
+static uint64_t scene_cache_key(const std::string& config, const BvhSettings& settings) {
+    std::ifstream file(config, std::ifstream::binary);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    const std::string text = contents.str();
+
+    uint64_t h = 0xCBF29CE484222325ull;
+    h = hash_value(h, scene_cache_version);
+    h = hash_bytes(h, config.data(), config.size());
+    h = hash_bytes(h, text.data(), text.size());
+    h = hash_value(h, int(settings.builder));
+    h = hash_value(h, settings.num_bins);
+    h = hash_value(h, settings.spatial_budget);
+    h = hash_value(h, settings.morton_bits);
+    h = hash_value(h, settings.sah_levels);
+    h = hash_value(h, settings.optimize_passes);
+    h = hash_value(h, settings.align_nodes);
+    h = hash_value(h, settings.compress_nodes);
+    h = hash_value(h, settings.tri_block);
+    h = hash_value(h, settings.width);
+    h = hash_value(h, settings.shadow_order);
+    h = hash_value(h, settings.leaf_order);
+    return h;
+}
+
+static std::string scene_cache_path(const Scene& scene, uint64_t key) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.cache", (unsigned long long)key);
+    return scene.cache_dir + "/" + name;
+}
+
+/// Gets the size and modification time of a file. The time has a sub-second resolution (nanoseconds, or units of
+/// 100 nanoseconds on Windows), so that modifications made within the same second are detected.
+/// Returns false if the file does not exist.
+static bool file_stamp(const std::string& path, uint64_t& size, int64_t& mtime) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attr)) return false;
+    size  = (uint64_t(attr.nFileSizeHigh) << 32) | attr.nFileSizeLow;
+    mtime = int64_t((uint64_t(attr.ftLastWriteTime.dwHighDateTime) << 32) | attr.ftLastWriteTime.dwLowDateTime);
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    size  = st.st_size;
+#ifdef __APPLE__
+    mtime = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+}
+
+/// Returns the files that a cached scene depends on: the OBJ and MTL files of its meshes.
+static std::vector<std::string> scene_cache_dependencies(const SceneCache& cache) {
+    std::vector<std::string> files;
+    for (auto& mesh : cache.meshes) {
+        files.push_back(mesh.file);
+        for (auto& lib : mesh.mtl_libs)
+            files.push_back(FilePath(mesh.file).base_name() + "/" + lib);
+    }
+    return files;
+}
+
+static void write_strings(BinaryWriter& out, const std::vector<std::string>& strings) {
+    out.write(uint64_t(strings.size()));
+    for (auto& s : strings) out.write_string(s);
+}
+
+static void read_strings(BinaryReader& in, std::vector<std::string>& strings) {
+    strings.clear();
+    for (uint64_t i = 0, n = in.read<uint64_t>(); i < n && in.ok(); i++)
+        strings.push_back(in.read_string());
+}
+
+/// Writes the mesh data and the BVHs of a scene to the cache. The file is written under a temporary name and then
+/// renamed, so that other processes never see an incomplete file.
+static void save_scene_cache(const std::string& path, const Scene& scene, const SceneCache& cache) {
+    const std::string tmp_path = path + "." + std::to_string(std::random_device()()) + ".tmp";
+    bool ok = true;
+    {
+        std::ofstream file(tmp_path, std::ofstream::binary);
+        BinaryWriter out(file);
+        out.write(scene_cache_magic);
+        out.write(scene_cache_version);
+        out.write(cache.key);
+
+        auto deps = scene_cache_dependencies(cache);
+        out.write(uint64_t(deps.size()));
+        for (auto& dep : deps) {
+            uint64_t size;
+            int64_t mtime;
+            ok &= file_stamp(dep, size, mtime);
+            out.write_string(dep);
+            out.write(size);
+            out.write(mtime);
+        }
+
+        out.write(uint64_t(cache.meshes.size()));
+        for (auto& mesh : cache.meshes) {
+            out.write_string(mesh.file);
+            out.write(mesh.first_tri);
+            out.write(mesh.num_tris);
+            write_strings(out, mesh.materials);
+            write_strings(out, mesh.mtl_libs);
+            out.write_vector(mesh.light_tris);
+        }
+        out.write(cache.num_static_tris);
+
+        out.write_vector(scene.vertices);
+        out.write_vector(scene.texcoords);
+        out.write_vector(scene.normals);
+        out.write_vector(scene.indices);
+        out.write_vector(scene.face_normals);
+
+        // Two-level BVHs are saved as their bottom-level BVHs, the top-level BVH is rebuilt when loading
+        out.write(int(scene.mesh_bvhs.size()));
+        if (scene.mesh_bvhs.empty()) {
+            scene.bvh.save(out);
+        } else {
+            for (auto& mesh_bvh : scene.mesh_bvhs) mesh_bvh->save(out);
+            out.write_vector(scene.mesh_bvh_tris);
+        }
+        ok &= out.ok();
+    }
+
+    if (ok && std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        // Renaming fails on some systems when the destination exists
+        std::remove(path.c_str());
+        ok = std::rename(tmp_path.c_str(), path.c_str()) == 0;
+    }
+
+    if (ok) {
+        info("Scene saved to the cache '", path, "'.");
+    } else {
+        std::remove(tmp_path.c_str());
+        warn("Cannot write the scene cache '", path, "'.");
+    }
+}
+
+/// Loads the mesh data and the BVHs of a scene from the cache. The BVHs use the memory-mapped file in place.
+/// Returns false if the scene is not in the cache, or if the files it depends on have changed.
+static bool load_scene_cache(const std::string& path, Scene& scene, SceneCache& cache) {
+    std::unique_ptr<MappedFile> file(new MappedFile(path, true));
+    if (!file->is_open()) return false;
+
+    BinaryReader in(file->data(), file->size());
+    if (in.read<uint64_t>() != scene_cache_magic ||
+        in.read<uint32_t>() != scene_cache_version ||
+        in.read<uint64_t>() != cache.key) {
+        warn("Ignoring invalid scene cache '", path, "'.");
+        return false;
+    }
+
+    for (uint64_t i = 0, n = in.read<uint64_t>(); i < n && in.ok(); i++) {
+        auto dep = in.read_string();
+        auto size = in.read<uint64_t>();
+        auto mtime = in.read<int64_t>();
+        uint64_t cur_size;
+        int64_t cur_mtime;
+        if (in.ok() && (!file_stamp(dep, cur_size, cur_mtime) || cur_size != size || cur_mtime != mtime)) {
+            info("The scene cache is outdated ('", dep, "' has changed).");
+            return false;
+        }
+    }
+
+    std::vector<MeshInfo> meshes;
+    for (uint64_t i = 0, n = in.read<uint64_t>(); i < n && in.ok(); i++) {
+        MeshInfo mesh;
+        mesh.file      = in.read_string();
+        mesh.first_tri = in.read<int>();
+        mesh.num_tris  = in.read<int>();
+        read_strings(in, mesh.materials);
+        read_strings(in, mesh.mtl_libs);
+        in.read_vector(mesh.light_tris);
+        meshes.push_back(std::move(mesh));
+    }
+    const int num_static_tris = in.read<int>();
+
+    std::vector<float3> vertices, normals, face_normals;
+    std::vector<float2> texcoords;
+    std::vector<int> indices;
+    in.read_vector(vertices);
+    in.read_vector(texcoords);
+    in.read_vector(normals);
+    in.read_vector(indices);
+    in.read_vector(face_normals);
+
+    Bvh bvh;
+    Scene::unique_vector<Bvh> mesh_bvhs;
+    std::vector<int> mesh_bvh_tris;
+    const int num_mesh_bvhs = in.read<int>();
+    if (num_mesh_bvhs == 0) {
+        if (!bvh.map(in)) in.fail();
+    } else {
+        for (int i = 0; i < num_mesh_bvhs && in.ok(); i++) {
+            mesh_bvhs.emplace_back(new Bvh());
+            if (!mesh_bvhs.back()->map(in)) in.fail();
+        }
+        in.read_vector(mesh_bvh_tris);
+    }
+
+    if (!in.ok() || !in.at_end()) {
+        warn("Ignoring invalid scene cache '", path, "'.");
+        return false;
+    }
+
+    cache.meshes = std::move(meshes);
+    cache.num_static_tris = num_static_tris;
+    scene.vertices      = std::move(vertices);
+    scene.texcoords     = std::move(texcoords);
+    scene.normals       = std::move(normals);
+    scene.indices       = std::move(indices);
+    scene.face_normals  = std::move(face_normals);
+    scene.bvh           = std::move(bvh);
+    scene.mesh_bvhs     = std::move(mesh_bvhs);
+    scene.mesh_bvh_tris = std::move(mesh_bvh_tris);
+    scene.cache_file    = std::move(file);
+    info("Scene loaded from the cache '", path, "'.");
+    return true;
+}
+
 static std::ostream& operator << (std::ostream& os, const YAML::Mark& mark) {
     if (mark.line < 0 && mark.column < 0) return os;
     assert(mark.line >= 0);
@@ -372,13 +1082,42 @@ bool load_scene(const std::string& config, Scene& scene) {
         return false;
     }
 
+    // The static geometry comes first, followed by the instanced meshes
+    int num_static_tris = 0;
+    std::vector<InstancedMesh> meshes;
+    std::vector<MeshInstance> instances;
+
     auto start_load = high_resolution_clock::now();
+
+    // When the scene is in the cache, the meshes and BVHs are loaded from there, but the materials and lights are still created
+    SceneCache cache;
+    std::string cache_path;
+    if (!scene.cache_dir.empty()) {
+        cache.key = scene_cache_key(config, scene.bvh_settings);
+        cache_path = scene_cache_path(scene, cache.key);
+        cache.hit = load_scene_cache(cache_path, scene, cache);
+    }
+
     try {
         auto node = YAML::LoadFile(config);
         TextureMap tex_map;
+        MeshMap mesh_map;
         FilePath config_path(config);
-        for (const auto& mesh : node["meshes"]) load_mesh(config_path.base_name() + "/" + mesh.as<std::string>(), tex_map, scene);
-        for (const auto& light : node["lights"]) setup_light(scene, light);
+
+        // The meshes and textures are loaded concurrently, and then added to the scene in the order of the scene file
+        std::vector<std::string> mesh_files;
+        for (const auto& mesh : node["meshes"]) mesh_files.push_back(config_path.base_name() + "/" + mesh.as<std::string>());
+        const size_t num_meshes = mesh_files.size();
+        for (const auto& inst : node["instances"]) mesh_files.push_back(config_path.base_name() + "/" + inst["mesh"].as<std::string>());
+        SceneAssets assets;
+        load_assets(mesh_files, cache, assets);
+
+        for (size_t i = 0; i < num_meshes; i++) load_mesh(mesh_files[i], tex_map, assets, scene, cache);
+        for (const auto& light : node["lights"]) setup_light(scene, light, !cache.hit);
+        pad_vertex_attributes(scene);
+        if (!cache.hit) cache.num_static_tris = scene.indices.size() / 4;
+        num_static_tris = cache.num_static_tris;
+        for (const auto& inst : node["instances"]) setup_instance(scene, inst, config_path, tex_map, assets, cache, mesh_map, meshes, instances);
         setup_camera(scene, node["camera"]);
     } catch (YAML::Exception& e) {
         error("Configuration error: ", e.msg, " ", e.mark);
@@ -395,10 +1134,734 @@ bool load_scene(const std::string& config, Scene& scene) {
 
     // Build BVH
     auto start_bvh = high_resolution_clock::now();
-    scene.bvh.build(scene.vertices.data(), scene.indices.data(), num_tris);
+    if (instances.empty()) {
+        if (!cache.hit) scene.bvh.build(scene.vertices.data(), scene.indices.data(), num_tris, scene.bvh_settings);
+    } else {
+        // Two-level BVH: one BVH per mesh, and a top-level BVH over the instances. The static geometry is an instance with no transformation.
+        auto build_mesh_bvh = [&] (int first_tri, int num_tris) {
+            scene.mesh_bvhs.emplace_back(new Bvh());
+            scene.mesh_bvhs.back()->build(scene.vertices.data(), scene.indices.data() + first_tri * 4, num_tris, scene.bvh_settings);
+            scene.mesh_bvh_tris.push_back(first_tri);
+        };
+
+        const int first_mesh_bvh = num_static_tris > 0 ? 1 : 0;
+        if (!cache.hit) {
+            if (num_static_tris > 0) build_mesh_bvh(0, num_static_tris);
+            for (auto& mesh : meshes)
+                build_mesh_bvh(mesh.first_tri, mesh.num_tris);
+        }
+
+        auto offsets = mesh_bvh_offsets(scene);
+        std::vector<BvhInstance> bvh_instances;
+        if (num_static_tris > 0)
+            bvh_instances.push_back(BvhInstance{Transform::identity(), Transform::identity(), scene.mesh_bvhs[0].get(), offsets[0]});
+        for (auto& inst : instances) {
+            const int mesh_bvh = first_mesh_bvh + inst.mesh;
+            bvh_instances.push_back(BvhInstance{
+                inst.to_world,
+                inverse(inst.to_world),
+                scene.mesh_bvhs[mesh_bvh].get(),
+                offsets[mesh_bvh]});
+        }
+
+        scene.bvh.build(bvh_instances.data(), bvh_instances.size(), scene.bvh_settings);
+    }
+    if (!cache_path.empty() && !cache.hit && cache.complete) save_scene_cache(cache_path, scene, cache);
+    const size_t uncompressed_memory = shading_memory(scene);
+    if (scene.compact_attributes) compress_attributes(scene);
+    if (scene.bvh_settings.leaf_order) pack_shading_data(scene);
     auto end_bvh = high_resolution_clock::now();
     info("BVH constructed in ", duration_cast<milliseconds>(end_bvh - start_bvh).count(), " ms (",
-         scene.bvh.node_count(), " nodes).");
+         scene.bvh.node_count(), " nodes, ", scene.bvh.ref_count(), " references, width ", scene.bvh.width(), ", SAH cost ", scene.bvh.sah_cost(), ").");
+    if (!instances.empty()) {
+        size_t mesh_node_memory = 0, mesh_tri_memory = 0;
+        for (auto& mesh_bvh : scene.mesh_bvhs) {
+            mesh_node_memory += mesh_bvh->node_memory();
+            mesh_tri_memory  += mesh_bvh->tri_memory();
+        }
+        info("Two-level BVH with ", instances.size(), " instances of ", meshes.size(), " meshes, ",
+             scene.mesh_bvhs.size(), " bottom-level BVHs (", mesh_node_memory / 1024, " KB for the nodes, ", mesh_tri_memory / 1024, " KB for the triangles).");
+    }
+    info("BVH memory usage: ", scene.bvh.node_memory() / 1024, " KB for the nodes, ", scene.bvh.tri_memory() / 1024, " KB for the triangles.");
+    const char* order = scene.bvh_settings.leaf_order ? " in BVH leaf order" : "";
+    if (scene.compact_attributes) {
+        const size_t records = scene.packed_shading_tris.size() * sizeof(ShadingTri);
+        info("Shading data memory usage: ", shading_memory(scene) / 1024, " KB", order, " (",
+             (uncompressed_memory + records) / 1024, " KB uncompressed).");
+    } else {
+        info("Shading data memory usage: ", shading_memory(scene) / 1024, " KB", order, ".");
+    }
+
+    return true;
+}
+
+/// Mesh loaded in the background by a scene stream, with the BVH of its triangles.
+struct StreamedMesh {
+    std::string file;
+    bool instanced;                 ///< Set if the mesh is loaded for the instances of the scene
+    SceneAssets assets;
+    std::unique_ptr<Bvh> bvh;       ///< BVH over the triangles of the mesh, or nullptr if it has none
+};
+
+/// Instance of a streamed mesh.
+struct StreamedInstance {
+    std::string file;
+    Transform to_world;
+    int mesh_bvh;                   ///< Bottom-level BVH of the mesh, or -1 if it has not been loaded yet
+};
+
+struct SceneStreamState {
+    BvhSettings settings;
+    std::vector<std::string> files;             ///< Meshes to load: the static meshes, followed by the instanced meshes
+    size_t num_static;                          ///< Number of static meshes
+    std::vector<StreamedInstance> instances;
+    std::vector<int> static_bvhs;               ///< Bottom-level BVHs of the static geometry, which have no transformation
+    TextureMap tex_map;
+    SceneCache cache;                           ///< Information about the meshes that are in the scene (never saved)
+    std::chrono::high_resolution_clock::time_point start;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<StreamedMesh>> ready;  ///< Meshes that are loaded but not added to the scene yet (protected by the mutex)
+    bool finished;                                      ///< Set when all the meshes are loaded (protected by the mutex)
+    std::atomic<bool> cancel;                           ///< Stops the loading thread
+
+    SceneStreamState() : num_static(0), finished(false), cancel(false) {}
+};
+
+/// Loads the meshes of a scene stream one after the other (each one is loaded in parallel), and builds their BVHs.
+static void stream_meshes(SceneStreamState& state) {
+    const SceneCache no_cache;
+    for (size_t i = 0; i < state.files.size() && !state.cancel; i++) {
+        std::unique_ptr<StreamedMesh> mesh(new StreamedMesh());
+        mesh->file = state.files[i];
+        mesh->instanced = i >= state.num_static;
+        load_assets(std::vector<std::string>(1, mesh->file), no_cache, mesh->assets);
+
+        // The BVH only depends on the vertex positions, which are the same once the mesh is in the scene
+        const MeshData& data = mesh->assets.meshes[mesh->file];
+        if (!data.indices.empty()) {
+            mesh->bvh.reset(new Bvh());
+            mesh->bvh->build(data.vertices.data(), data.indices.data(), data.indices.size() / 4, state.settings);
+        }
+
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.ready.push_back(std::move(mesh));
+        state.finished = i + 1 == state.files.size();
+    }
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.finished = true;
+}
+
+/// Builds the top-level BVH of a scene made of bottom-level BVHs. The static geometry has no transformation, and the
+/// instances refer to the bottom-level BVHs by index.
+static void build_top_level_bvh(Scene& scene, const std::vector<int>& static_bvhs, const std::vector<MeshInstance>& instances) {
+    auto offsets = mesh_bvh_offsets(scene);
+    std::vector<BvhInstance> bvh_instances;
+    for (auto mesh_bvh : static_bvhs)
+        bvh_instances.push_back(BvhInstance{Transform::identity(), Transform::identity(), scene.mesh_bvhs[mesh_bvh].get(), offsets[mesh_bvh]});
+    for (auto& inst : instances) {
+        bvh_instances.push_back(BvhInstance{
+            inst.to_world,
+            inverse(inst.to_world),
+            scene.mesh_bvhs[inst.mesh].get(),
+            offsets[inst.mesh]});
+    }
+
+    if (!bvh_instances.empty())
+        scene.bvh.build(bvh_instances.data(), bvh_instances.size(), scene.bvh_settings);
+}
+
+/// Rebuilds the top-level BVH of a streamed scene over the bottom-level BVHs that have been loaded so far.
+static void build_streamed_bvh(Scene& scene, const SceneStreamState& state) {
+    std::vector<MeshInstance> instances;
+    for (auto& inst : state.instances) {
+        if (inst.mesh_bvh >= 0) instances.push_back(MeshInstance{inst.mesh_bvh, inst.to_world});
+    }
+    build_top_level_bvh(scene, state.static_bvhs, instances);
+    if (scene.bvh_settings.leaf_order) pack_shading_data(scene);
+}
+
+SceneStream::SceneStream() : state_(new SceneStreamState()) {}
+
+SceneStream::~SceneStream() {
+    state_->cancel = true;
+    if (state_->thread.joinable()) state_->thread.join();
+}
+
+bool SceneStream::start(const std::string& config, Scene& scene) {
+    auto& state = *state_;
+    if (!std::ifstream(config)) {
+        error("The scene file '", config, "' cannot be opened.");
+        return false;
+    }
 
+    state.settings = scene.bvh_settings;
+    state.start = std::chrono::high_resolution_clock::now();
+
+    try {
+        auto node = YAML::LoadFile(config);
+        FilePath config_path(config);
+        for (const auto& mesh : node["meshes"]) state.files.push_back(config_path.base_name() + "/" + mesh.as<std::string>());
+        state.num_static = state.files.size();
+        for (const auto& inst : node["instances"]) {
+            auto file = config_path.base_name() + "/" + inst["mesh"].as<std::string>();
+            state.instances.push_back(StreamedInstance{file, parse_instance_transform(inst), -1});
+            // Every instanced mesh is only loaded once
+            if (std::find(state.files.begin() + state.num_static, state.files.end(), file) == state.files.end())
+                state.files.push_back(file);
+        }
+        for (const auto& light : node["lights"]) setup_light(scene, light, true);
+        pad_vertex_attributes(scene);
+        setup_camera(scene, node["camera"]);
+    } catch (YAML::Exception& e) {
+        error("Configuration error: ", e.msg, " ", e.mark);
+        return false;
+    }
+
+    // The triangle lights are available immediately
+    if (!scene.indices.empty()) {
+        scene.mesh_bvhs.emplace_back(new Bvh());
+        scene.mesh_bvhs.back()->build(scene.vertices.data(), scene.indices.data(), scene.indices.size() / 4, scene.bvh_settings);
+        scene.mesh_bvh_tris.push_back(0);
+        state.static_bvhs.push_back(0);
+        build_streamed_bvh(scene, state);
+    }
+
+    info("Streaming ", state.files.size(), " meshes.");
+    state.thread = std::thread(stream_meshes, std::ref(state));
+    return true;
+}
+
+bool SceneStream::update(Scene& scene) {
+    using namespace std::chrono;
+    auto& state = *state_;
+
+    std::vector<std::unique_ptr<StreamedMesh>> meshes;
+    bool finished;
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        meshes.swap(state.ready);
+        finished = state.finished;
+    }
+    if (meshes.empty()) return false;
+
+    for (auto& mesh : meshes) {
+        auto info = load_mesh(mesh->file, state.tex_map, mesh->assets, scene, state.cache, !mesh->instanced);
+        if (!info) continue;
+        if (info->num_tris == 0) {
+            if (mesh->instanced) warn("The instanced mesh '", mesh->file, "' has no triangles.");
+            continue;
+        }
+
+        const int mesh_bvh = scene.mesh_bvhs.size();
+        scene.mesh_bvhs.emplace_back(std::move(mesh->bvh));
+        scene.mesh_bvh_tris.push_back(info->first_tri);
+        if (!mesh->instanced) {
+            state.static_bvhs.push_back(mesh_bvh);
+        } else {
+            for (auto& inst : state.instances) {
+                if (inst.file == mesh->file) inst.mesh_bvh = mesh_bvh;
+            }
+        }
+    }
+    build_streamed_bvh(scene, state);
+
+    auto elapsed = duration_cast<milliseconds>(high_resolution_clock::now() - state.start).count();
+    info(finished ? "Scene streamed in " : "Scene partially streamed in ", elapsed, " ms (",
+         scene.vertices.size(), " vertices, ", scene.indices.size() / 4, " triangles).");
     return true;
 }
+
+bool SceneStream::done() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->finished && state_->ready.empty();
+}
+
+typedef std::pair<uint64_t, int64_t> FileStamp;
+
+/// Returns the size and modification time of a file (the size is set to the maximum value if the file does not exist).
+static FileStamp current_stamp(const std::string& file) {
+    FileStamp stamp(~uint64_t(0), 0);
+    file_stamp(file, stamp.first, stamp.second);
+    return stamp;
+}
+
+/// Returns a YAML node as text, or an empty string if the node is not defined.
+static std::string node_text(const YAML::Node& node) {
+    return node.IsDefined() ? YAML::Dump(node) : std::string();
+}
+
+/// Returns the files of the static meshes of a scene description, and the distinct files of its instanced meshes.
+static void scene_mesh_files(const YAML::Node& node, const FilePath& config_path,
+                             std::vector<std::string>& static_files,
+                             std::vector<std::string>& instanced_files) {
+    for (const auto& mesh : node["meshes"]) static_files.push_back(config_path.base_name() + "/" + mesh.as<std::string>());
+    for (const auto& inst : node["instances"]) {
+        auto file = config_path.base_name() + "/" + inst["mesh"].as<std::string>();
+        if (std::find(instanced_files.begin(), instanced_files.end(), file) == instanced_files.end())
+            instanced_files.push_back(file);
+    }
+}
+
+/// Checks a scene description by setting up its camera, lights and instances in a temporary scene.
+/// Throws a YAML::Exception if the description is invalid.
+static void check_scene_description(const YAML::Node& node, const FilePath& config_path, const Scene& scene) {
+    Scene tmp;
+    tmp.width  = scene.width;
+    tmp.height = scene.height;
+    std::vector<std::string> static_files, instanced_files;
+    scene_mesh_files(node, config_path, static_files, instanced_files);
+    for (const auto& light : node["lights"]) setup_light(tmp, light, true);
+    for (const auto& inst : node["instances"]) parse_instance_transform(inst);
+    setup_camera(tmp, node["camera"]);
+}
+
+/// Returns the emissive triangles of a mesh, in the format of MeshInfo::light_tris.
+static std::vector<int> emissive_tris(const MeshData& data, int first_tri) {
+    std::vector<bool> emissive(data.materials.size(), false);
+    for (int i = 1, n = data.materials.size(); i < n; i++) {
+        auto it = data.mat_lib.find(data.materials[i]);
+        emissive[i] = it != data.mat_lib.end() && lensqr(it->second.ke) > 0.0f;
+    }
+
+    std::vector<int> light_tris;
+    for (int i = 0, n = data.indices.size() / 4; i < n; i++) {
+        if (!emissive[data.indices[i * 4 + 3]]) continue;
+        light_tris.push_back(first_tri + i);
+        light_tris.push_back(data.indices[i * 4 + 3]);
+    }
+    return light_tris;
+}
+
+struct SceneReloadState {
+    std::string config;
+    YAML::Node node;                                                ///< Current scene description
+    SceneAssets assets;                                             ///< Meshes and images of the scene, kept to rebuild it
+    std::unordered_map<std::string, std::unique_ptr<Bvh>> bvhs;     ///< BVHs of the meshes that are not used by the scene
+    std::vector<std::string> bvh_files;                             ///< Mesh of every bottom-level BVH of the scene (empty for the triangle lights)
+    SceneCache cache;                                               ///< Meshes added to the scene, in order
+    size_t num_static_meshes;                                       ///< Number of static meshes in the cache, which come first
+    size_t first_config_light;                                      ///< Index of the first light of the scene file in Scene::lights
+    std::unordered_map<std::string, FileStamp> stamps;              ///< Size and modification time of every file of the scene
+    std::chrono::steady_clock::time_point last_check;
+
+    SceneReloadState() : num_static_meshes(0), first_config_light(0) {}
+};
+
+static void record_stamps(SceneReloadState& state) {
+    state.stamps.clear();
+    state.stamps[state.config] = current_stamp(state.config);
+    for (auto& mesh : state.assets.meshes) {
+        state.stamps[mesh.first] = current_stamp(mesh.first);
+        for (auto& lib : mesh.second.mtl_libs) {
+            auto lib_file = FilePath(mesh.first).base_name() + "/" + lib;
+            state.stamps[lib_file] = current_stamp(lib_file);
+        }
+    }
+    for (auto& image : state.assets.images)
+        state.stamps[image.first] = current_stamp(image.first);
+}
+
+/// Moves the bottom-level BVHs of the scene back to the reload state, so that they can be used again.
+static void take_back_bvhs(Scene& scene, SceneReloadState& state) {
+    for (size_t i = 0; i < state.bvh_files.size(); i++) {
+        if (!state.bvh_files[i].empty())
+            state.bvhs.emplace(state.bvh_files[i], std::move(scene.mesh_bvhs[i]));
+    }
+    scene.mesh_bvhs.clear();
+    scene.mesh_bvh_tris.clear();
+    state.bvh_files.clear();
+}
+
+/// Returns the BVH of a mesh, which is only built if the mesh is new or has changed.
+static std::unique_ptr<Bvh> reuse_bvh(SceneReloadState& state, const std::string& file, const BvhSettings& settings) {
+    auto it = state.bvhs.find(file);
+    if (it != state.bvhs.end()) {
+        auto bvh = std::move(it->second);
+        state.bvhs.erase(it);
+        return bvh;
+    }
+
+    const MeshData& data = state.assets.meshes[file];
+    std::unique_ptr<Bvh> bvh(new Bvh());
+    bvh->build(data.vertices.data(), data.indices.data(), data.indices.size() / 4, settings);
+    return bvh;
+}
+
+/// Rebuilds the whole scene from the meshes of the reload state, reusing the BVHs of the meshes that have not changed.
+static void assemble_scene(Scene& scene, SceneReloadState& state) {
+    take_back_bvhs(scene, state);
+    scene.bsdfs.clear();
+    scene.lights.clear();
+    scene.textures.clear();
+    scene.materials.clear();
+    scene.vertices.clear();
+    scene.texcoords.clear();
+    scene.normals.clear();
+    scene.indices.clear();
+    scene.face_normals.clear();
+    scene.shading_tris.clear();
+    scene.packed_normals.clear();
+    scene.packed_face_normals.clear();
+    scene.packed_texcoords.clear();
+    scene.packed_shading_tris.clear();
+    scene.bvh = Bvh();
+
+    FilePath config_path(state.config);
+    std::vector<std::string> static_files, instanced_files;
+    scene_mesh_files(state.node, config_path, static_files, instanced_files);
+
+    TextureMap tex_map;
+    state.cache = SceneCache();
+    auto add_mesh_bvh = [&] (const std::string& file, std::unique_ptr<Bvh> bvh, int first_tri) {
+        scene.mesh_bvhs.emplace_back(std::move(bvh));
+        scene.mesh_bvh_tris.push_back(first_tri);
+        state.bvh_files.push_back(file);
+        return int(scene.mesh_bvhs.size()) - 1;
+    };
+
+    std::vector<int> static_bvhs;
+    for (auto& file : static_files) {
+        auto info = load_mesh(file, tex_map, state.assets, scene, state.cache);
+        if (info && info->num_tris > 0)
+            static_bvhs.push_back(add_mesh_bvh(file, reuse_bvh(state, file, scene.bvh_settings), info->first_tri));
+    }
+    state.num_static_meshes = state.cache.meshes.size();
+
+    state.first_config_light = scene.lights.size();
+    const int first_light_tri = scene.indices.size() / 4;
+    for (const auto& light : state.node["lights"]) setup_light(scene, light, true);
+    const int num_light_tris = scene.indices.size() / 4 - first_light_tri;
+    if (num_light_tris > 0) {
+        std::unique_ptr<Bvh> bvh(new Bvh());
+        bvh->build(scene.vertices.data(), scene.indices.data() + first_light_tri * 4, num_light_tris, scene.bvh_settings);
+        static_bvhs.push_back(add_mesh_bvh(std::string(), std::move(bvh), first_light_tri));
+    }
+    pad_vertex_attributes(scene);
+
+    MeshMap instanced_bvhs;
+    for (auto& file : instanced_files) {
+        auto info = load_mesh(file, tex_map, state.assets, scene, state.cache, false);
+        if (!info) continue;
+        if (info->num_tris == 0) {
+            warn("The instanced mesh '", file, "' has no triangles.");
+            continue;
+        }
+        instanced_bvhs[file] = add_mesh_bvh(file, reuse_bvh(state, file, scene.bvh_settings), info->first_tri);
+    }
+
+    std::vector<MeshInstance> instances;
+    for (const auto& inst : state.node["instances"]) {
+        auto it = instanced_bvhs.find(config_path.base_name() + "/" + inst["mesh"].as<std::string>());
+        if (it != instanced_bvhs.end()) instances.push_back(MeshInstance{it->second, parse_instance_transform(inst)});
+    }
+
+    build_top_level_bvh(scene, static_bvhs, instances);
+    if (scene.compact_attributes) compress_attributes(scene);
+    if (scene.bvh_settings.leaf_order) pack_shading_data(scene);
+}
+
+/// Recreates the materials, textures and lights of the scene, without changing its geometry. Returns false if this is
+/// not possible, because an MTL file cannot be loaded or because the set of emissive triangles has changed.
+static bool rebuild_materials(Scene& scene, SceneReloadState& state) {
+    auto& meshes = state.cache.meshes;
+    for (size_t i = 0; i < meshes.size(); i++) {
+        const MeshData& data = state.assets.meshes[meshes[i].file];
+        if (!data.missing_mtl.empty()) return false;
+        if (i < state.num_static_meshes && emissive_tris(data, meshes[i].first_tri) != meshes[i].light_tris) return false;
+    }
+
+    scene.bsdfs.clear();
+    scene.lights.clear();
+    scene.textures.clear();
+    scene.materials.clear();
+
+    // The materials are created in the same order as before, so that the triangles keep their material indices
+    TextureMap tex_map;
+    SceneCache cache = state.cache;
+    cache.hit = true;
+    cache.next_mesh = 0;
+    auto add_meshes = [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            load_cached_mesh(meshes[i].file, tex_map, state.assets, scene, cache);
+    };
+
+    add_meshes(0, state.num_static_meshes);
+    state.first_config_light = scene.lights.size();
+    for (const auto& light : state.node["lights"]) setup_light(scene, light, false);
+    add_meshes(state.num_static_meshes, meshes.size());
+    return true;
+}
+
+/// Moves the vertices of the meshes that have been reloaded with the same triangles and materials (e.g. the frames of
+/// a deforming mesh), and refits the BVHs instead of rebuilding them (see Scene::update_geometry()). Returns false if
+/// this is not possible, because the triangles or the materials of a mesh have changed, or because a mesh has emissive
+/// triangles, whose lights would have to be moved as well.
+static bool move_vertices(Scene& scene, SceneReloadState& state, const std::unordered_map<std::string, MeshData>& old_meshes) {
+    for (auto& old : old_meshes) {
+        auto it = state.assets.meshes.find(old.first);
+        if (it == state.assets.meshes.end()) return false;
+        const MeshData& data = it->second;
+        if (!data.loaded || !data.missing_mtl.empty() ||
+            data.indices != old.second.indices ||
+            data.vertices.size() != old.second.vertices.size() ||
+            data.materials != old.second.materials ||
+            data.mtl_libs != old.second.mtl_libs)
+            return false;
+    }
+    for (auto& info : state.cache.meshes) {
+        if (old_meshes.count(info.file) && !info.light_tris.empty()) return false;
+    }
+
+    for (auto& info : state.cache.meshes) {
+        if (!old_meshes.count(info.file) || info.num_tris == 0) continue;
+        const MeshData& data = state.assets.meshes[info.file];
+        // The indices of the scene are those of the mesh, offset by the index of its first vertex
+        const int vtx_offset = scene.indices[info.first_tri * 4] - data.indices[0];
+        std::copy(data.vertices.begin(), data.vertices.end(), scene.vertices.begin() + vtx_offset);
+        if (scene.compact_attributes) {
+            #pragma omp parallel for
+            for (int i = 0; i < (int)data.vertices.size(); i++) {
+                scene.packed_normals[vtx_offset + i]   = pack_normal(data.normals[i]);
+                scene.packed_texcoords[vtx_offset + i] = pack_texcoords(data.texcoords[i]);
+            }
+        } else {
+            std::copy(data.normals.begin(), data.normals.end(), scene.normals.begin() + vtx_offset);
+            std::copy(data.texcoords.begin(), data.texcoords.end(), scene.texcoords.begin() + vtx_offset);
+        }
+    }
+
+    scene.update_geometry();
+    return true;
+}
+
+/// Returns true if the lights of two scene descriptions only differ by the parameters of some point lights.
+static bool only_point_lights_differ(const YAML::Node& lights, const YAML::Node& old_lights) {
+    if (lights.size() != old_lights.size()) return false;
+    for (size_t i = 0; i < lights.size(); i++) {
+        if (node_text(lights[i]) != node_text(old_lights[i]) &&
+            (lights[i].Tag() != "!point_light" || old_lights[i].Tag() != "!point_light"))
+            return false;
+    }
+    return true;
+}
+
+SceneReloader::SceneReloader() : state_(new SceneReloadState()) {}
+SceneReloader::~SceneReloader() {}
+
+bool SceneReloader::load(const std::string& config, Scene& scene) {
+    using namespace std::chrono;
+    auto& state = *state_;
+    if (!std::ifstream(config)) {
+        error("The scene file '", config, "' cannot be opened.");
+        return false;
+    }
+
+    auto start_load = high_resolution_clock::now();
+    state.config = config;
+    state.assets.keep_images = true;
+
+    FilePath config_path(config);
+    std::vector<std::string> files, instanced_files;
+    try {
+        state.node = YAML::LoadFile(config);
+        check_scene_description(state.node, config_path, scene);
+        scene_mesh_files(state.node, config_path, files, instanced_files);
+    } catch (YAML::Exception& e) {
+        error("Configuration error: ", e.msg, " ", e.mark);
+        return false;
+    }
+    files.insert(files.end(), instanced_files.begin(), instanced_files.end());
+
+    load_assets(files, SceneCache(), state.assets);
+    assemble_scene(scene, state);
+    setup_camera(scene, state.node["camera"]);
+    record_stamps(state);
+    state.last_check = steady_clock::now();
+
+    auto end_load = high_resolution_clock::now();
+    info("Scene loaded in ", duration_cast<milliseconds>(end_load - start_load).count(), " ms (",
+         scene.vertices.size(), " vertices, ", scene.indices.size() / 4, " triangles), watching ", state.stamps.size(), " files for changes.");
+    return validate_scene(scene);
+}
+
+bool SceneReloader::update(Scene& scene) {
+    using namespace std::chrono;
+    auto& state = *state_;
+
+    // The files are only checked a few times per second
+    auto now = steady_clock::now();
+    if (now - state.last_check < milliseconds(500)) return false;
+    state.last_check = now;
+
+    std::unordered_set<std::string> changed;
+    for (auto& stamp : state.stamps) {
+        if (current_stamp(stamp.first) != stamp.second) changed.insert(stamp.first);
+    }
+    if (changed.empty()) return false;
+
+    auto start_reload = high_resolution_clock::now();
+    FilePath config_path(state.config);
+    YAML::Node old_node = state.node;
+    if (changed.count(state.config)) {
+        // An invalid scene file is ignored until it is modified again
+        state.stamps[state.config] = current_stamp(state.config);
+        try {
+            auto node = YAML::LoadFile(state.config);
+            check_scene_description(node, config_path, scene);
+            // Nodes have reference semantics: the old description must not be overwritten
+            state.node.reset(node);
+        } catch (YAML::Exception& e) {
+            error("Configuration error: ", e.msg, " ", e.mark);
+            warn("The scene file '", state.config, "' is not reloaded.");
+            return false;
+        }
+    }
+
+    std::vector<std::string> files, instanced_files;
+    scene_mesh_files(state.node, config_path, files, instanced_files);
+    files.insert(files.end(), instanced_files.begin(), instanced_files.end());
+
+    auto triangle_lights = [] (const YAML::Node& node) {
+        std::vector<std::string> lights;
+        for (const auto& light : node["lights"]) {
+            if (light.Tag() == "!triangle_light") lights.push_back(node_text(light));
+        }
+        return lights;
+    };
+    const bool camera_changed = node_text(state.node["camera"]) != node_text(old_node["camera"]);
+    const bool lights_changed = node_text(state.node["lights"]) != node_text(old_node["lights"]);
+    const bool meshes_changed = node_text(state.node["meshes"]) != node_text(old_node["meshes"]) ||
+                                node_text(state.node["instances"]) != node_text(old_node["instances"]);
+
+    // Modified OBJ files are loaded again, and the meshes that are not used anymore are dropped. The previous contents
+    // of the modified files are kept, to find out if only their vertices have moved.
+    int reloaded_meshes = 0;
+    bool materials_changed = false;
+    std::unordered_map<std::string, MeshData> old_meshes;
+    for (auto it = state.assets.meshes.begin(); it != state.assets.meshes.end();) {
+        const bool used = std::find(files.begin(), files.end(), it->first) != files.end();
+        if (!used || changed.count(it->first)) {
+            reloaded_meshes += used;
+            if (used) {
+                for (auto& lib : it->second.mtl_libs)
+                    materials_changed |= changed.count(FilePath(it->first).base_name() + "/" + lib) > 0;
+                old_meshes.emplace(it->first, std::move(it->second));
+            }
+            state.bvhs.erase(it->first);
+            it = state.assets.meshes.erase(it);
+            continue;
+        }
+
+        // Modified MTL files are loaded again without reparsing the OBJ file
+        MeshData& data = it->second;
+        for (auto& lib : data.mtl_libs) {
+            if (!changed.count(FilePath(it->first).base_name() + "/" + lib)) continue;
+            data.mat_lib.clear();
+            data.missing_mtl.clear();
+            load_mtl_libs(FilePath(it->first), data);
+            materials_changed = true;
+            break;
+        }
+        ++it;
+    }
+
+    for (auto it = state.assets.images.begin(); it != state.assets.images.end();) {
+        if (changed.count(it->first)) {
+            it = state.assets.images.erase(it);
+            materials_changed = true;
+        } else ++it;
+    }
+
+    // Meshes whose vertices have only moved keep their BVHs, which are refitted
+    bool deformed = false;
+    if (reloaded_meshes > 0 && !meshes_changed && !lights_changed && !materials_changed) {
+        load_assets(files, SceneCache(), state.assets);
+        deformed = move_vertices(scene, state, old_meshes);
+    }
+
+    const char* reload_type = nullptr;
+    if (deformed) {
+        reload_type = "vertices";
+    } else if (meshes_changed || reloaded_meshes > 0 || triangle_lights(state.node) != triangle_lights(old_node)) {
+        // The BVHs of the meshes that have changed must not be reused
+        take_back_bvhs(scene, state);
+        for (auto it = state.bvhs.begin(); it != state.bvhs.end();) {
+            if (!state.assets.meshes.count(it->first) || changed.count(it->first)) it = state.bvhs.erase(it);
+            else ++it;
+        }
+        load_assets(files, SceneCache(), state.assets);
+        assemble_scene(scene, state);
+        reload_type = "geometry";
+    } else if (materials_changed || (lights_changed && !only_point_lights_differ(state.node["lights"], old_node["lights"]))) {
+        load_assets(files, SceneCache(), state.assets);
+        if (rebuild_materials(scene, state)) {
+            reload_type = "materials and lights";
+        } else {
+            assemble_scene(scene, state);
+            reload_type = "geometry";
+        }
+    } else if (lights_changed) {
+        auto lights = state.node["lights"], old_lights = old_node["lights"];
+        for (size_t i = 0; i < lights.size(); i++) {
+            if (node_text(lights[i]) == node_text(old_lights[i])) continue;
+            scene.lights[state.first_config_light + i].reset(new PointLight(
+                parse_float3(lights[i]["position"]),
+                parse_float3(lights[i]["color"])));
+        }
+        reload_type = "lights";
+    }
+
+    record_stamps(state);
+    if (!reload_type && !camera_changed) return false;
+    if (camera_changed) setup_camera(scene, state.node["camera"]);
+
+    auto end_reload = high_resolution_clock::now();
+    info("Scene reloaded in ", duration_cast<milliseconds>(end_reload - start_reload).count(), " ms (",
+         reload_type ? reload_type : "camera", camera_changed && reload_type ? " and camera" : "",
+         reloaded_meshes > 0 ? ", " : "", reloaded_meshes > 0 ? std::to_string(reloaded_meshes) + " meshes reloaded" : std::string(), ").");
+    validate_scene(scene);
+    return reload_type || camera_changed;
+}
+
+void Scene::update_geometry() {
+    if (compact_attributes) {
+        #pragma omp parallel for
+        for (int i = 0; i < (int)packed_face_normals.size(); i++) {
+            const float3& v0 = vertices[indices[i * 4 + 0]];
+            const float3& v1 = vertices[indices[i * 4 + 1]];
+            const float3& v2 = vertices[indices[i * 4 + 2]];
+            packed_face_normals[i] = pack_normal(normalize(cross(v1 - v0, v2 - v0)));
+        }
+    } else {
+        compute_face_normals(indices, vertices, face_normals, 0);
+    }
+
+    if (bvh.instance_count() == 0) {
+        bvh.update(vertices.data(), indices.data(), bvh_settings);
+    } else {
+        bool rebuilt = false;
+        for (int i = 0, n = mesh_bvhs.size(); i < n; i++)
+            rebuilt |= mesh_bvhs[i]->update(vertices.data(), indices.data() + mesh_bvh_tris[i] * 4, bvh_settings);
+
+        if (bvh_settings.leaf_order && rebuilt) {
+            // Rebuilding a bottom-level BVH may change its number of leaf slots, and thus the offsets of the instances
+            auto offsets = mesh_bvh_offsets(*this);
+            std::unordered_map<const Bvh*, int> mesh_bvh_ids;
+            for (int i = 0, n = mesh_bvhs.size(); i < n; i++) mesh_bvh_ids[mesh_bvhs[i].get()] = i;
+
+            std::vector<BvhInstance> instances(bvh.instance_count());
+            for (int i = 0, n = instances.size(); i < n; i++) {
+                instances[i] = bvh.instance(i);
+                instances[i].first_tri = offsets[mesh_bvh_ids[instances[i].bvh]];
+            }
+            bvh.build(instances.data(), instances.size(), bvh_settings);
+        } else {
+            bvh.update(bvh_settings);
+        }
+    }
+
+    if (bvh_settings.leaf_order) pack_shading_data(*this);
+}
@@ -12,6 +12,36 @@
 #include "float3.h"
 #include "float2.h"
 #include "bvh.h"
+#include "packing.h"
+#include "mapped_file.h"
+
+/// Shading data of a triangle, stored contiguously so that a hit only touches one record.
+struct ShadingTri {
+    float3 normals[3];      ///< Vertex normals
+    float3 face_normal;     ///< Geometric normal
+    float2 texcoords[3];    ///< Vertex texture coordinates
+    int material;           ///< Material index
+    float uv_scale;         ///< Ratio between lengths in texture space and in object space (see uv_scale())
+};
+
+/// Compressed version of ShadingTri, with octahedral normals and half-precision texture coordinates (36 bytes).
+struct PackedShadingTri {
+    uint32_t normals[3];    ///< Vertex normals (see pack_normal())
+    uint32_t face_normal;   ///< Geometric normal
+    uint32_t texcoords[3];  ///< Vertex texture coordinates (see pack_texcoords())
+    int material;           ///< Material index
+    float uv_scale;         ///< Ratio between lengths in texture space and in object space
+};
+
+/// Returns the ratio between lengths on a triangle in texture space and in object space, computed as the square root
+/// of the ratio of the areas of the triangle in both spaces. This converts the width of a ray footprint into texture space.
+inline float uv_scale(const float3& v0, const float3& v1, const float3& v2,
+                      const float2& t0, const float2& t1, const float2& t2) {
+    const float area = length(cross(v1 - v0, v2 - v0));
+    const float2 e1 = t1 - t0, e2 = t2 - t0;
+    const float uv_area = std::fabs(e1.x * e2.y - e1.y * e2.x);
+    return area > 0.0f ? std::sqrt(uv_area / area) : 0.0f;
+}
 
 struct Scene {
     template <typename T>
@@ -29,6 +59,9 @@ struct Scene {
 
     // Traversal data
     Bvh                         bvh;
+    BvhSettings                 bvh_settings;
+    unique_vector<Bvh>          mesh_bvhs;      ///< Bottom-level BVHs of the instanced meshes, when bvh is a two-level BVH
+    std::vector<int>            mesh_bvh_tris;  ///< Index of the first triangle of every bottom-level BVH
 
     // Mesh data
     std::vector<float3>         vertices;
@@ -38,37 +71,101 @@ struct Scene {
 
     std::vector<float3>         face_normals;
 
+    /// Shading data in the order of the BVH leaves, indexed by hit.tri when the BVH uses the leaf order setting
+    std::vector<ShadingTri>     shading_tris;
+
+    // Compressed shading data, replacing the normals, face normals, texture coordinates and shading records above
+    bool                        compact_attributes = false;
+    std::vector<uint32_t>       packed_normals;
+    std::vector<uint32_t>       packed_face_normals;
+    std::vector<uint32_t>       packed_texcoords;
+    std::vector<PackedShadingTri> packed_shading_tris;
+
+    // Scene cache
+    std::string                 cache_dir;      ///< Directory where the geometry and BVHs of scenes are cached (empty to disable the cache)
+    std::unique_ptr<MappedFile> cache_file;     ///< Cache file the BVHs were loaded from, which they use in place
+
     /// Returns the intersection point between a ray and the scene.
-    /// If not intersection is found, hit.tri == -1.
+    /// If not intersection is found, hit.tri == -1. With the leaf order setting, hit.tri is the index of the shading
+    /// record of the triangle, otherwise it is the index of the triangle.
     Hit intersect(const Ray& ray) const {
         Hit hit;
         bvh.traverse(ray, hit);
         return hit;
     }
 
+    /// Computes the intersection points between a packet of coherent rays and the scene, see Bvh::traverse_packet.
+    void intersect(const Ray* rays, Hit* hits, int n) const {
+        bvh.traverse_packet(rays, hits, n);
+    }
+
+    /// Updates the face normals and the BVH after the vertices have been moved (e.g. for an animation).
+    /// The BVH is refitted, or rebuilt if refitting degraded it too much. The vertex normals are left unchanged.
+    void update_geometry();
+
     /// Returns true if the given ray hits the scene.
     bool occluded(const Ray& ray) const {
-        Hit hit;
-        bvh.traverse(ray, hit, true);
-        return hit.tri >= 0;
+        return bvh.occluded(ray);
     }
 
     /// Returns the material associated with a hit point.
     const Material& material(const Hit& hit) const {
         assert(hit.tri >= 0);
+        if (bvh_settings.leaf_order)
+            return materials[compact_attributes ? packed_shading_tris[hit.tri].material : shading_tris[hit.tri].material];
         return materials[indices[hit.tri * 4 + 3]];
     }
 
-    /// Returns the surface parameters for a hit point.
-    SurfaceParams surface_params(const Ray& ray, const Hit& hit) const {
+    /// Returns the shading data of the triangle at a hit point, decompressed if needed. The normals are in object space.
+    ShadingTri shading_tri(const Hit& hit) const {
         assert(hit.tri >= 0);
-        int i0 = indices[hit.tri * 4 + 0];
-        int i1 = indices[hit.tri * 4 + 1];
-        int i2 = indices[hit.tri * 4 + 2];
+        if (bvh_settings.leaf_order && !compact_attributes) return shading_tris[hit.tri];
+
+        ShadingTri tri;
+        if (bvh_settings.leaf_order) {
+            auto& packed = packed_shading_tris[hit.tri];
+            for (int i = 0; i < 3; i++) {
+                tri.normals[i]   = unpack_normal(packed.normals[i]);
+                tri.texcoords[i] = unpack_texcoords(packed.texcoords[i]);
+            }
+            tri.face_normal = unpack_normal(packed.face_normal);
+            tri.material    = packed.material;
+            tri.uv_scale    = packed.uv_scale;
+            return tri;
+        }
+
+        const int* idx = &indices[hit.tri * 4];
+        for (int i = 0; i < 3; i++) {
+            tri.normals[i]   = compact_attributes ? unpack_normal(packed_normals[idx[i]]) : normals[idx[i]];
+            tri.texcoords[i] = compact_attributes ? unpack_texcoords(packed_texcoords[idx[i]]) : texcoords[idx[i]];
+        }
+        tri.face_normal = compact_attributes ? unpack_normal(packed_face_normals[hit.tri]) : face_normals[hit.tri];
+        tri.material    = idx[3];
+        tri.uv_scale    = uv_scale(vertices[idx[0]], vertices[idx[1]], vertices[idx[2]],
+                                   tri.texcoords[0], tri.texcoords[1], tri.texcoords[2]);
+        return tri;
+    }
 
-        auto& fn = face_normals[hit.tri];
-        auto n = normalize(lerp(normals[i0], normals[i1], normals[i2], hit.u, hit.v));
-        auto uv = lerp(texcoords[i0], texcoords[i1], texcoords[i2], hit.u, hit.v);
+    /// Returns the interpolated normal at a hit point, in world space.
+    float3 shading_normal(const Hit& hit) const {
+        return shading_normal(hit, shading_tri(hit));
+    }
+
+    /// Returns the surface parameters for a hit point, for point lookups in the textures.
+    SurfaceParams surface_params(const Ray& ray, const Hit& hit) const {
+        return surface_params(ray, hit, RayCone(0.0f, 0.0f));
+    }
+
+    /// Returns the surface parameters for a hit point, with the footprint of the ray on the surface, which is used
+    /// to filter the textures. The ray direction must be normalized.
+    SurfaceParams surface_params(const Ray& ray, const Hit& hit, const RayCone& cone) const {
+        auto tri = shading_tri(hit);
+        auto fn = tri.face_normal;
+        auto uv = lerp(tri.texcoords[0], tri.texcoords[1], tri.texcoords[2], hit.u, hit.v);
+
+        // The normals of instanced meshes are stored in the space of the mesh
+        if (hit.inst >= 0) fn = normalize(transform_normal(bvh.instance(hit.inst).to_local, fn));
+        auto n = shading_normal(hit, tri);
 
         // Compute the surface parameters, and make sure the face and per-vertex normal agree
         SurfaceParams surf;
@@ -77,11 +174,73 @@ struct Scene {
         surf.point = ray.org + ray.dir * hit.t;
         surf.coords = gen_local_coords(dot(ray.dir, n) <= 0 ? n : -n);
         surf.uv = uv;
+
+        // The footprint is stretched on surfaces seen at grazing angles, and the texture coordinates of instanced
+        // meshes are relative to the object space of the mesh
+        auto width = cone.width_at(hit.t) / std::max(std::fabs(dot(ray.dir, surf.face_normal)), 0.01f);
+        if (hit.inst >= 0) width *= length(transform_vector(bvh.instance(hit.inst).to_local, ray.dir));
+        surf.footprint = width * tri.uv_scale;
         return surf;
     }
+
+    /// Returns the interpolated normal at a hit point in world space, given the shading data of the triangle.
+    float3 shading_normal(const Hit& hit, const ShadingTri& tri) const {
+        auto n = lerp(tri.normals[0], tri.normals[1], tri.normals[2], hit.u, hit.v);
+        if (hit.inst >= 0) n = transform_normal(bvh.instance(hit.inst).to_local, n);
+        return normalize(n);
+    }
 };
 
 /// Load a scene from the given YAML configuration file.
 bool load_scene(const std::string& config, Scene& scene);
+/// Checks that a scene has geometry, lights and a camera, and reports an error otherwise.
+bool validate_scene(const Scene& scene);
+
+struct SceneStreamState;
+
+/// Loads the meshes of a scene in the background, so that the scene can be rendered while it is loading. Every mesh
+/// is added to the scene as a bottom-level BVH of a two-level BVH, which is rebuilt when new meshes arrive.
+class SceneStream {
+public:
+    SceneStream();
+    ~SceneStream();
+
+    SceneStream(const SceneStream&) = delete;
+    SceneStream& operator = (const SceneStream&) = delete;
+
+    /// Sets up the camera and the lights given in a YAML configuration file, and starts loading its meshes.
+    bool start(const std::string& config, Scene& scene);
+    /// Adds the meshes loaded since the last call to the scene, which must not be in use. Returns true if the scene has changed.
+    bool update(Scene& scene);
+    /// Returns true when all the meshes have been loaded and added to the scene.
+    bool done() const;
+
+private:
+    std::unique_ptr<SceneStreamState> state_;
+};
+
+struct SceneReloadState;
+
+/// Loads a scene and reloads it when the scene file, or the OBJ, MTL or texture files that it uses are modified. Only
+/// the parts of the scene that depend on the modified files are rebuilt: the meshes are kept in memory along with
+/// their BVHs, and the scene is made of one bottom-level BVH per mesh, so that only the modified meshes are reloaded.
+/// When only the vertices of the modified meshes have moved, their BVHs are refitted (see Scene::update_geometry()).
+class SceneReloader {
+public:
+    SceneReloader();
+    ~SceneReloader();
+
+    SceneReloader(const SceneReloader&) = delete;
+    SceneReloader& operator = (const SceneReloader&) = delete;
+
+    /// Loads the scene given in a YAML configuration file.
+    bool load(const std::string& config, Scene& scene);
+    /// Checks if the files of the scene have been modified, and updates the scene accordingly. The scene must not be
+    /// in use. Returns true if the scene has changed.
+    bool update(Scene& scene);
+
+private:
+    std::unique_ptr<SceneReloadState> state_;
+};
 
 #endif // SCENE_H
@@ -0,0 +1,124 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+/// Alignment of the arrays in binary files, so that they can be used in place from a memory mapping.
+static constexpr size_t binary_alignment = 64;
+
+/// Writes values and arrays of trivially copyable types to a binary stream.
+class BinaryWriter {
+public:
+    BinaryWriter(std::ostream& os) : os_(os), pos_(0) {}
+
+    template <typename T>
+    void write(const T& t) {
+        static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be written");
+        write_bytes(&t, sizeof(T));
+    }
+
+    /// Writes the number of elements of an array, followed by the elements, which start at an aligned position in the stream.
+    template <typename T>
+    void write_array(const T* data, size_t n) {
+        static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be written");
+        write(uint64_t(n));
+        static const char zeros[binary_alignment] = {};
+        write_bytes(zeros, (binary_alignment - pos_ % binary_alignment) % binary_alignment);
+        write_bytes(data, n * sizeof(T));
+    }
+
+    template <typename T>
+    void write_vector(const std::vector<T>& v) { write_array(v.data(), v.size()); }
+
+    void write_string(const std::string& s) {
+        write(uint64_t(s.size()));
+        write_bytes(s.data(), s.size());
+    }
+
+    /// Returns true if no error occurred while writing.
+    bool ok() const { return bool(os_); }
+
+private:
+    void write_bytes(const void* data, size_t size) {
+        os_.write(static_cast<const char*>(data), size);
+        pos_ += size;
+    }
+
+    std::ostream& os_;
+    size_t pos_;
+};
+
+/// Reads the data written by a BinaryWriter from a block of memory, which must be aligned on binary_alignment bytes.
+/// Arrays are not copied: the reader returns pointers to their elements in the block. Reading past the end of the
+/// block puts the reader in an error state, in which all the values that are read are zero and all the arrays empty.
+class BinaryReader {
+public:
+    BinaryReader(char* data, size_t size) : data_(data), size_(size), pos_(0), ok_(true) {}
+
+    template <typename T>
+    T read() {
+        static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be read");
+        T t;
+        if (!check(sizeof(T))) std::memset(static_cast<void*>(&t), 0, sizeof(T));
+        else std::memcpy(&t, data_ + pos_, sizeof(T));
+        pos_ += ok_ ? sizeof(T) : 0;
+        return t;
+    }
+
+    /// Reads an array and returns a pointer to its first element, or nullptr in case of error.
+    template <typename T>
+    T* read_array(size_t& n) {
+        n = read<uint64_t>();
+        pos_ += ok_ ? (binary_alignment - pos_ % binary_alignment) % binary_alignment : 0;
+        if (!ok_ || n > (size_ - std::min(pos_, size_)) / sizeof(T)) {
+            ok_ = false;
+            n = 0;
+            return nullptr;
+        }
+        T* ptr = reinterpret_cast<T*>(data_ + pos_);
+        pos_ += n * sizeof(T);
+        return ptr;
+    }
+
+    /// Reads an array and copies it into a vector.
+    template <typename T>
+    void read_vector(std::vector<T>& v) {
+        size_t n;
+        T* ptr = read_array<T>(n);
+        v.assign(ptr, ptr + n);
+    }
+
+    std::string read_string() {
+        const size_t n = read<uint64_t>();
+        if (!check(n)) return std::string();
+        std::string s(data_ + pos_, n);
+        pos_ += n;
+        return s;
+    }
+
+    /// Marks the data as invalid.
+    void fail() { ok_ = false; }
+    /// Returns true if no error occurred while reading.
+    bool ok() const { return ok_; }
+    /// Returns true if the whole block has been read.
+    bool at_end() const { return pos_ == size_; }
+
+private:
+    bool check(size_t n) {
+        ok_ = ok_ && pos_ <= size_ && n <= size_ - pos_;
+        return ok_;
+    }
+
+    char* data_;
+    size_t size_;
+    size_t pos_;
+    bool ok_;
+};
+
+#endif // SERIALIZE_H
@@ -0,0 +1,125 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define SIMD_AVX
+#include <immintrin.h>
+#endif
+
+/// Vector of N floats, used to process several boxes or triangles at once.
+/// The generic version is a plain loop, which is specialized below when SSE or AVX are available.
+template <int N>
+struct vfloat {
+    float v[N];
+
+    vfloat() {}
+    explicit vfloat(float f) { for (int i = 0; i < N; i++) v[i] = f; }
+
+    static vfloat load(const float* p) { vfloat r; for (int i = 0; i < N; i++) r.v[i] = p[i]; return r; }
+    /// Loads N unsigned bytes and converts them to floats.
+    static vfloat load(const uint8_t* p) { vfloat r; for (int i = 0; i < N; i++) r.v[i] = p[i]; return r; }
+    void store(float* p) const { for (int i = 0; i < N; i++) p[i] = v[i]; }
+
+    friend vfloat operator + (const vfloat& a, const vfloat& b) { vfloat r; for (int i = 0; i < N; i++) r.v[i] = a.v[i] + b.v[i]; return r; }
+    friend vfloat operator - (const vfloat& a, const vfloat& b) { vfloat r; for (int i = 0; i < N; i++) r.v[i] = a.v[i] - b.v[i]; return r; }
+    friend vfloat operator * (const vfloat& a, const vfloat& b) { vfloat r; for (int i = 0; i < N; i++) r.v[i] = a.v[i] * b.v[i]; return r; }
+    friend vfloat min(const vfloat& a, const vfloat& b) { vfloat r; for (int i = 0; i < N; i++) r.v[i] = std::min(a.v[i], b.v[i]); return r; }
+    friend vfloat max(const vfloat& a, const vfloat& b) { vfloat r; for (int i = 0; i < N; i++) r.v[i] = std::max(a.v[i], b.v[i]); return r; }
+
+    friend vfloat abs(const vfloat& a) { vfloat r; for (int i = 0; i < N; i++) r.v[i] = std::fabs(a.v[i]); return r; }
+    /// Returns a with the sign of the product a * b.
+    friend vfloat prodsign(const vfloat& a, const vfloat& b) { vfloat r; for (int i = 0; i < N; i++) r.v[i] = std::signbit(b.v[i]) ? -a.v[i] : a.v[i]; return r; }
+
+    /// Returns a bit mask where bit i is set if a[i] <= b[i].
+    friend int mask_le(const vfloat& a, const vfloat& b) { int m = 0; for (int i = 0; i < N; i++) m |= (a.v[i] <= b.v[i]) << i; return m; }
+    /// Returns a bit mask where bit i is set if a[i] < b[i].
+    friend int mask_lt(const vfloat& a, const vfloat& b) { int m = 0; for (int i = 0; i < N; i++) m |= (a.v[i] < b.v[i]) << i; return m; }
+};
+
+#ifdef SIMD_SSE
+template <>
+struct vfloat<4> {
+    __m128 v;
+
+    vfloat() {}
+    vfloat(__m128 v) : v(v) {}
+    explicit vfloat(float f) : v(_mm_set1_ps(f)) {}
+
+    static vfloat load(const float* p) { return _mm_loadu_ps(p); }
+    static vfloat load(const uint8_t* p) {
+        int32_t i;
+        std::memcpy(&i, p, sizeof(i));
+        const __m128i zero = _mm_setzero_si128();
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(i), zero), zero));
+    }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    friend vfloat operator + (const vfloat& a, const vfloat& b) { return _mm_add_ps(a.v, b.v); }
+    friend vfloat operator - (const vfloat& a, const vfloat& b) { return _mm_sub_ps(a.v, b.v); }
+    friend vfloat operator * (const vfloat& a, const vfloat& b) { return _mm_mul_ps(a.v, b.v); }
+    friend vfloat min(const vfloat& a, const vfloat& b) { return _mm_min_ps(a.v, b.v); }
+    friend vfloat max(const vfloat& a, const vfloat& b) { return _mm_max_ps(a.v, b.v); }
+
+    friend vfloat abs(const vfloat& a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+    friend vfloat prodsign(const vfloat& a, const vfloat& b) { return _mm_xor_ps(a.v, _mm_and_ps(b.v, _mm_set1_ps(-0.0f))); }
+
+    friend int mask_le(const vfloat& a, const vfloat& b) { return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v)); }
+    friend int mask_lt(const vfloat& a, const vfloat& b) { return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)); }
+};
+#endif // SIMD_SSE
+
+#ifdef SIMD_AVX
+template <>
+struct vfloat<8> {
+    __m256 v;
+
+    vfloat() {}
+    vfloat(__m256 v) : v(v) {}
+    explicit vfloat(float f) : v(_mm256_set1_ps(f)) {}
+
+    static vfloat load(const float* p) { return _mm256_loadu_ps(p); }
+    static vfloat load(const uint8_t* p) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i w = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), zero);
+        const __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero));
+        const __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(w, zero));
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+    }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+    friend vfloat operator + (const vfloat& a, const vfloat& b) { return _mm256_add_ps(a.v, b.v); }
+    friend vfloat operator - (const vfloat& a, const vfloat& b) { return _mm256_sub_ps(a.v, b.v); }
+    friend vfloat operator * (const vfloat& a, const vfloat& b) { return _mm256_mul_ps(a.v, b.v); }
+    friend vfloat min(const vfloat& a, const vfloat& b) { return _mm256_min_ps(a.v, b.v); }
+    friend vfloat max(const vfloat& a, const vfloat& b) { return _mm256_max_ps(a.v, b.v); }
+
+    friend vfloat abs(const vfloat& a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+    friend vfloat prodsign(const vfloat& a, const vfloat& b) { return _mm256_xor_ps(a.v, _mm256_and_ps(b.v, _mm256_set1_ps(-0.0f))); }
+
+    friend int mask_le(const vfloat& a, const vfloat& b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)); }
+    friend int mask_lt(const vfloat& a, const vfloat& b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+};
+#endif // SIMD_AVX
+
+/// Returns the index of the lowest bit set in a non-zero mask.
+inline int first_bit(int mask) {
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & (1 << i))) i++;
+    return i;
+#endif
+}
+
+#endif // SIMD_H
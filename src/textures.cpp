@@ -0,0 +1,60 @@
+#include "textures.h"
+
+/// Returns the weight of the pixel j of a row or column of the given size in the pixel i of the downsampled image,
+/// which covers an interval of size / half_size pixels. When the size is odd, the pixels at the boundary of two
+/// intervals are shared between them, so that every pixel contributes to the result.
+static float downsample_weight(int i, int j, int size, int half_size) {
+    const float scale = float(size) / half_size;
+    const float a = i * scale, b = (i + 1) * scale;
+    return std::max(std::min(float(j + 1), b) - std::max(float(j), a), 0.0f) / scale;
+}
+
+/// Halves the resolution of an image with a box filter. When the width and height are even, this averages blocks of
+/// 2x2 pixels, otherwise the blocks of the odd dimensions span 3 pixels, with a weight of 1/2 on the shared ones.
+static Image downsample(const Image& img) {
+    Image half(std::max(img.width / 2, 1), std::max(img.height / 2, 1));
+
+    #pragma omp parallel for
+    for (int y = 0; y < half.height; y++) {
+        const int y0 = 2 * y, y1 = std::min(2 * y + 2, img.height - 1);
+        for (int x = 0; x < half.width; x++) {
+            const int x0 = 2 * x, x1 = std::min(2 * x + 2, img.width - 1);
+            rgba sum(0.0f);
+            for (int j = y0; j <= y1; j++) {
+                const float wy = downsample_weight(y, j, img.height, half.height);
+                if (wy == 0.0f) continue;
+                const rgba* row = img.row(j);
+                for (int i = x0; i <= x1; i++)
+                    sum += row[i] * (wy * downsample_weight(x, i, img.width, half.width));
+            }
+            half(x, y) = sum;
+        }
+    }
+    return half;
+}
+
+void ImageTexture::store_level(const Image& img, Level& level) {
+    level.width   = img.width;
+    level.height  = img.height;
+    level.tiles_x = (img.width + tile_size - 1) / tile_size;
+    const int tiles_y = (img.height + tile_size - 1) / tile_size;
+    level.texels.resize(size_t(level.tiles_x) * tiles_y * tile_size * tile_size, rgba(0.0f));
+
+    #pragma omp parallel for
+    for (int y = 0; y < img.height; y++) {
+        const rgba* row = img.row(y);
+        for (int x = 0; x < img.width; x++)
+            level(x, y) = row[x];
+    }
+}
+
+ImageTexture::ImageTexture(Image&& img) {
+    // The first level is the image itself, and the next ones halve its resolution down to a single texel
+    Image cur = std::move(img);
+    while (true) {
+        levels.emplace_back();
+        store_level(cur, levels.back());
+        if (cur.width == 1 && cur.height == 1) break;
+        cur = downsample(cur);
+    }
+}
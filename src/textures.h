@@ -1,6 +1,10 @@
 #ifndef TEXTURES_H
 #define TEXTURES_H
 
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
 #include "color.h"
 #include "image.h"
 
@@ -8,47 +12,92 @@
 class Texture {
 public:
     virtual ~Texture() {}
-    virtual rgb operator () (float u, float v) const = 0;
+    /// Returns the value of the texture at (u, v), averaged over a footprint of the given width in texture space
+    /// (0 for a point lookup).
+    virtual rgb operator () (float u, float v, float footprint) const = 0;
 };
 
 /// Constant texture, returns the same value everywhere.
 class ConstantTexture : public Texture {
 public:
     ConstantTexture(const rgb& c) : color(c) {}
-    rgb operator () (float, float) const override final { return color; }
+    rgb operator () (float, float, float) const override final { return color; }
 
 private:
     rgb color;
 };
 
-/// Image-based texture, using bilinear filtering.
+/// Image-based texture, using trilinear filtering over a mip-map pyramid that is built when the texture is created.
+/// The level is chosen so that a texel covers the footprint of the lookup, and point lookups use bilinear filtering
+/// on the full-resolution image.
 class ImageTexture : public Texture {
 public:
-    ImageTexture(Image&& img) : img(img) {}
+    ImageTexture(Image&& img);
 
-    rgb operator () (float u, float v) const override final {
+    rgb operator () (float u, float v, float footprint) const override final {
         u = u - (int)u;
         u = u < 0.0f ? 1.0f + u : u;
         v = v - (int)v;
         v = v < 0.0f ? 1.0f + v : v;
         v = 1.0f - v;
-        auto kx = u * img.width;;
-        auto ky = v * img.height;
+
+        // Footprint in texels of the full-resolution image
+        const float texels = footprint * std::max(levels[0].width, levels[0].height);
+        if (texels <= 1.0f) return bilinear(levels[0], u, v);
+
+        const int last = levels.size() - 1;
+        const float lod = std::min(std::log2(texels), float(last));
+        const int l0 = lod;
+        const int l1 = std::min(l0 + 1, last);
+        return lerp(bilinear(levels[l0], u, v), bilinear(levels[l1], u, v), lod - l0);
+    }
+
+    /// Returns the number of levels of the mip-map pyramid.
+    int level_count() const { return levels.size(); }
+
+private:
+    static constexpr int tile_bits = 3;
+    static constexpr int tile_size = 1 << tile_bits;
+
+    /// Level of the mip-map pyramid. The texels are stored in tiles of 8x8 texels, each of them in Morton order, so
+    /// that the texels that are filtered together are close in memory.
+    struct Level {
+        std::vector<rgba> texels;
+        int width, height;
+        int tiles_x;
+
+        /// Spreads the lowest bits of a coordinate within a tile, so that there is a zero bit between each of them.
+        static int spread_bits(int x) {
+            return (x & 1) | ((x & 2) << 1) | ((x & 4) << 2);
+        }
+
+        /// Returns the index of a texel in the level.
+        size_t offset(int x, int y) const {
+            const size_t tile = (y >> tile_bits) * tiles_x + (x >> tile_bits);
+            return tile * tile_size * tile_size + (spread_bits(x & (tile_size - 1)) | (spread_bits(y & (tile_size - 1)) << 1));
+        }
+
+        const rgba& operator () (int x, int y) const { return texels[offset(x, y)]; }
+        rgba& operator () (int x, int y) { return texels[offset(x, y)]; }
+    };
+
+    static rgb bilinear(const Level& level, float u, float v) {
+        auto kx = u * level.width;
+        auto ky = v * level.height;
         auto fx = kx - (int)kx;
         auto fy = ky - (int)ky;
-        auto x0 = clamp((int)kx, 0, img.width - 1);
-        auto y0 = clamp((int)ky, 0, img.height - 1);
-        auto x1 = x0 + 1 >= img.width  ? 0 : x0 + 1;
-        auto y1 = y0 + 1 >= img.height ? 0 : y0 + 1;
-        return lerp(lerp(rgb(img(x0, y0)), rgb(img(x1, y0)), fx),
-                    lerp(rgb(img(x0, y1)), rgb(img(x1, y1)), fx),
+        auto x0 = clamp((int)kx, 0, level.width - 1);
+        auto y0 = clamp((int)ky, 0, level.height - 1);
+        auto x1 = x0 + 1 >= level.width  ? 0 : x0 + 1;
+        auto y1 = y0 + 1 >= level.height ? 0 : y0 + 1;
+        return lerp(lerp(rgb(level(x0, y0)), rgb(level(x1, y0)), fx),
+                    lerp(rgb(level(x0, y1)), rgb(level(x1, y1)), fx),
                     fy);
     }
 
-    const Image& image() const { return img; }
+    static void store_level(const Image& img, Level& level);
 
-private:
-    Image img;
+    std::vector<Level> levels;
 };
 
 #endif // TEXTURES_h
@@ -0,0 +1,100 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cmath>
+
+#include "float3.h"
+#include "float4.h"
+#include "common.h"
+
+/// Affine transformation, stored as the first three rows of a 4x4 matrix.
+struct Transform {
+    float4 rows[3];
+
+    Transform() {}
+    Transform(const float4& r0, const float4& r1, const float4& r2) {
+        rows[0] = r0;
+        rows[1] = r1;
+        rows[2] = r2;
+    }
+
+    static Transform identity() {
+        return Transform(float4(1, 0, 0, 0), float4(0, 1, 0, 0), float4(0, 0, 1, 0));
+    }
+
+    static Transform translation(const float3& t) {
+        return Transform(float4(1, 0, 0, t.x), float4(0, 1, 0, t.y), float4(0, 0, 1, t.z));
+    }
+
+    static Transform scaling(const float3& s) {
+        return Transform(float4(s.x, 0, 0, 0), float4(0, s.y, 0, 0), float4(0, 0, s.z, 0));
+    }
+
+    /// Rotation around the given axis, with an angle in degrees.
+    static Transform rotation(const float3& axis, float angle) {
+        const float3 a = normalize(axis);
+        const float c = std::cos(radians(angle));
+        const float s = std::sin(radians(angle));
+        const float k = 1.0f - c;
+        return Transform(
+            float4(c + a.x * a.x * k,       a.x * a.y * k - a.z * s, a.x * a.z * k + a.y * s, 0),
+            float4(a.y * a.x * k + a.z * s, c + a.y * a.y * k,       a.y * a.z * k - a.x * s, 0),
+            float4(a.z * a.x * k - a.y * s, a.z * a.y * k + a.x * s, c + a.z * a.z * k,       0));
+    }
+};
+
+/// Applies a transformation to a point.
+inline float3 transform_point(const Transform& t, const float3& p) {
+    return float3(dot(t.rows[0], float4(p, 1.0f)),
+                  dot(t.rows[1], float4(p, 1.0f)),
+                  dot(t.rows[2], float4(p, 1.0f)));
+}
+
+/// Applies a transformation to a direction, ignoring the translation.
+inline float3 transform_vector(const Transform& t, const float3& v) {
+    return float3(dot(t.rows[0], float4(v, 0.0f)),
+                  dot(t.rows[1], float4(v, 0.0f)),
+                  dot(t.rows[2], float4(v, 0.0f)));
+}
+
+/// Transforms a normal, given the inverse of the transformation applied to the geometry. The result is not normalized.
+inline float3 transform_normal(const Transform& inv, const float3& n) {
+    return float3(inv.rows[0].x * n.x + inv.rows[1].x * n.y + inv.rows[2].x * n.z,
+                  inv.rows[0].y * n.x + inv.rows[1].y * n.y + inv.rows[2].y * n.z,
+                  inv.rows[0].z * n.x + inv.rows[1].z * n.y + inv.rows[2].z * n.z);
+}
+
+/// Composes two transformations: the result applies b first, then a.
+inline Transform operator * (const Transform& a, const Transform& b) {
+    Transform r;
+    for (int i = 0; i < 3; i++) {
+        const float4& row = a.rows[i];
+        r.rows[i] = float4(row.x * b.rows[0].x + row.y * b.rows[1].x + row.z * b.rows[2].x,
+                           row.x * b.rows[0].y + row.y * b.rows[1].y + row.z * b.rows[2].y,
+                           row.x * b.rows[0].z + row.y * b.rows[1].z + row.z * b.rows[2].z,
+                           row.x * b.rows[0].w + row.y * b.rows[1].w + row.z * b.rows[2].w + row.w);
+    }
+    return r;
+}
+
+/// Computes the inverse of an affine transformation, which must not be singular.
+inline Transform inverse(const Transform& t) {
+    const float3 r0(t.rows[0]), r1(t.rows[1]), r2(t.rows[2]);
+
+    // The inverse of the linear part is the transposed matrix of cofactors, divided by the determinant
+    const float3 c0 = cross(r1, r2);
+    const float3 c1 = cross(r2, r0);
+    const float3 c2 = cross(r0, r1);
+    const float inv_det = 1.0f / dot(r0, c0);
+
+    Transform inv(float4(c0.x, c1.x, c2.x, 0) * inv_det,
+                  float4(c0.y, c1.y, c2.y, 0) * inv_det,
+                  float4(c0.z, c1.z, c2.z, 0) * inv_det);
+    const float3 tr = -transform_vector(inv, float3(t.rows[0].w, t.rows[1].w, t.rows[2].w));
+    inv.rows[0].w = tr.x;
+    inv.rows[1].w = tr.y;
+    inv.rows[2].w = tr.z;
+    return inv;
+}
+
+#endif // TRANSFORM_H